@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "bitmap.h"
+#include "metrics.h"
+
+
+// A running filter job.
+typedef struct {
+    pid_t pid;    // The child responding to the request, or 0 if unused.
+    long cost;
+} Job;
+
+// A request waiting for a job slot.
+typedef struct {
+    int client;   // Index into the event loop's client array.
+    long cost;
+    time_t queued_at;
+    unsigned long order;    // Arrival order, to break ties between costs.
+} QueuedJob;
+
+
+// Relative cost of each filter per pixel. Unknown filters get
+// DEFAULT_FILTER_WEIGHT.
+static const struct {
+    const char *name;
+    int weight;
+} filter_weights[] = {
+    {"copy", 1},
+    {"greyscale", 1},
+    {"gaussian_blur", 9},
+    {"edge_detection", 9},
+    {"convolve", 25},     // Depends on the kernel; this is for 5x5.
+};
+#define DEFAULT_FILTER_WEIGHT 4
+
+// Dimensions of the images costed so far, so that the event loop only reads
+// an image's header the first time it sees it. A name always refers to the
+// same bitmap, since uploads never replace an existing image. The cache is
+// direct-mapped on a hash of the name; longer names aren't cached.
+#define DIMENSION_CACHE_SIZE 256
+#define CACHED_NAME_SIZE 128
+
+typedef struct {
+    char image[CACHED_NAME_SIZE];   // Empty if the entry is unused.
+    int width;
+    int height;
+} CachedDimensions;
+
+static CachedDimensions dimension_cache[DIMENSION_CACHE_SIZE];
+
+static Job *jobs;
+static int max_jobs;
+static int num_jobs;
+
+static QueuedJob queue[MAX_QUEUED_JOBS];
+static int queue_len;
+static long queue_cost;
+static long queue_budget;
+static unsigned long queue_arrivals;
+
+
+void admission_init(int jobs_limit, long budget) {
+    if (jobs_limit <= 0) {
+        jobs_limit = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    max_jobs = jobs_limit;
+    queue_budget = budget;
+    jobs = calloc(max_jobs, sizeof(Job));
+    num_jobs = 0;
+    queue_len = 0;
+    queue_cost = 0;
+    metrics_gauge_add(GAUGE_JOB_SLOTS, max_jobs);
+}
+
+
+static int filter_weight(const char *filter) {
+    for (int i = 0; i < sizeof(filter_weights) / sizeof(filter_weights[0]); i++) {
+        if (strcmp(filter_weights[i].name, filter) == 0) {
+            return filter_weights[i].weight;
+        }
+    }
+    return DEFAULT_FILTER_WEIGHT;
+}
+
+
+/*
+ * Store the dimensions of the named image in *width and *height, reading
+ * them from its header unless they are cached. Return 0 on success, or -1
+ * if the image can't be read.
+ */
+static int image_dimensions(const char *image, int *width, int *height) {
+    unsigned long hash = 5381;
+    for (const char *c = image; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    CachedDimensions *entry = &dimension_cache[hash % DIMENSION_CACHE_SIZE];
+    if (strcmp(entry->image, image) == 0) {
+        *width = entry->width;
+        *height = entry->height;
+        return 0;
+    }
+
+    char path[MAXLINE];
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    if (read_bitmap_dimensions(path, width, height) < 0) {
+        return -1;
+    }
+    if (strlen(image) < CACHED_NAME_SIZE) {
+        strcpy(entry->image, image);
+        entry->width = *width;
+        entry->height = *height;
+    }
+    return 0;
+}
+
+
+long estimate_request_cost(const ReqData *req) {
+    if (strcmp(req->method, GET) != 0 || strcmp(req->path, IMAGE_FILTER) != 0) {
+        return 0;
+    }
+
+    const char *image = NULL;
+    const char *filter = NULL;
+    for (int i = 0; i < MAX_QUERY_PARAMS && req->params[i].name != NULL; i++) {
+        if (strcmp(req->params[i].name, "image") == 0) {
+            image = req->params[i].value;
+        } else if (strcmp(req->params[i].name, "filter") == 0) {
+            filter = req->params[i].value;
+        }
+    }
+    // Invalid requests are answered with an error right away.
+    if (image == NULL || filter == NULL || strchr(image, '/') != NULL) {
+        return 0;
+    }
+
+    int width, height;
+    if (image_dimensions(image, &width, &height) < 0) {
+        return 0;
+    }
+    return (long) width * height * filter_weight(filter);
+}
+
+
+int admission_can_start(long cost) {
+    return cost == 0 || num_jobs < max_jobs;
+}
+
+
+void admission_job_started(pid_t pid, long cost) {
+    if (cost == 0) {
+        return;
+    }
+    for (int i = 0; i < max_jobs; i++) {
+        if (jobs[i].pid == 0) {
+            jobs[i].pid = pid;
+            jobs[i].cost = cost;
+            num_jobs++;
+            metrics_gauge_add(GAUGE_RUNNING_JOBS, 1);
+            return;
+        }
+    }
+}
+
+
+void admission_job_finished(pid_t pid) {
+    for (int i = 0; i < max_jobs; i++) {
+        if (jobs[i].pid == pid) {
+            jobs[i].pid = 0;
+            num_jobs--;
+            metrics_gauge_add(GAUGE_RUNNING_JOBS, -1);
+            return;
+        }
+    }
+}
+
+
+int admission_enqueue(int client, long cost) {
+    if (queue_len == MAX_QUEUED_JOBS || queue_cost + cost > queue_budget) {
+        return -1;
+    }
+    queue[queue_len].client = client;
+    queue[queue_len].cost = cost;
+    queue[queue_len].queued_at = time(NULL);
+    queue[queue_len].order = queue_arrivals++;
+    queue_len++;
+    queue_cost += cost;
+    metrics_gauge_add(GAUGE_QUEUED_JOBS, 1);
+    return 0;
+}
+
+
+/*
+ * Remove the queue entry at index i, returning its client index.
+ */
+static int queue_remove(int i) {
+    int client = queue[i].client;
+    queue_cost -= queue[i].cost;
+    queue[i] = queue[--queue_len];
+    metrics_gauge_add(GAUGE_QUEUED_JOBS, -1);
+    return client;
+}
+
+
+int admission_dequeue(long *cost) {
+    if (queue_len == 0 || num_jobs >= max_jobs) {
+        return -1;
+    }
+    // Shortest job first, and first come first served among equal costs.
+    // The queue is short, so a linear scan is fine.
+    int best = 0;
+    for (int i = 1; i < queue_len; i++) {
+        if (queue[i].cost < queue[best].cost ||
+                (queue[i].cost == queue[best].cost &&
+                 queue[i].order < queue[best].order)) {
+            best = i;
+        }
+    }
+    *cost = queue[best].cost;
+    return queue_remove(best);
+}
+
+
+int admission_expire(void) {
+    time_t now = time(NULL);
+    for (int i = 0; i < queue_len; i++) {
+        if (now - queue[i].queued_at > MAX_QUEUE_WAIT) {
+            return queue_remove(i);
+        }
+    }
+    return -1;
+}
+
+
+int admission_retry_after(void) {
+    return 1 + queue_len / max_jobs;
+}
@@ -0,0 +1,74 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+#include <sys/types.h>
+#include "request.h"
+
+// Default number of filter jobs allowed to run at once, per event loop.
+// A value of 0 means "one per available CPU".
+#define DEFAULT_MAX_JOBS 0
+
+// Default total cost of the filter jobs allowed to wait in the queue.
+// Cost is measured in weighted pixels (width * height * filter weight).
+#define DEFAULT_QUEUE_BUDGET (64L * 1000 * 1000)
+
+// Queued requests that wait longer than this are shed with a 503.
+#define MAX_QUEUE_WAIT 10
+
+#define MAX_QUEUED_JOBS 64
+
+
+/*
+ * Set up admission control for at most max_jobs concurrent filter jobs
+ * and at most queue_budget total cost waiting in the queue.
+ */
+void admission_init(int max_jobs, long queue_budget);
+
+/*
+ * Return the estimated cost of responding to the request: width * height of
+ * the requested image times a per-filter weight. Requests that aren't
+ * filter jobs (main.html, uploads, errors) are cheap and cost 0.
+ */
+long estimate_request_cost(const ReqData *req);
+
+/*
+ * Return 1 if a job with the given cost can be started right now without
+ * exceeding the concurrency limit, and 0 otherwise. Cheap jobs always can.
+ */
+int admission_can_start(long cost);
+
+/*
+ * Record that the job with the given cost is running in process pid.
+ */
+void admission_job_started(pid_t pid, long cost);
+
+/*
+ * Record that process pid has exited. Does nothing if pid wasn't a job.
+ */
+void admission_job_finished(pid_t pid);
+
+/*
+ * Queue the client with the given index until a job slot is free.
+ * Return 0 on success, or -1 if the queue is over budget (the caller
+ * should shed the request).
+ */
+int admission_enqueue(int client, long cost);
+
+/*
+ * If a job slot is free, remove the cheapest queued client from the queue
+ * and return its index, storing its cost in *cost. Otherwise return -1.
+ */
+int admission_dequeue(long *cost);
+
+/*
+ * Remove one queued client that has waited longer than MAX_QUEUE_WAIT
+ * and return its index, or return -1 if there is none.
+ */
+int admission_expire(void);
+
+/*
+ * Return a suggested Retry-After value, in seconds, for shed requests.
+ */
+int admission_retry_after(void);
+
+#endif /* ADMISSION_H_ */
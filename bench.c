@@ -0,0 +1,575 @@
+/*
+ * Microbenchmarks for the request parser, the upload scanner and the
+ * image filters.
+ *
+ * Usage: microbench [-q] [-o results.tsv] [-b baseline.tsv] [-T tuning_profile]
+ *
+ * Each benchmark is run repeatedly for a while, and the fastest of a few
+ * trials is reported as ns/op, MB/s of input and, for filters, cycles per
+ * pixel (time stamp counter cycles, on x86).
+ *
+ * -o writes the results as tab-separated lines of
+ *     <name> <ns/op> <MB/s> <cycles/pixel>
+ * and -b compares this run against such a file from an earlier commit,
+ * flagging anything more than REGRESSION_PERCENT slower.
+ * -q skips the largest (4K and 8K) images, and -T runs the built-in
+ * kernels with the parameters in a profile written by image_server -T.
+ */
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "request.h"
+#include "bitmap.h"
+#include "log.h"
+#include "metrics.h"
+#include "kernels.h"
+#include "tuner.h"
+#include "sidecar.h"
+
+// Minimum time each trial runs for, and the number of trials.
+#define TRIAL_NS (200 * 1000000L)
+#define TRIALS 3
+
+#define REGRESSION_PERCENT 10
+
+#define MAX_RESULTS 256
+#define MAX_BENCH_NAME 64
+
+typedef struct {
+    char name[MAX_BENCH_NAME];
+    double ns_per_op;
+    double mb_per_s;
+    double cycles_per_pixel;
+} Result;
+
+static Result results[MAX_RESULTS];
+static int num_results;
+
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+static unsigned long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Run fn(arg) in batches for at least TRIAL_NS, TRIALS times, and record the
+ * fastest trial under the given name. bytes and pixels are the amount of
+ * input each call processes (0 if not meaningful).
+ */
+static void run_bench(const char *name, void (*fn)(void *), void *arg,
+                      long bytes, long pixels) {
+    // Warm up, and find a batch size that takes a measurable time.
+    long batch = 1;
+    while (1) {
+        long start = now_ns();
+        for (long i = 0; i < batch; i++) {
+            fn(arg);
+        }
+        if (now_ns() - start > TRIAL_NS / 20 || batch > (1L << 30)) {
+            break;
+        }
+        batch *= 2;
+    }
+
+    double best_ns = 0;
+    double best_cycles = 0;
+    for (int t = 0; t < TRIALS; t++) {
+        long ops = 0;
+        long start = now_ns();
+        unsigned long start_cycles = cycles();
+        long elapsed;
+        do {
+            for (long i = 0; i < batch; i++) {
+                fn(arg);
+            }
+            ops += batch;
+            elapsed = now_ns() - start;
+        } while (elapsed < TRIAL_NS);
+        double ns = (double) elapsed / ops;
+        if (t == 0 || ns < best_ns) {
+            best_ns = ns;
+            best_cycles = (double) (cycles() - start_cycles) / ops;
+        }
+    }
+
+    // Past MAX_RESULTS, results are still printed but not kept for -o and
+    // -c.
+    static int warned;
+    Result extra;
+    Result *r = &extra;
+    if (num_results < MAX_RESULTS) {
+        r = &results[num_results++];
+    } else if (!warned) {
+        fprintf(stderr, "microbench: more than %d results; the rest won't be "
+                "saved or compared\n", MAX_RESULTS);
+        warned = 1;
+    }
+    snprintf(r->name, MAX_BENCH_NAME, "%s", name);
+    r->ns_per_op = best_ns;
+    r->mb_per_s = bytes > 0 ? bytes / best_ns * 1e9 / 1e6 : 0;
+    r->cycles_per_pixel = pixels > 0 ? best_cycles / pixels : 0;
+    printf("%-40s %14.1f ns/op %10.1f MB/s", r->name, r->ns_per_op, r->mb_per_s);
+    if (pixels > 0) {
+        printf(" %10.2f cycles/px", r->cycles_per_pixel);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/******************************************************************************
+ * Request parsing
+ *****************************************************************************/
+
+#define START_LINE "GET /image-filter?image=dog.bmp&filter=gaussian_blur HTTP/1.1\r\n" \
+    "Host: localhost:51920\r\nUser-Agent: microbench\r\n\r\n"
+
+static ClientState bench_client;
+
+
+static void bench_find_newline(void *arg) {
+    const char *buf = arg;
+    // Search a header block for its last line, to scan something realistic.
+    volatile int where = find_network_newline(buf + 60, strlen(buf) - 60);
+    (void) where;
+}
+
+
+/*
+ * Free the request data parsed into the client, without closing anything.
+ */
+static void reset_client(ClientState *client) {
+    client->sock = -1;
+    remove_client(client);
+}
+
+
+static void bench_parse_start_line(void *arg) {
+    ClientState *client = arg;
+    strcpy(client->buf, START_LINE);
+    client->num_bytes = strlen(START_LINE);
+    parse_req_start_line(client);
+    reset_client(client);
+}
+
+
+static void bench_parse_query(void *arg) {
+    ReqData req;
+    memset(&req, 0, sizeof(req));
+    parse_query(&req, arg);
+    for (int i = 0; i < MAX_QUERY_PARAMS && req.params[i].name != NULL; i++) {
+        free(req.params[i].name);
+        free(req.params[i].value);
+    }
+}
+
+
+/******************************************************************************
+ * Upload scanning
+ *****************************************************************************/
+
+// The body of an upload request is served to the parser from a memfd, which
+// read() treats just like a socket that already has all the data.
+typedef struct {
+    int request_fd;       // The request, after its start line.
+    long request_size;
+    int null_fd;          // Where the uploaded file is written.
+    const char *stage;    // How far to go: "boundary", "filename" or "save".
+} UploadBench;
+
+
+static void bench_upload(void *arg) {
+    UploadBench *b = arg;
+    lseek(b->request_fd, 0, SEEK_SET);
+    bench_client.sock = b->request_fd;
+    bench_client.num_bytes = 0;
+    bench_client.reqData = NULL;
+
+    char *boundary = get_boundary(&bench_client);
+    if (strcmp(b->stage, "boundary") != 0) {
+        char *filename = get_bitmap_filename(&bench_client, boundary);
+        if (strcmp(b->stage, "save") == 0) {
+            UploadInfo info;
+            save_file_upload(&bench_client, boundary, b->null_fd, &info);
+        }
+        free(filename);
+    }
+    free(boundary);
+}
+
+
+/*
+ * Return a memfd holding the headers and body of an upload of the given
+ * bitmap, as they arrive after the start line.
+ */
+static int make_upload_request(int image_fd, long image_size, long *size) {
+    int fd = memfd_create("upload", 0);
+    dprintf(fd, "Host: localhost\r\n"
+            "Content-Type: multipart/form-data; boundary=bench-boundary\r\n"
+            "Content-Length: %ld\r\n\r\n"
+            "--bench-boundary\r\n"
+            "Content-Disposition: form-data; name=\"bitmap\"; filename=\"bench.bmp\"\r\n"
+            "Content-Type: image/bmp\r\n\r\n", image_size + 128);
+    off_t offset = 0;
+    while (offset < image_size) {
+        if (sendfile(fd, image_fd, &offset, image_size - offset) <= 0) {
+            perror("sendfile");
+            exit(1);
+        }
+    }
+    dprintf(fd, "\r\n--bench-boundary--\r\n");
+    *size = lseek(fd, 0, SEEK_END);
+    return fd;
+}
+
+
+/******************************************************************************
+ * Filters
+ *****************************************************************************/
+
+static const struct {
+    const char *name;
+    int width;
+    int height;
+    int large;
+} sizes[] = {
+    {"640x480", 640, 480, 0},
+    {"1080p", 1920, 1080, 0},
+    {"4k", 3840, 2160, 1},
+    {"8k", 7680, 4320, 1},
+};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+
+/*
+ * Load the test image for size s: dog.bmp if s is -1, or otherwise a
+ * synthetic bitmap of sizes[s]. Exit if this fails.
+ */
+static void load_test_image(int s, Image *image) {
+    if (s < 0) {
+        if (load_bitmap("dog.bmp", image) < 0) {
+            fprintf(stderr, "Couldn't load dog.bmp\n");
+            exit(1);
+        }
+        return;
+    }
+    if (create_bitmap(image, sizes[s].width, sizes[s].height) < 0) {
+        perror("create_bitmap");
+        exit(1);
+    }
+    for (int y = 0; y < image->height; y++) {
+        unsigned char *p = image->pixels + (size_t) image->stride * y;
+        for (int x = 0; x < image->width; x++) {
+            p[3 * x] = x * 255 / image->width;
+            p[3 * x + 1] = y * 255 / image->height;
+            p[3 * x + 2] = (x ^ y) & 0xff;
+        }
+    }
+}
+
+
+/*
+ * Return a memfd holding the image as a bitmap file.
+ */
+static int bitmap_memfd(const Image *image) {
+    int fd = memfd_create("bitmap", 0);
+    if (fd < 0 || write_bitmap(fd, image) < 0) {
+        perror("memfd");
+        exit(1);
+    }
+    return fd;
+}
+
+
+typedef struct {
+    int kernel;
+    Convolution conv;
+    KernelParams params;
+    const Image *src;
+    Image dst;
+} KernelBench;
+
+
+/*
+ * Run a built-in kernel on a decoded image; decoding and encoding are not
+ * included.
+ */
+static void bench_kernel(void *arg) {
+    KernelBench *b = arg;
+    run_kernel(b->kernel, b->src, &b->dst, &b->params);
+}
+
+
+static void bench_convolution(void *arg) {
+    KernelBench *b = arg;
+    run_convolution(&b->conv, b->src, &b->dst, &b->params);
+}
+
+
+// Convolutions covering each code path: the unrolled 3x3 and 5x5 loops,
+// a separable 5x5 kernel, and the general loops with a separable 7x7 one.
+static const struct {
+    const char *name;
+    const char *coefficients;
+} convolutions[] = {
+    {"sharpen3", "0,-1,0,-1,5,-1,0,-1,0"},
+    {"emboss5", "-1,-1,-1,-1,0,-1,-1,-1,0,1,-1,-1,0,1,1,-1,0,1,1,1,0,1,1,1,1"},
+    {"gaussian5", "1,4,6,4,1,4,16,24,16,4,6,24,36,24,6,4,16,24,16,4,1,4,6,4,1"},
+    {"box7", "1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,"
+             "1,1,1,1,1,1,1,1,1,1,1,1,1,1"},
+};
+#define NUM_CONVOLUTIONS (sizeof(convolutions) / sizeof(convolutions[0]))
+
+
+typedef struct {
+    char path[MAXLINE];
+    int image_fd;
+    int null_fd;
+} FilterBench;
+
+
+/*
+ * Run an external filter executable on the image, the way the server does.
+ * This includes the cost of starting the process.
+ */
+static void bench_filter(void *arg) {
+    FilterBench *b = arg;
+    lseek(b->image_fd, 0, SEEK_SET);
+    int pid = fork();
+    if (pid == 0) {
+        dup2(b->image_fd, STDIN_FILENO);
+        dup2(b->null_fd, STDOUT_FILENO);
+        execl(b->path, b->path, NULL);
+        _exit(1);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+
+/******************************************************************************
+ * Results
+ *****************************************************************************/
+
+static void write_results(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; i < num_results; i++) {
+        fprintf(out, "%s\t%.1f\t%.1f\t%.3f\n", results[i].name,
+                results[i].ns_per_op, results[i].mb_per_s,
+                results[i].cycles_per_pixel);
+    }
+    fclose(out);
+}
+
+
+static void compare_results(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return;
+    }
+    char name[MAX_BENCH_NAME];
+    double ns, mb, cpp;
+    int regressions = 0;
+    printf("\nCompared with %s:\n", path);
+    while (fscanf(in, "%63s %lf %lf %lf", name, &ns, &mb, &cpp) == 4) {
+        for (int i = 0; i < num_results; i++) {
+            if (strcmp(results[i].name, name) == 0) {
+                double change = (results[i].ns_per_op - ns) / ns * 100;
+                int slower = change > REGRESSION_PERCENT;
+                regressions += slower;
+                printf("%-40s %+8.1f%%%s\n", name, change,
+                       slower ? "  <-- regression" : "");
+            }
+        }
+    }
+    fclose(in);
+    printf("%d regression(s)\n", regressions);
+}
+
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    const char *baseline = NULL;
+    int quick = 0;
+    int opt;
+    const char *tuning_profile = NULL;
+    while ((opt = getopt(argc, argv, "qo:b:T:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quick = 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'T':
+            tuning_profile = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-o results.tsv] [-b baseline.tsv] "
+                    "[-T tuning_profile]\n", argv[0]);
+            exit(1);
+        }
+    }
+    // Keep the parser's request logging out of the measurements.
+    log_init(LOG_ERROR, 0);
+    if (metrics_init() < 0) {
+        exit(1);
+    }
+    tuner_init(tuning_profile);
+
+    char headers[] = START_LINE;
+    run_bench("find_network_newline", bench_find_newline, headers,
+              strlen(headers) - 60, 0);
+    run_bench("parse_req_start_line", bench_parse_start_line, &bench_client,
+              strlen(START_LINE), 0);
+    char start_line[] = START_LINE;
+    run_bench("parse_query", bench_parse_query, start_line,
+              strlen(start_line), 0);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    int dog_fd = open("dog.bmp", O_RDONLY);
+    struct stat st;
+    if (dog_fd < 0 || fstat(dog_fd, &st) < 0) {
+        perror("dog.bmp");
+        exit(1);
+    }
+    UploadBench upload = {.null_fd = null_fd};
+    upload.request_fd = make_upload_request(dog_fd, st.st_size, &upload.request_size);
+    const char *stages[] = {"boundary", "filename", "save"};
+    for (int i = 0; i < 3; i++) {
+        char name[MAX_BENCH_NAME];
+        snprintf(name, sizeof(name), "upload/%s/dog.bmp", stages[i]);
+        upload.stage = stages[i];
+        // Only saving consumes the whole request; the others stop at a header.
+        run_bench(name, bench_upload, &upload, i == 2 ? upload.request_size : 0, 0);
+    }
+
+    for (int s = -1; s < (int) NUM_SIZES; s++) {
+        if (s >= 0 && quick && sizes[s].large) {
+            continue;
+        }
+        const char *size_name = s < 0 ? "dog.bmp" : sizes[s].name;
+        Image image;
+        load_test_image(s, &image);
+        long pixels = (long) image.width * image.height;
+        long bytes = (long) image.stride * image.height;
+        char name[MAX_BENCH_NAME];
+
+        // Built-in kernels, with the tuned parameters and then with each
+        // variant of the code.
+        KernelBench kernel = {.src = &image};
+        if (create_bitmap_like(&kernel.dst, &image) < 0) {
+            perror("create_bitmap_like");
+            exit(1);
+        }
+        for (kernel.kernel = 0; kernel.kernel < KERNEL_COUNT; kernel.kernel++) {
+            kernel.params = *tuned_params(kernel.kernel);
+            snprintf(name, sizeof(name), "kernel/%s/%s", kernel_name(kernel.kernel),
+                     size_name);
+            run_bench(name, bench_kernel, &kernel, bytes, pixels);
+            for (int v = 0; v < VARIANT_COUNT; v++) {
+                if (!variant_supported(v)) {
+                    continue;
+                }
+                kernel.params.variant = v;
+                snprintf(name, sizeof(name), "kernel/%s:%s/%s",
+                         kernel_name(kernel.kernel), variant_name(v), size_name);
+                run_bench(name, bench_kernel, &kernel, bytes, pixels);
+            }
+        }
+        for (int c = 0; c < NUM_CONVOLUTIONS; c++) {
+            if (make_convolution(&kernel.conv, NULL, convolutions[c].coefficients,
+                                 NULL, NULL) < 0) {
+                continue;
+            }
+            kernel.params = *tuned_params(KERNEL_GAUSSIAN_BLUR);
+            for (int v = 0; v < VARIANT_COUNT; v++) {
+                if (!variant_supported(v)) {
+                    continue;
+                }
+                kernel.params.variant = v;
+                snprintf(name, sizeof(name), "convolve/%s:%s/%s", convolutions[c].name,
+                         variant_name(v), size_name);
+                run_bench(name, bench_convolution, &kernel, bytes, pixels);
+            }
+        }
+        free_bitmap(&kernel.dst);
+
+        // The same kernels on the sidecar layouts: top-down, cache-line
+        // aligned rows, with packed and padded pixels.
+        for (int ps = BMP_PIXEL_SIZE; ps <= 4; ps++) {
+            Image sidecar;
+            set_sidecar_pixel_size(ps);
+            if (convert_to_sidecar_layout(&image, &sidecar) < 0 ||
+                    create_bitmap_like(&kernel.dst, &sidecar) < 0) {
+                perror("convert_to_sidecar_layout");
+                exit(1);
+            }
+            kernel.src = &sidecar;
+            for (kernel.kernel = 0; kernel.kernel < KERNEL_COUNT; kernel.kernel++) {
+                kernel.params = *tuned_params(kernel.kernel);
+                snprintf(name, sizeof(name), "kernel/%s@%s/%s", kernel_name(kernel.kernel),
+                         ps == 4 ? "bgrx" : "bgr", size_name);
+                run_bench(name, bench_kernel, &kernel, bytes, pixels);
+            }
+            kernel.src = &image;
+            free_bitmap(&kernel.dst);
+            free_bitmap(&sidecar);
+        }
+
+        // External filters, including the cost of starting them.
+        FilterBench filter = {.null_fd = null_fd, .image_fd = bitmap_memfd(&image)};
+        DIR *dir = opendir(FILTER_DIR);
+        struct dirent *entry;
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            snprintf(filter.path, MAXLINE, "%s%s", FILTER_DIR, entry->d_name);
+            if (entry->d_name[0] == '.' || access(filter.path, X_OK) != 0) {
+                continue;
+            }
+            snprintf(name, sizeof(name), "filter/%.40s/%s", entry->d_name, size_name);
+            run_bench(name, bench_filter, &filter,
+                      lseek(filter.image_fd, 0, SEEK_END), pixels);
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+        close(filter.image_fd);
+        free_bitmap(&image);
+    }
+
+    if (output != NULL) {
+        write_results(output);
+    }
+    if (baseline != NULL) {
+        compare_results(baseline);
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+
+
+/*
+ * Read a little-endian 32-bit integer from buf.
+ */
+static int32_t read_le32(const unsigned char *buf) {
+    return (int32_t) ((uint32_t) buf[0] | ((uint32_t) buf[1] << 8) |
+                      ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24));
+}
+
+
+/*
+ * Write n as a little-endian 32-bit integer to buf.
+ */
+static void write_le32(unsigned char *buf, uint32_t n) {
+    buf[0] = n;
+    buf[1] = n >> 8;
+    buf[2] = n >> 16;
+    buf[3] = n >> 24;
+}
+
+
+int parse_bitmap_header(const unsigned char *header, int *pixel_array_offset,
+                        int *width, int *height) {
+    if (header[0] != 'B' || header[1] != 'M') {
+        return -1;
+    }
+    int bpp = header[BMP_BPP_OFFSET] | (header[BMP_BPP_OFFSET + 1] << 8);
+    if (bpp != 24) {
+        return -1;
+    }
+    *pixel_array_offset = read_le32(header + BMP_PIXEL_OFFSET_OFFSET);
+    *width = read_le32(header + BMP_WIDTH_OFFSET);
+    *height = read_le32(header + BMP_HEIGHT_OFFSET);
+    if (*width <= 0 || *height <= 0 || *pixel_array_offset < BMP_HEADER_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+
+long read_bitmap_file_size(const unsigned char *header) {
+    return (uint32_t) read_le32(header + BMP_FILE_SIZE_OFFSET);
+}
+
+
+int read_bitmap_dimensions(const char *path, int *width, int *height) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char header[BMP_HEADER_SIZE];
+    ssize_t n = read(fd, header, BMP_HEADER_SIZE);
+    close(fd);
+    if (n != BMP_HEADER_SIZE) {
+        return -1;
+    }
+    int offset;
+    return parse_bitmap_header(header, &offset, width, height);
+}
+
+
+/*
+ * Read exactly n bytes from fd at offset into buf.
+ * Return 0 on success, or -1 on an error or a short file.
+ */
+static int read_fully(int fd, void *buf, size_t n, off_t offset) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = pread(fd, (char *) buf + done, n - done, offset + done);
+        if (r <= 0) {
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+
+int load_bitmap(const char *path, Image *image) {
+    memset(image, 0, sizeof(*image));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char header[BMP_HEADER_SIZE];
+    int offset;
+    struct stat st;
+    if (read_fully(fd, header, BMP_HEADER_SIZE, 0) < 0 ||
+            parse_bitmap_header(header, &offset, &image->width, &image->height) < 0 ||
+            fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    image->stride = BMP_ROW_SIZE(image->width);
+    image->pixel_size = BMP_PIXEL_SIZE;
+    image->bottom_up = 1;
+    size_t pixels_size = (size_t) image->stride * image->height;
+    if (st.st_size < offset + (off_t) pixels_size) {
+        close(fd);
+        return -1;
+    }
+    image->header_size = offset;
+    image->header = malloc(offset);
+    image->pixels = malloc(pixels_size);
+    if (image->header == NULL || image->pixels == NULL ||
+            read_fully(fd, image->header, offset, 0) < 0 ||
+            read_fully(fd, image->pixels, pixels_size, offset) < 0) {
+        close(fd);
+        free_bitmap(image);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+
+void init_bitmap_header(unsigned char header[BMP_HEADER_SIZE], int width,
+                        int height) {
+    uint32_t pixels_size = BMP_ROW_SIZE(width) * height;
+    memset(header, 0, BMP_HEADER_SIZE);
+    header[0] = 'B';
+    header[1] = 'M';
+    write_le32(header + BMP_FILE_SIZE_OFFSET, BMP_HEADER_SIZE + pixels_size);
+    write_le32(header + BMP_PIXEL_OFFSET_OFFSET, BMP_HEADER_SIZE);
+    write_le32(header + 14, 40);                  // Size of the info header.
+    write_le32(header + BMP_WIDTH_OFFSET, width);
+    write_le32(header + BMP_HEIGHT_OFFSET, height);
+    header[26] = 1;                               // Number of colour planes.
+    header[BMP_BPP_OFFSET] = 24;
+    write_le32(header + 34, pixels_size);
+}
+
+
+int create_bitmap(Image *image, int width, int height) {
+    memset(image, 0, sizeof(*image));
+    image->width = width;
+    image->height = height;
+    image->stride = BMP_ROW_SIZE(width);
+    image->pixel_size = BMP_PIXEL_SIZE;
+    image->bottom_up = 1;
+    image->header_size = BMP_HEADER_SIZE;
+    image->header = malloc(BMP_HEADER_SIZE);
+    image->pixels = calloc(image->height, image->stride);
+    if (image->header == NULL || image->pixels == NULL) {
+        free_bitmap(image);
+        return -1;
+    }
+    init_bitmap_header(image->header, width, height);
+    return 0;
+}
+
+
+int create_bitmap_like(Image *dst, const Image *src) {
+    memset(dst, 0, sizeof(*dst));
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->stride = src->stride;
+    dst->pixel_size = src->pixel_size;
+    dst->bottom_up = src->bottom_up;
+    dst->header_size = src->header_size;
+    dst->header = malloc(src->header_size);
+    // Aligned like a sidecar's rows, and zeroed so that row padding is
+    // written out as zeros.
+    size_t pixels_size = (size_t) src->stride * src->height;
+    void *pixels = NULL;
+    if (dst->header == NULL || posix_memalign(&pixels, 64, pixels_size) != 0) {
+        free_bitmap(dst);
+        return -1;
+    }
+    dst->pixels = pixels;
+    memset(dst->pixels, 0, pixels_size);
+    memcpy(dst->header, src->header, src->header_size);
+    return 0;
+}
+
+
+/*
+ * Write all n bytes of buf to fd.
+ */
+static int write_fully(int fd, const void *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = write(fd, (const char *) buf + done, n - done);
+        if (w <= 0) {
+            return -1;
+        }
+        done += w;
+    }
+    return 0;
+}
+
+
+int write_bitmap(int fd, const Image *image) {
+    int row_size = BMP_ROW_SIZE(image->width);
+    if (write_fully(fd, image->header, image->header_size) < 0) {
+        return -1;
+    }
+    if (image->bottom_up && image->pixel_size == BMP_PIXEL_SIZE &&
+            image->stride == row_size) {
+        return write_fully(fd, image->pixels, (size_t) row_size * image->height);
+    }
+
+    // Convert to the file's layout, then write it all at once.
+    unsigned char *out = calloc(image->height, row_size);
+    if (out == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < image->height; i++) {
+        int y = image->bottom_up ? i : image->height - 1 - i;
+        const unsigned char *src = image->pixels + (size_t) image->stride * y;
+        unsigned char *dst = out + (size_t) row_size * i;
+        if (image->pixel_size == BMP_PIXEL_SIZE) {
+            memcpy(dst, src, BMP_PIXEL_SIZE * image->width);
+            continue;
+        }
+        for (int x = 0; x < image->width; x++) {
+            memcpy(dst + BMP_PIXEL_SIZE * x, src + image->pixel_size * x,
+                   BMP_PIXEL_SIZE);
+        }
+    }
+    int result = write_fully(fd, out, (size_t) row_size * image->height);
+    free(out);
+    return result;
+}
+
+
+void free_bitmap(Image *image) {
+    free(image->header);
+    if (image->mapping != NULL) {
+        munmap(image->mapping, image->mapping_size);
+    } else {
+        free(image->pixels);
+    }
+    image->header = NULL;
+    image->pixels = NULL;
+    image->mapping = NULL;
+}
@@ -0,0 +1,93 @@
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+// Byte offsets of fields in the headers of a bitmap file.
+#define BMP_FILE_SIZE_OFFSET 2
+#define BMP_PIXEL_OFFSET_OFFSET 10
+#define BMP_WIDTH_OFFSET 18
+#define BMP_HEIGHT_OFFSET 22
+#define BMP_BPP_OFFSET 28
+
+// Number of header bytes needed to read all of the fields above.
+#define BMP_HEADER_SIZE 54
+
+// Bytes per pixel (blue, green, red) and per row, which is padded to a
+// multiple of four bytes.
+#define BMP_PIXEL_SIZE 3
+#define BMP_ROW_SIZE(width) (((width) * BMP_PIXEL_SIZE + 3) & ~3)
+
+// A decoded 24-bit bitmap. Images loaded from a bitmap file keep the file's
+// layout (rows bottom-up, BGR pixels, rows padded to a multiple of four
+// bytes), so encoding them again is a copy; images mapped from a sidecar
+// (see sidecar.h) are top-down, may pad each pixel to four bytes, and have
+// rows aligned to cache lines.
+typedef struct {
+    int width;
+    int height;
+    int stride;               // Bytes from the start of one row to the next.
+    int pixel_size;           // BMP_PIXEL_SIZE, or 4 with a padding byte.
+    int bottom_up;            // 1 if the first row is the bottom one.
+    unsigned char *pixels;
+    unsigned char *header;    // Bitmap file headers to encode the image with.
+    int header_size;
+    void *mapping;            // The mapped file holding the pixels, if any.
+    size_t mapping_size;
+} Image;
+
+
+/*
+ * Read the pixel array offset, width and height from the first
+ * BMP_HEADER_SIZE bytes of a bitmap.
+ * Return 0 on success, or -1 if the data doesn't look like a 24-bit bitmap.
+ */
+int parse_bitmap_header(const unsigned char *header, int *pixel_array_offset,
+                        int *width, int *height);
+
+/*
+ * Return the file size recorded in the first BMP_HEADER_SIZE bytes of a
+ * bitmap.
+ */
+long read_bitmap_file_size(const unsigned char *header);
+
+/*
+ * Read the width and height of the bitmap stored at path.
+ * Return 0 on success, or -1 if the file can't be read or isn't a bitmap.
+ */
+int read_bitmap_dimensions(const char *path, int *width, int *height);
+
+/*
+ * Read the bitmap stored at path into image.
+ * Return 0 on success, or -1 if the file can't be read or isn't a bitmap.
+ */
+int load_bitmap(const char *path, Image *image);
+
+/*
+ * Initialize image as a bitmap of the given size with a minimal header and
+ * zeroed pixels. Return 0 on success, or -1 if memory runs out.
+ */
+int create_bitmap(Image *image, int width, int height);
+
+/*
+ * Write the headers of a bitmap file with the given size into header.
+ */
+void init_bitmap_header(unsigned char header[BMP_HEADER_SIZE], int width,
+                        int height);
+
+/*
+ * Initialize dst as a bitmap with the same size, layout and headers as src,
+ * ready for a filter to write its pixels. Return 0 on success, or -1.
+ */
+int create_bitmap_like(Image *dst, const Image *src);
+
+/*
+ * Write image to fd as a bitmap file, converting it from the layout it is
+ * held in if necessary. Return 0 on success, or -1 on an error.
+ */
+int write_bitmap(int fd, const Image *image);
+
+/*
+ * Free the memory held by image.
+ */
+void free_bitmap(Image *image);
+
+#endif /* BITMAP_H_ */
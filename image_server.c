@@ -1,3 +1,4 @@
+#define _GNU_SOURCE        /* sched_setaffinity, CPU_* macros */
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -7,11 +8,30 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <sched.h>         /* sched_setaffinity */
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
 #include <netinet/in.h>    /* Internet domain header */
 
 #include "socket.h"
 #include "request.h"
 #include "response.h"
+#include "admission.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include "perf.h"
+#include "tuner.h"
+#include "sidecar.h"
+#include "store.h"
+#include "warmer.h"
+#include "results.h"
+#include "remote.h"
+#include "uring.h"
+#include "imcache.h"
 
 #ifndef PORT
 #define PORT 30000
@@ -20,157 +40,922 @@
 #define BACKLOG 10
 #define MAX_CLIENTS 10
 
+// A worker that exits this soon after starting is taken to have failed to
+// start, and is restarted after a delay that doubles with each such exit.
+#define WORKER_QUICK_EXIT_MS 5000
+#define WORKER_MIN_BACKOFF_MS 100
+#define WORKER_MAX_BACKOFF_MS 30000
+
+// epoll_event.data.u32 value used for the listening socket; client sockets
+// are tagged with their index into the clients array instead.
+#define LISTEN_TAG ((uint32_t) -1)
+#define SIGNAL_TAG ((uint32_t) -2)
+// The io_uring loop tags its operations the same way, and its cancellations
+// with CANCEL_TAG.
+#define CANCEL_TAG ((uint32_t) -3)
+
+// Room in the io_uring loop's submission queue: a read per client, the
+// accept and the signalfd poll, and a cancellation per client.
+#define URING_ENTRIES (2 * MAX_CLIENTS + 2)
+
+// Default connection deadlines, in seconds.
+#define DEFAULT_HEADER_TIMEOUT 10   // From accept to a complete start line.
+#define DEFAULT_IDLE_TIMEOUT 5      // Between reads from the client.
+#define DEFAULT_BODY_TIMEOUT 60     // To receive a whole upload.
+
+#define TICKS_PER_SEC (1000 / TIMER_TICK_MS)
+
+static int header_timeout = DEFAULT_HEADER_TIMEOUT;
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static int body_timeout = DEFAULT_BODY_TIMEOUT;
+
+static int log_level = DEFAULT_LOG_LEVEL;
+static int log_rate = DEFAULT_LOG_RATE;
+
+static int max_jobs = DEFAULT_MAX_JOBS;
+static long queue_budget = DEFAULT_QUEUE_BUDGET;
+
+// Deadlines for the clients of this process's event loop.
+static TimerWheel wheel;
+
+// The event loop's ring, if it runs on io_uring (-u), and which clients
+// have a read into their buffer in flight. A client's slot isn't reused
+// until its read has completed.
+static Uring ring = {.fd = -1};
+static char read_pending[MAX_CLIENTS];
+
 
 /*
- * Read data from a client socket, and, if there is enough information to
- * determine the type of request, spawn a child process to respond to the
- * request.
- *
- * Return 1 if one of the conditions hold:
- *   a) No bytes were read from the socket. (The client has likely closed the
- *      connection.)
- *   b) A child process has been created to respond to the request.
- *
- * This return value indicates that the server process should close the socket.
- * Otherwise, return 0 (indicating that the server must continue to monitor the
- * socket).
- *
- * Complete this function according to the comments within.
- * Note that you'll be doing this incrementally, adding to the function as you
- * complete the different parts of the assignment.
- */
-int handle_client(ClientState *client) {
-    read_from_client(client);
-    parse_req_start_line(client);
-
-    // At this point client->reqData is not null, and so we are guaranteed
-    // to spawn a child process to handle the request (so we return 1).
-    // First, call fork. In the *parent* process, just return 1.
-    // In the *child* process, check the values in client->reqData to determine
-    // how to respond to the request.
-    // The child should call exit(0) (rather than return) to prevent it from
-    // executing the main server loop that listens for new requests.
+ * Respond to the request in client->reqData. This runs in the child
+ * process created by dispatch_client, and never returns.
+ */
+static void respond_to_client(ClientState *client) {
+    int route = metrics_route(client->reqData);
+    metrics_request_begin(client->accepted_ns, client->parsed_ns);
+    trace_request_begin(client->accepted_ns, client->first_byte_ns,
+                        client->parsed_ns);
+
+    if (route == ROUTE_MAIN_HTML) {
+        main_html_response(client->sock);
+    } else if (route == ROUTE_IMAGE_FILTER) {
+        image_filter_response(client->sock, client->reqData);
+    } else if (route == ROUTE_METRICS) {
+        metrics_response(client->sock);
+    } else if (route == ROUTE_TRACE) {
+        trace_response(client->sock);
+    } else if (route == ROUTE_IMAGE_UPLOAD) {
+        // The body is read here rather than in the event loop, so bound
+        // it with an idle timeout on each read and an overall alarm,
+        // which image_upload_response answers with a 408.
+        struct timeval idle = {idle_timeout, 0};
+        setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        alarm(body_timeout);
+        image_upload_response(client);
+    } else {
+        // No valid response
+        not_found_response(client->sock);
+    }
+    metrics_request_end(route);
+    trace_request_end(metrics_route_name(route), metrics_status());
+    exit(0);
+}
+
+
+/*
+ * Fork a child process to respond to the request of clients[index], and
+ * record it as a running job of the given cost.
+ * The parent should close its copy of the socket afterwards.
+ */
+static void dispatch_client(ClientState *clients, int index, long cost) {
     int result = fork();
-    if (result ==0){
-        // Checking if GET or POST
-        if (strcmp(client->reqData->method, GET)==0){
-            if (strcmp(client->reqData->path, MAIN_HTML)==0){
-                // Display html response
-                main_html_response(client->sock);
-                exit(0);
-            }else if (strcmp(client->reqData->path, IMAGE_FILTER)==0){
-                // Execute filter
-                image_filter_response(client->sock, client->reqData);
-                exit(0);
-            }
-
-        }else if (strcmp(client->reqData->method, POST)==0){
-            // Upload image
-            if (strcmp(client->reqData->path, IMAGE_UPLOAD)==0){
-                image_upload_response(client);
-                exit(0);
+    if (result == 0) {
+        // Drop the child's copies of the other clients' sockets, so that
+        // closing them in the parent really ends those connections.
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (i != index && clients[i].sock >= 0) {
+                close(clients[i].sock);
             }
         }
-        // No valid response
-        not_found_response(client->sock);
-        exit(0);
-    }else if (result >0){
-        return 1;
-    }else{
+        if (ring.fd >= 0) {
+            close(ring.fd);
+        }
+        // The event loop blocks SIGCHLD to receive it through a signalfd;
+        // don't pass that on to the child (or to the filters it runs).
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        respond_to_client(&clients[index]);
+    } else if (result > 0) {
+        admission_job_started(result, cost);
+        metrics_gauge_add(GAUGE_RUNNING_CHILDREN, 1);
+    } else {
         perror("fork");
         exit(1);
     }
-
-    close(client->sock);
-    exit(0);
 }
 
 
-int main(int argc, char **argv) {
-    ClientState *clients = init_clients(MAX_CLIENTS);
+// Return values for handle_client.
+#define CLIENT_PENDING 0   // Keep monitoring the socket.
+#define CLIENT_DONE 1      // Close the socket.
+#define CLIENT_QUEUED 2    // Stop monitoring, but keep the socket open.
 
-    struct sockaddr_in *servaddr = init_server_addr(PORT);
+/*
+ * Arm the client's timer for whichever comes first: its start line deadline
+ * or its idle deadline.
+ */
+static void arm_client_timer(ClientState *client) {
+    unsigned long expires = timer_now() + idle_timeout * TICKS_PER_SEC;
+    if (client->header_deadline < expires) {
+        expires = client->header_deadline;
+    }
+    timer_arm(&wheel, &client->timer, expires);
+}
 
-    // Create an fd to listen to new connections.
-    int listenfd = setup_server_socket(servaddr, BACKLOG);
 
-    // Print out information about this server
-    char host[MAX_HOSTNAME];
-    if ((gethostname(host, sizeof(host))) == -1) {
-        perror("gethostname");
+/*
+ * Queue an operation on the event loop's ring. The queue has room for
+ * everything the loop can have in flight, so running out is a bug.
+ */
+static struct io_uring_sqe *prep_uring(int op, int fd, const void *addr,
+                                       unsigned len, unsigned long user_data) {
+    struct io_uring_sqe *sqe = uring_prep(&ring, op, fd, addr, len, 0, user_data);
+    if (sqe == NULL) {
+        perror("io_uring_enter");
         exit(1);
     }
-    fprintf(stderr, "Server hostname: %s\n", host);
-    fprintf(stderr, "Port: %d\n", PORT);
+    return sqe;
+}
+
+
+/*
+ * Queue a read into the free end of clients[index]'s buffer, which is
+ * registered with the ring as buffer number index.
+ */
+static void prep_client_read(ClientState *clients, int index) {
+    ClientState *client = &clients[index];
+    struct io_uring_sqe *sqe = prep_uring(IORING_OP_READ_FIXED, client->sock,
+                                          &client->buf[client->num_bytes],
+                                          MAXLINE - 1 - client->num_bytes, index);
+    sqe->buf_index = index;
+    read_pending[index] = 1;
+}
 
-    // Set up the arguments for select
-    int maxfd = listenfd;
-    fd_set allset;
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
 
-    // Set up a timer for select (This is only necessary for debugging help)
-    struct timeval timer;
+/*
+ * Cancel the client's deadline and remove it from the client array.
+ */
+static void close_client(ClientState *client) {
+    timer_cancel(&wheel, &client->timer);
+    remove_client(client);
+    metrics_gauge_add(GAUGE_OPEN_CONNECTIONS, -1);
+}
+
+
+/*
+ * Answer the client with a 503 from the event loop itself.
+ */
+static void shed_client(ClientState *client) {
+    service_unavailable_response(client->sock, admission_retry_after());
+    metrics_add(COUNTER_SHED, 1);
+    metrics_count_request(metrics_route(client->reqData), 503,
+                          metrics_now_ns() - client->accepted_ns);
+}
 
 
+/*
+ * Timer wheel callback for a client that missed its deadline. arg is the
+ * clients array.
+ */
+static void expire_client(Timer *t, void *arg) {
+    ClientState *client = TIMER_CONTAINER(t, ClientState, timer);
+    int index = client - (ClientState *) arg;
+    if (read_pending[index]) {
+        // Closing the socket doesn't end a read in flight on it.
+        prep_uring(IORING_OP_ASYNC_CANCEL, -1, (void *) (unsigned long) index, 0,
+                   CANCEL_TAG);
+    }
+    request_timeout_response(client->sock);
+    metrics_add(COUNTER_TIMEOUTS, 1);
+    close_client(client);
+}
+
+
+/*
+ * Take the new connection on fd into a free client slot, and arm its
+ * deadline. Return the slot's index, or -1 if there is no free slot (the
+ * connection is then refused).
+ */
+static int add_client(ClientState *clients, int fd) {
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].sock < 0 && !read_pending[i]) {
+            break;
+        }
+    }
+    if (i == MAX_CLIENTS) {
+        // No free slot; refuse the connection.
+        close(fd);
+        return -1;
+    }
+    clients[i].sock = fd;
+    clients[i].accepted_ns = metrics_now_ns();
+    clients[i].first_byte_ns = 0;
+    metrics_add(COUNTER_CONNECTIONS, 1);
+    metrics_gauge_add(GAUGE_OPEN_CONNECTIONS, 1);
+    clients[i].header_deadline = timer_now() + header_timeout * TICKS_PER_SEC;
+    arm_client_timer(&clients[i]);
+    return i;
+}
+
+
+/*
+ * Process data newly read into the client buffer of clients[index], and,
+ * if there is enough information to determine the type of request, either
+ * spawn a child process to respond to the request, queue it until a job
+ * slot frees up, or shed it.
+ *
+ * Return CLIENT_DONE if a child process has been created to respond to
+ * the request, or if the server is too busy and has answered with a 503.
+ * Return CLIENT_QUEUED if the request is waiting in the admission queue,
+ * and CLIENT_PENDING if the start line hasn't fully arrived yet.
+ */
+static int process_client(ClientState *clients, int index) {
+    ClientState *client = &clients[index];
+    if (client->first_byte_ns == 0) {
+        client->first_byte_ns = metrics_now_ns();
+    }
+    if (!parse_req_start_line(client)) {
+        // A start line that doesn't fit in the buffer will never parse.
+        if (client->num_bytes == MAXLINE - 1) {
+            return CLIENT_DONE;
+        }
+        arm_client_timer(client);
+        return CLIENT_PENDING;
+    }
+    timer_cancel(&wheel, &client->timer);
+    client->parsed_ns = metrics_now_ns();
+
+    long cost = estimate_request_cost(client->reqData);
+    if (admission_can_start(cost)) {
+        dispatch_client(clients, index, cost);
+        return CLIENT_DONE;
+    }
+    if (admission_enqueue(index, cost) == 0) {
+        return CLIENT_QUEUED;
+    }
+    shed_client(client);
+    return CLIENT_DONE;
+}
+
+
+/*
+ * Read data from a client socket, and process it as process_client does.
+ * Return CLIENT_DONE if no bytes were read from the socket (the client has
+ * likely closed the connection), and otherwise what process_client returns.
+ */
+int handle_client(ClientState *clients, int index) {
+    if (read_from_client(&clients[index]) <= 0) {
+        return CLIENT_DONE;
+    }
+    return process_client(clients, index);
+}
+
+
+/*
+ * Reap any children that have finished responding to a request,
+ * releasing their job slots.
+ */
+static void reap_children(void) {
+    int status;
+    int pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (WIFSIGNALED(status)) {
+            log_msg(LOG_WARN, "Child [%d] failed with signal %d", pid,
+                    WTERMSIG(status));
+        }
+        admission_job_finished(pid);
+        metrics_gauge_add(GAUGE_RUNNING_CHILDREN, -1);
+    }
+}
+
+
+/*
+ * Start queued requests while job slots are free, and shed requests that
+ * have been queued for too long.
+ */
+static void run_admission_queue(ClientState *clients) {
+    int i;
+    long cost;
+    while ((i = admission_dequeue(&cost)) >= 0) {
+        dispatch_client(clients, i, cost);
+        close_client(&clients[i]);
+    }
+    while ((i = admission_expire()) >= 0) {
+        shed_client(&clients[i]);
+        close_client(&clients[i]);
+    }
+}
+
+
+/*
+ * The event loop on io_uring: the same as the epoll loop in run_event_loop,
+ * but with accepts, client reads and the signalfd poll submitted to a ring
+ * in one batch per turn of the loop, and client data read straight into the
+ * client buffers, which are registered with the ring.
+ * Returns only if the ring can't be set up.
+ */
+static void run_uring_loop(int listenfd, ClientState *clients, int sigfd) {
+    if (uring_init(&ring, URING_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        return;
+    }
+    struct iovec bufs[MAX_CLIENTS];
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        bufs[i].iov_base = clients[i].buf;
+        bufs[i].iov_len = MAXLINE;
+    }
+    if (uring_register_buffers(&ring, bufs, MAX_CLIENTS) < 0) {
+        uring_close(&ring);
+        return;
+    }
+    log_msg(LOG_INFO, "Event loop [%d] using io_uring", getpid());
+
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    struct io_uring_sqe *accept_sqe =
+        prep_uring(IORING_OP_ACCEPT, listenfd, &peer, 0, LISTEN_TAG);
+    accept_sqe->addr2 = (unsigned long) &peer_len;
+    struct io_uring_sqe *poll_sqe = prep_uring(IORING_OP_POLL_ADD, sigfd, NULL, 0, SIGNAL_TAG);
+    poll_sqe->poll32_events = POLLIN;
+
     // Main server loop.
     while (1) {
-        fd_set rset = allset;
-        timer.tv_sec = 2;
-        timer.tv_usec = 0;
-        int nready = select(maxfd + 1, &rset, NULL, NULL, &timer);
-        if(nready == -1) {
-            perror("select");
+        // Wake up every tick while any deadlines are pending, as in the
+        // epoll loop.
+        int timeout = wheel.num_armed > 0 ? TIMER_TICK_MS : 1000;
+        if (uring_submit(&ring, 1, timeout) < 0 && errno != ETIME && errno != EINTR) {
+            perror("io_uring_enter");
             exit(1);
         }
 
-        if(nready == 0) {  // timer expired
-            // Check if any children have failed
-            int status;
-            int pid;
-            errno = 0;
-            if((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-                if(WIFSIGNALED(status)) {
-                    fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
-                            WTERMSIG(status));
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&ring)) != NULL) {
+            uint32_t tag = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(&ring);
+
+            if (tag == CANCEL_TAG) {
+                continue;
+            }
+
+            if (tag == SIGNAL_TAG) {
+                struct signalfd_siginfo info;
+                while (read(sigfd, &info, sizeof(info)) > 0) {
+                }
+                poll_sqe = prep_uring(IORING_OP_POLL_ADD, sigfd, NULL, 0, SIGNAL_TAG);
+                poll_sqe->poll32_events = POLLIN;
+                continue;
+            }
+
+            if (tag == LISTEN_TAG) {    // New client connection.
+                if (res < 0) {
+                    errno = -res;
+                    perror("accept");
+                } else {
+                    log_connection(&peer);
+                }
+                // Accept the next one into peer only once this one is logged.
+                peer_len = sizeof(peer);
+                accept_sqe = prep_uring(IORING_OP_ACCEPT, listenfd, &peer, 0, LISTEN_TAG);
+                accept_sqe->addr2 = (unsigned long) &peer_len;
+                int i = res >= 0 ? add_client(clients, res) : -1;
+                if (i >= 0) {
+                    prep_client_read(clients, i);
                 }
+                continue;
+            }
+
+            // A read into the buffer of client tag has completed.
+            read_pending[tag] = 0;
+            if (clients[tag].sock < 0) {
+                continue;   // It timed out while the read was in flight.
+            }
+            int result = CLIENT_DONE;
+            if (res > 0) {
+                note_client_read(&clients[tag], res);
+                result = process_client(clients, tag);
+            }
+            if (result == CLIENT_DONE) {
+                close_client(&clients[tag]);
+            } else if (result == CLIENT_PENDING) {
+                prep_client_read(clients, tag);
             }
-            continue;
         }
 
+        timer_wheel_advance(&wheel, timer_now(), expire_client, clients);
+        reap_children();
+        run_admission_queue(clients);
+    }
+}
 
-        if (FD_ISSET(listenfd, &rset)) {    // New client connection.
-            int new_client_fd = accept_connection(listenfd);
-            if (new_client_fd >= 0) {
-                maxfd = (new_client_fd > maxfd) ? new_client_fd : maxfd;
-                FD_SET(new_client_fd, &allset);    // Add new descriptor to set.
 
-                for(int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].sock < 0) {
-                        clients[i].sock = new_client_fd;
-                        break;
-                    }
+/*
+ * Run the server's event loop on the given listening socket.
+ * The client table is allocated here, so each event loop owns its
+ * connections and their buffers outright. Never returns.
+ */
+static void run_event_loop(int listenfd) {
+    // Children forked by this loop log through its ring as well.
+    log_init(log_level, log_rate);
+    if (remote_enabled()) {
+        remote_pool_init();
+    }
+
+    ClientState *clients = init_clients(MAX_CLIENTS);
+    timer_wheel_init(&wheel, timer_now());
+    admission_init(max_jobs, queue_budget);
+
+    // Finished children free up job slots for queued requests, so
+    // SIGCHLD is delivered through the event loop as well.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    if (uring_enabled()) {
+        run_uring_loop(listenfd, clients, sigfd);
+        log_msg(LOG_WARN, "Event loop [%d] falling back to epoll", getpid());
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = LISTEN_TAG;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.data.u32 = SIGNAL_TAG;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_CLIENTS + 2];
+
+    // Main server loop.
+    while (1) {
+        // Wake up every tick while any deadlines are pending; otherwise the
+        // timeout only makes sure queued requests are eventually shed.
+        int timeout = wheel.num_armed > 0 ? TIMER_TICK_MS : 1000;
+        int nready = epoll_wait(epfd, events, MAX_CLIENTS + 2, timeout);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int e = 0; e < nready; e++) {
+            uint32_t tag = events[e].data.u32;
+
+            if (tag == SIGNAL_TAG) {
+                struct signalfd_siginfo info;
+                while (read(sigfd, &info, sizeof(info)) > 0) {
                 }
+                continue;
+            }
+
+            if (tag == LISTEN_TAG) {    // New client connection.
+                int new_client_fd = accept_connection(listenfd);
+                if (new_client_fd < 0) {
+                    continue;
+                }
+                int i = add_client(clients, new_client_fd);
+                if (i < 0) {
+                    continue;
+                }
+                ev.events = EPOLLIN;
+                ev.data.u32 = i;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_client_fd, &ev) < 0) {
+                    perror("epoll_ctl");
+                    close_client(&clients[i]);
+                }
+                continue;
+            }
+
+            int result = handle_client(clients, tag);
+            if (result == CLIENT_DONE) {
+                // A child may still hold the socket open, which would keep
+                // it in the epoll set after this process closes it.
+                epoll_ctl(epfd, EPOLL_CTL_DEL, clients[tag].sock, NULL);
+                close_client(&clients[tag]);
+            } else if (result == CLIENT_QUEUED) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, clients[tag].sock, NULL);
+            }
+        }
+
+        timer_wheel_advance(&wheel, timer_now(), expire_client, clients);
+        reap_children();
+        run_admission_queue(clients);
+    }
+}
+
+
+/*
+ * Pin the calling process to the n-th CPU (modulo the number of CPUs)
+ * that it is currently allowed to run on.
+ */
+static void pin_to_cpu(int n) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+    int count = CPU_COUNT(&allowed);
+    int target = n % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+                perror("sched_setaffinity");
+            } else {
+                log_msg(LOG_INFO, "Worker [%d] pinned to CPU %d", getpid(), cpu);
             }
+            return;
+        }
+    }
+}
+
+
+/*
+ * Fork a worker process for slot n. The worker pins itself to a CPU,
+ * binds its own SO_REUSEPORT listening socket and runs an independent
+ * event loop; the kernel spreads new connections across the workers.
+ * Return the worker's pid.
+ */
+static pid_t spawn_worker(int n, struct sockaddr_in *servaddr) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        pin_to_cpu(n);
+        int listenfd = setup_server_socket(servaddr, BACKLOG, 1);
+        run_event_loop(listenfd);
+    }
+    return pid;
+}
+
+
+static volatile sig_atomic_t shutting_down = 0;
+
+static void handle_shutdown(int sig) {
+    shutting_down = 1;
+}
+
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Start num_workers event-loop workers and restart any that die, backing
+ * off from workers that keep exiting right after they start.
+ * On SIGINT/SIGTERM, stop all workers and exit.
+ */
+static void supervise_workers(int num_workers, struct sockaddr_in *servaddr) {
+    pid_t *workers = malloc(sizeof(pid_t) * num_workers);
+    long *started_ms = malloc(sizeof(long) * num_workers);
+    long *restart_ms = malloc(sizeof(long) * num_workers);
+    long *backoff_ms = calloc(num_workers, sizeof(long));
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_shutdown;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = 0;
+        restart_ms[i] = 0;
+    }
 
-            nready -= 1;
+    while (!shutting_down) {
+        // Start the workers that are due, and find when the next one is.
+        long now = now_ms();
+        long next = -1;
+        for (int i = 0; i < num_workers; i++) {
+            if (workers[i] != 0) {
+                continue;
+            }
+            if (restart_ms[i] <= now) {
+                workers[i] = spawn_worker(i, servaddr);
+                started_ms[i] = now;
+            } else if (next < 0 || restart_ms[i] < next) {
+                next = restart_ms[i];
+            }
         }
 
-        // The nready is just an optimization; no harm in checking all fds
-        // except efficiency
-        for (int i = 0; i < MAX_CLIENTS && nready > 0; i++) {
-            // Check whether clients[i] has an active, ready socket.
-            if (clients[i].sock < 0 || !FD_ISSET(clients[i].sock, &rset)) {
+        int status;
+        pid_t pid;
+        if (next < 0) {
+            pid = wait(&status);
+        } else {
+            usleep((next - now) * 1000);
+            pid = waitpid(-1, &status, WNOHANG);
+        }
+        if (pid < 0) {
+            if (errno == EINTR) {
                 continue;
             }
+            perror("wait");
+            break;
+        }
+        now = now_ms();
+        for (int i = 0; i < num_workers; i++) {
+            if (pid == 0 || workers[i] != pid || shutting_down) {
+                continue;
+            }
+            if (now - started_ms[i] < WORKER_QUICK_EXIT_MS) {
+                backoff_ms[i] = backoff_ms[i] == 0 ? WORKER_MIN_BACKOFF_MS : backoff_ms[i] * 2;
+                if (backoff_ms[i] > WORKER_MAX_BACKOFF_MS) {
+                    backoff_ms[i] = WORKER_MAX_BACKOFF_MS;
+                }
+            } else {
+                backoff_ms[i] = 0;
+            }
+            log_msg(LOG_WARN, "Worker [%d] exited; restarting in %ld ms", pid,
+                    backoff_ms[i]);
+            workers[i] = 0;
+            restart_ms[i] = now + backoff_ms[i];
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i] != 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    free(workers);
+    free(started_ms);
+    free(restart_ms);
+    free(backoff_ms);
+    exit(0);
+}
+
 
-            int done = handle_client(&clients[i]);
-            if (done) {
-                FD_CLR(clients[i].sock, &allset);
-                remove_client(&clients[i]);
+/*
+ * Usage: image_server [-w num_workers] [-j max_jobs] [-q queue_budget]
+ *                     [-H header_timeout] [-I idle_timeout] [-B body_timeout]
+ *                     [-t trace_every] [-s trace_slow_ms]
+ *                     [-l log_level] [-r log_rate] [-P] [-T tuning_profile]
+ *                     [-F bgr|bgrx] [-U max_upload_mb] [-D max_dimension]
+ *                     [-W] [-p port] [-J] [-O host:port,...] [-u]
+ *                     [-M image_cache_mb] [-R max_result_mb]
+ *
+ * With -w, the server starts num_workers event-loop processes, one per CPU
+ * (a value of 0 means one per available CPU), each accepting on its own
+ * SO_REUSEPORT socket. Without it, a single event loop serves every client.
+ *
+ * -j limits the number of filter jobs each event loop runs at once, and
+ * -q limits the total cost (in millions of weighted pixels) of the jobs
+ * waiting for a slot; requests beyond that are answered with a 503.
+ *
+ * -H, -I and -B set the connection deadlines in seconds: the time allowed
+ * to send the start line, the longest gap between reads, and the time
+ * allowed to send an upload's body.
+ *
+ * -t traces one in every trace_every requests, and -s traces every request
+ * slower than trace_slow_ms; the traces are served from /trace.
+ *
+ * -l sets the minimum level logged (0 debug, 1 info, 2 warnings, 3 errors),
+ * and -r the most info and debug records logged per second.
+ *
+ * -P counts hardware events (cycles, instructions, cache and branch misses)
+ * around every filter run with perf_event_open, and adds per-filter totals
+ * to /metrics.
+ *
+ * -T reads the tile sizes, thread counts and code variants of the built-in
+ * filters from tuning_profile. If the file is missing or was made on
+ * different hardware, the filters are calibrated at startup first, and the
+ * results are saved there.
+ *
+ * -F sets the pixel layout of the sidecars that the built-in filters read
+ * (see sidecar.h): packed BGR (the default), or BGR padded to four bytes.
+ * Sidecars for every image are brought up to date at startup.
+ *
+ * -U and -D limit the size of uploads, in megabytes, and the width and
+ * height of uploaded bitmaps. Uploads are checked as they arrive, and the
+ * client gets a 413 as soon as one goes over.
+ *
+ * Filter results are kept in the result store, and while the server is
+ * idle a low-priority warmer fills it in for new and popular images (see
+ * warmer.h). -W turns the warmer off.
+ *
+ * -p sets the port to listen on. With -J, the server is a job worker: it
+ * runs filter jobs sent by other servers instead of serving HTTP. -O lists
+ * the job workers that this server sends filter jobs to (see remote.h).
+ *
+ * -u runs the event loops on io_uring instead of epoll, and has uploads
+ * received and written through it (see uring.h). The server falls back to
+ * epoll if the kernel doesn't support it.
+ *
+ * -M sets the memory, in megabytes, that every process shares to keep
+ * decoded source images in (see imcache.h); 0 turns the cache off.
+ *
+ * -R limits the size of the result store in megabytes; the least recently
+ * used results are evicted to stay under it (see results.h).
+ */
+int main(int argc, char **argv) {
+    int num_workers = -1;
+    int trace_every = 0;
+    int trace_slow_ms = 0;
+    int profile = 0;
+    int warm = 1;
+    int port = PORT;
+    int job_worker = 0;
+    int use_uring = 0;
+    long image_cache_mb = IMCACHE_DEFAULT_MB;
+    long max_result_mb = DEFAULT_RESULT_STORE_MB;
+    char *tuning_profile = NULL;
+    long max_upload_bytes = DEFAULT_MAX_UPLOAD_BYTES;
+    int max_dimension = DEFAULT_MAX_DIMENSION;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:j:q:H:I:B:t:s:l:r:PT:F:U:D:Wp:JO:uM:R:")) != -1) {
+        switch (opt) {
+        case 'w':
+            num_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'j':
+            max_jobs = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            queue_budget = strtol(optarg, NULL, 10) * 1000 * 1000;
+            break;
+        case 'H':
+            header_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'I':
+            idle_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'B':
+            body_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            trace_every = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            trace_slow_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            log_level = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            log_rate = strtol(optarg, NULL, 10);
+            break;
+        case 'P':
+            profile = 1;
+            break;
+        case 'T':
+            tuning_profile = optarg;
+            break;
+        case 'F':
+            if (strcmp(optarg, "bgr") == 0) {
+                set_sidecar_pixel_size(BMP_PIXEL_SIZE);
+            } else if (strcmp(optarg, "bgrx") == 0) {
+                set_sidecar_pixel_size(4);
+            } else {
+                fprintf(stderr, "Unknown pixel layout %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'U':
+            max_upload_bytes = strtol(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'D':
+            max_dimension = strtol(optarg, NULL, 10);
+            break;
+        case 'W':
+            warm = 0;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'J':
+            job_worker = 1;
+            break;
+        case 'O':
+            if (remote_add_workers(optarg) < 0) {
+                fprintf(stderr, "Invalid job worker list %s\n", optarg);
+                exit(1);
             }
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'M':
+            image_cache_mb = strtol(optarg, NULL, 10);
+            break;
+        case 'R':
+            max_result_mb = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w num_workers] [-j max_jobs] "
+                    "[-q queue_budget] [-H header_timeout] [-I idle_timeout] "
+                    "[-B body_timeout] [-t trace_every] [-s trace_slow_ms] "
+                    "[-l log_level] [-r log_rate] [-P] [-T tuning_profile] "
+                    "[-F bgr|bgrx] [-U max_upload_mb] [-D max_dimension] [-W] "
+                    "[-p port] [-J] [-O host:port,...] [-u] [-M image_cache_mb] "
+                    "[-R max_result_mb]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    set_upload_limits(max_upload_bytes, max_dimension);
+    if (use_uring) {
+        if (uring_probe()) {
+            uring_set_enabled(1);
+        } else {
+            fprintf(stderr, "io_uring is unavailable; using epoll\n");
+        }
+    }
+    if (num_workers == 0) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            num_workers = CPU_COUNT(&allowed);
+        } else {
+            num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+    }
 
-            nready -= 1;
+    // Shared by every worker and child, so it must be set up before forking.
+    metrics_init();
+    trace_init(trace_every, trace_slow_ms);
+    perf_init(profile);
+    tuner_init(tuning_profile);
+    // A job worker only has the images sent to it, so it leaves the image
+    // directory alone.
+    if (!job_worker) {
+        int imported = store_init(IMAGE_DIR);
+        if (imported > 0) {
+            log_msg(LOG_INFO, "Moved %d image(s) into the blob store", imported);
+        }
+        int made = scan_sidecars(IMAGE_DIR);
+        if (made > 0) {
+            log_msg(LOG_INFO, "Made %d image sidecar(s)", made);
         }
     }
+    results_init(max_result_mb);
+    imcache_init(image_cache_mb);
+    if (warm && !job_worker && warmer_init() == 0) {
+        warmer_start();
+    }
+
+    struct sockaddr_in *servaddr = init_server_addr(port);
+
+    // Print out information about this server
+    char host[MAX_HOSTNAME];
+    if ((gethostname(host, sizeof(host))) == -1) {
+        perror("gethostname");
+        exit(1);
+    }
+    fprintf(stderr, "Server hostname: %s\n", host);
+    fprintf(stderr, "Port: %d\n", port);
+
+    if (job_worker) {
+        fprintf(stderr, "Running as a job worker\n");
+        log_init(log_level, log_rate);
+        run_job_server(setup_server_socket(servaddr, BACKLOG, 0));
+    }
+
+    if (num_workers > 0) {
+        fprintf(stderr, "Workers: %d\n", num_workers);
+        supervise_workers(num_workers, servaddr);
+    }
+
+    // Create an fd to listen to new connections.
+    int listenfd = setup_server_socket(servaddr, BACKLOG, 0);
+    run_event_loop(listenfd);
 }
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE  // memfd_create, fallocate
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "imcache.h"
+#include "sidecar.h"
+#include "store.h"
+#include "metrics.h"
+#include "log.h"
+
+#define PAGE_ROUND(n) (((n) + 4095) & ~4095L)
+
+enum {
+    ENTRY_FREE,
+    ENTRY_LOADING,     // Being decoded by its loader.
+    ENTRY_READY,
+};
+
+typedef struct {
+    int state;
+    char blob[MAX_BLOB_PATH];
+    pid_t loader;
+    pid_t users[IMCACHE_MAX_USERS];   // 0 if the slot is free.
+    long offset;                      // Where the pixels are in the arena,
+    long size;                        // or a size of 0 if not yet placed.
+    int width;
+    int height;
+    int stride;
+    int pixel_size;
+    long last_use;                    // metrics_now_ns of the last get.
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    long capacity;
+    CacheEntry entries[IMCACHE_ENTRIES];
+} CacheTable;
+
+static CacheTable *table;
+static int arena_fd = -1;
+static unsigned char *arena;
+
+
+int imcache_init(long capacity_mb) {
+    if (capacity_mb <= 0) {
+        return 0;
+    }
+    long capacity = capacity_mb * 1024 * 1024;
+    arena_fd = memfd_create("image-cache", MFD_CLOEXEC);
+    if (arena_fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    // The memfd only takes up memory as pixels are written to it.
+    if (ftruncate(arena_fd, capacity) < 0) {
+        perror("ftruncate");
+        close(arena_fd);
+        arena_fd = -1;
+        return -1;
+    }
+    void *pixels = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        arena_fd, 0);
+    void *mem = mmap(NULL, sizeof(CacheTable), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pixels == MAP_FAILED || mem == MAP_FAILED) {
+        perror("mmap");
+        if (pixels != MAP_FAILED) {
+            munmap(pixels, capacity);
+        }
+        if (mem != MAP_FAILED) {
+            munmap(mem, sizeof(CacheTable));
+        }
+        close(arena_fd);
+        arena_fd = -1;
+        return -1;
+    }
+    arena = pixels;
+    table = mem;
+    table->capacity = capacity;
+    // Robust, since a process can be killed while holding the lock (the
+    // warmer kills its runs).
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+
+static void lock_table(void) {
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&table->lock);
+    }
+}
+
+
+static int alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/*
+ * Forget the users of e that have exited, and return the number left.
+ * The table must be locked.
+ */
+static int live_users(CacheEntry *e) {
+    int count = 0;
+    for (int i = 0; i < IMCACHE_MAX_USERS; i++) {
+        if (e->users[i] != 0) {
+            if (alive(e->users[i])) {
+                count++;
+            } else {
+                e->users[i] = 0;
+            }
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Record this process as a user of e. Return 0, or -1 if e has too many
+ * users. The table must be locked.
+ */
+static int add_user(CacheEntry *e) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < IMCACHE_MAX_USERS; i++) {
+            if (e->users[i] == 0) {
+                e->users[i] = getpid();
+                return 0;
+            }
+        }
+        live_users(e);
+    }
+    return -1;
+}
+
+
+/*
+ * Free e and the memory holding its pixels. The table must be locked.
+ */
+static void free_entry(CacheEntry *e) {
+    if (e->size > 0) {
+        fallocate(arena_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  e->offset, e->size);
+        metrics_gauge_add(GAUGE_IMAGE_CACHE_BYTES, -e->size);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+
+/*
+ * Return the entry that may be evicted to make room: one whose loader was
+ * killed, or else a ready one that no live process is using, scored by how
+ * long ago it was used times its size, so that old and large images go
+ * first. Return NULL if there is none.
+ * The table must be locked.
+ */
+static CacheEntry *pick_victim(long now) {
+    CacheEntry *victim = NULL;
+    double victim_score = -1;
+    for (int i = 0; i < IMCACHE_ENTRIES; i++) {
+        CacheEntry *e = &table->entries[i];
+        if (e->state == ENTRY_LOADING && !alive(e->loader)) {
+            return e;   // Abandoned part-way through loading.
+        }
+        if (e->state != ENTRY_READY || live_users(e) > 0) {
+            continue;
+        }
+        double score = (double) (now - e->last_use + 1) * e->size;
+        if (score > victim_score) {
+            victim = e;
+            victim_score = score;
+        }
+    }
+    return victim;
+}
+
+
+static int compare_offsets(const void *a, const void *b) {
+    long x = (*(CacheEntry * const *) a)->offset;
+    long y = (*(CacheEntry * const *) b)->offset;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Return the lowest offset in the arena with size free bytes, or -1.
+ * The table must be locked.
+ */
+static long find_space(long size) {
+    CacheEntry *placed[IMCACHE_ENTRIES];
+    int count = 0;
+    for (int i = 0; i < IMCACHE_ENTRIES; i++) {
+        if (table->entries[i].state != ENTRY_FREE && table->entries[i].size > 0) {
+            placed[count++] = &table->entries[i];
+        }
+    }
+    qsort(placed, count, sizeof(placed[0]), compare_offsets);
+    long start = 0;
+    for (int i = 0; i < count; i++) {
+        if (placed[i]->offset - start >= size) {
+            return start;
+        }
+        start = placed[i]->offset + placed[i]->size;
+    }
+    return table->capacity - start >= size ? start : -1;
+}
+
+
+/*
+ * Place e's pixels in the arena, evicting other entries until they fit.
+ * Return 0, or -1 if they can't fit. The table must be locked.
+ */
+static int place_entry(CacheEntry *e, long size, long now) {
+    if (size > table->capacity) {
+        return -1;
+    }
+    long offset;
+    while ((offset = find_space(size)) < 0) {
+        CacheEntry *victim = pick_victim(now);
+        if (victim == NULL) {
+            return -1;
+        }
+        log_msg(LOG_DEBUG, "Evicting %s from the image cache", victim->blob);
+        free_entry(victim);
+        metrics_add(COUNTER_IMAGE_CACHE_EVICTIONS, 1);
+    }
+    e->offset = offset;
+    e->size = size;
+    metrics_gauge_add(GAUGE_IMAGE_CACHE_BYTES, size);
+    return 0;
+}
+
+
+/*
+ * Decode the image at image_path into image, with its own copy of the
+ * pixels. Return 0, or -1.
+ */
+static int load_image(const char *image_path, Image *image) {
+    if (open_sidecar(image_path, image, NULL) == 0) {
+        return 0;
+    }
+    log_msg(LOG_DEBUG, "No sidecar for %s; decoding it", image_path);
+    return load_bitmap(image_path, image);
+}
+
+
+/*
+ * Point image at the pixels of the ready entry e.
+ * Return 0, or -1 if memory runs out.
+ */
+static int fill_image(const CacheEntry *e, Image *image) {
+    memset(image, 0, sizeof(*image));
+    image->header = malloc(BMP_HEADER_SIZE);
+    if (image->header == NULL) {
+        return -1;
+    }
+    image->width = e->width;
+    image->height = e->height;
+    image->stride = e->stride;
+    image->pixel_size = e->pixel_size;
+    image->bottom_up = 0;
+    image->pixels = arena + e->offset;
+    image->header_size = BMP_HEADER_SIZE;
+    init_bitmap_header(image->header, image->width, image->height);
+    return 0;
+}
+
+
+/*
+ * Return the entry for blob, waiting for another process to finish loading
+ * it, or else a free entry for this process to load it into, evicting an
+ * image if the table is full. Return NULL if nothing can be evicted.
+ * The table must be locked; it is unlocked while waiting.
+ */
+static CacheEntry *find_entry(const char *blob) {
+    while (1) {
+        CacheEntry *unused = NULL;
+        CacheEntry *found = NULL;
+        for (int i = 0; i < IMCACHE_ENTRIES; i++) {
+            CacheEntry *e = &table->entries[i];
+            if (e->state == ENTRY_FREE) {
+                if (unused == NULL) {
+                    unused = e;
+                }
+            } else if (strcmp(e->blob, blob) == 0) {
+                found = e;
+                break;
+            }
+        }
+        if (found == NULL) {
+            if (unused == NULL) {
+                unused = pick_victim(metrics_now_ns());
+                if (unused != NULL) {
+                    free_entry(unused);
+                    metrics_add(COUNTER_IMAGE_CACHE_EVICTIONS, 1);
+                }
+            }
+            return unused;
+        }
+        if (found->state == ENTRY_READY) {
+            return found;
+        }
+        if (!alive(found->loader)) {
+            // Its loader was killed part-way; load it again.
+            free_entry(found);
+            continue;
+        }
+        pthread_mutex_unlock(&table->lock);
+        usleep(IMCACHE_WAIT_US);
+        lock_table();
+    }
+}
+
+
+int imcache_get(const char *image_path, Image *image) {
+    char blob[MAX_BLOB_PATH];
+    if (table == NULL || store_blob_name(image_path, blob, sizeof(blob)) < 0) {
+        return load_image(image_path, image) == 0 ? IMCACHE_UNCACHED : IMCACHE_FAILED;
+    }
+
+    lock_table();
+    CacheEntry *e = find_entry(blob);
+    if (e != NULL && e->state == ENTRY_READY && add_user(e) == 0) {
+        e->last_use = metrics_now_ns();
+        pthread_mutex_unlock(&table->lock);
+        metrics_add(COUNTER_IMAGE_CACHE_HITS, 1);
+        if (fill_image(e, image) < 0) {
+            imcache_release(e - table->entries, image);
+            return IMCACHE_FAILED;
+        }
+        return e - table->entries;
+    }
+    if (e == NULL || e->state == ENTRY_READY) {
+        // The cache is full of images in use, or this one has too many
+        // users to keep track of.
+        pthread_mutex_unlock(&table->lock);
+        return load_image(image_path, image) == 0 ? IMCACHE_UNCACHED : IMCACHE_FAILED;
+    }
+    // Claim the entry, and decode the image while other processes wait.
+    strcpy(e->blob, blob);
+    e->state = ENTRY_LOADING;
+    e->loader = getpid();
+    e->users[0] = getpid();
+    pthread_mutex_unlock(&table->lock);
+    metrics_add(COUNTER_IMAGE_CACHE_MISSES, 1);
+
+    Image decoded;
+    if (load_image(image_path, &decoded) < 0) {
+        lock_table();
+        free_entry(e);
+        pthread_mutex_unlock(&table->lock);
+        return IMCACHE_FAILED;
+    }
+    int stride, pixel_size;
+    sidecar_layout(decoded.width, &stride, &pixel_size);
+    long size = PAGE_ROUND((long) stride * decoded.height);
+
+    lock_table();
+    e->last_use = metrics_now_ns();
+    int placed = place_entry(e, size, e->last_use);
+    if (placed < 0) {
+        free_entry(e);
+    }
+    pthread_mutex_unlock(&table->lock);
+    if (placed < 0) {
+        // Too large for what can be evicted: use the decoded copy.
+        *image = decoded;
+        return IMCACHE_UNCACHED;
+    }
+
+    copy_to_sidecar_layout(&decoded, arena + e->offset);
+    free_bitmap(&decoded);
+    lock_table();
+    e->width = decoded.width;
+    e->height = decoded.height;
+    e->stride = stride;
+    e->pixel_size = pixel_size;
+    e->state = ENTRY_READY;
+    pthread_mutex_unlock(&table->lock);
+    if (fill_image(e, image) < 0) {
+        imcache_release(e - table->entries, image);
+        return IMCACHE_FAILED;
+    }
+    return e - table->entries;
+}
+
+
+void imcache_release(int entry, Image *image) {
+    if (entry < 0) {
+        free_bitmap(image);
+        return;
+    }
+    free(image->header);
+    image->header = NULL;
+    image->pixels = NULL;
+    CacheEntry *e = &table->entries[entry];
+    pid_t pid = getpid();
+    lock_table();
+    for (int i = 0; i < IMCACHE_MAX_USERS; i++) {
+        if (e->users[i] == pid) {
+            e->users[i] = 0;
+            break;
+        }
+    }
+    e->last_use = metrics_now_ns();
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,47 @@
+#ifndef IMCACHE_H_
+#define IMCACHE_H_
+
+#include "bitmap.h"
+
+// A cache of decoded source images, shared by every process of the server.
+// The pixels live in one memfd, laid out like sidecars (see sidecar.h),
+// which is mapped before any workers are forked, so a hot image is decoded
+// once and then shared by every request that filters it, in any worker.
+//
+// Entries are keyed by blob (see store.h), so they never go stale. Each
+// records the processes using it; an entry that no live process is using
+// can be evicted when space runs out, oldest and largest first.
+#define IMCACHE_DEFAULT_MB 256
+#define IMCACHE_ENTRIES 256         // Images cached at once.
+#define IMCACHE_MAX_USERS 16        // Processes sharing an entry at once.
+#define IMCACHE_WAIT_US 500         // How often to check on another loader.
+
+// Returned by imcache_get when image holds its own copy of the pixels, or
+// when the image couldn't be decoded at all.
+#define IMCACHE_UNCACHED -1
+#define IMCACHE_FAILED -2
+
+
+/*
+ * Set up a cache holding up to capacity_mb megabytes of pixels; 0 turns it
+ * off. This must be called before any processes are forked.
+ * Return 0 on success, or -1 (images are then decoded by each request).
+ */
+int imcache_init(long capacity_mb);
+
+/*
+ * Decode the image at image_path into image, from the cache if it is
+ * there; otherwise from its sidecar or bitmap, adding it to the cache.
+ * The pixels are read-only.
+ * Return the cache entry holding the pixels, IMCACHE_UNCACHED if image has
+ * its own copy (if the image isn't in the blob store, or the cache is full
+ * or off), or IMCACHE_FAILED.
+ */
+int imcache_get(const char *image_path, Image *image);
+
+/*
+ * Release an image returned by imcache_get; entry is what it returned.
+ */
+void imcache_release(int entry, Image *image);
+
+#endif /* IMCACHE_H_ */
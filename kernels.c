@@ -0,0 +1,899 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "kernels.h"
+
+
+// Process the pixels [x0, x1) of one row. above and below are the rows
+// either side of it, or the row itself at the top and bottom edges, and
+// each pixel is ps bytes, of which the first BMP_PIXEL_SIZE are colours.
+typedef void (*RowFunction)(const unsigned char *above,
+                            const unsigned char *row,
+                            const unsigned char *below,
+                            unsigned char *out, int x0, int x1, int width,
+                            int ps);
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// The vector code is specialised for each pixel size, so that the offsets
+// to neighbouring pixels are constants.
+#define FOR_PIXEL_SIZE(ps, call) \
+    do { \
+        if ((ps) == 4) { \
+            call(4); \
+        } else { \
+            call(BMP_PIXEL_SIZE); \
+        } \
+    } while (0)
+
+
+/******************************************************************************
+ * Greyscale: each channel becomes the mean of the three.
+ *****************************************************************************/
+
+ALWAYS_INLINE void greyscale_span(const unsigned char *restrict row,
+                                  unsigned char *restrict out, int x0, int x1,
+                                  int ps) {
+    for (int x = x0; x < x1; x++) {
+        unsigned char grey = (row[ps * x] + row[ps * x + 1] + row[ps * x + 2]) / 3;
+        for (int c = 0; c < ps; c++) {
+            out[ps * x + c] = grey;
+        }
+    }
+}
+
+
+static void greyscale_row_scalar(const unsigned char *above,
+                                 const unsigned char *row,
+                                 const unsigned char *below,
+                                 unsigned char *out, int x0, int x1, int width,
+                                 int ps) {
+    for (int x = x0; x < x1; x++) {
+        unsigned char grey = (row[ps * x] + row[ps * x + 1] + row[ps * x + 2]) / 3;
+        for (int c = 0; c < ps; c++) {
+            out[ps * x + c] = grey;
+        }
+    }
+}
+
+#define GREYSCALE_SPAN(ps) greyscale_span(row, out, x0, x1, ps)
+
+static void greyscale_row_vector(const unsigned char *above,
+                                 const unsigned char *row,
+                                 const unsigned char *below,
+                                 unsigned char *out, int x0, int x1, int width,
+                                 int ps) {
+    FOR_PIXEL_SIZE(ps, GREYSCALE_SPAN);
+}
+
+
+/******************************************************************************
+ * 3x3 stencils: a Gaussian blur with weights 1 2 1 / 2 4 2 / 1 2 1 (over
+ * 16), and Sobel edge detection, |Gx| + |Gy| capped at 255. Both work on
+ * each channel separately and repeat the edge pixels beyond the border.
+ * Neither depends on which way up the rows are stored.
+ *****************************************************************************/
+
+ALWAYS_INLINE unsigned char blur_value(int a0, int a1, int a2, int r0, int r1,
+                                       int r2, int b0, int b1, int b2) {
+    return (a0 + 2 * a1 + a2 + 2 * (r0 + 2 * r1 + r2) + b0 + 2 * b1 + b2 + 8) >> 4;
+}
+
+
+ALWAYS_INLINE unsigned char edge_value(int a0, int a1, int a2, int r0, int r1,
+                                       int r2, int b0, int b1, int b2) {
+    int gx = (a2 - a0) + 2 * (r2 - r0) + (b2 - b0);
+    int gy = (b0 + 2 * b1 + b2) - (a0 + 2 * a1 + a2);
+    int magnitude = abs(gx) + abs(gy);
+    return magnitude > 255 ? 255 : magnitude;
+}
+
+
+/*
+ * Compute byte i of the output, where the neighbours to the left and right
+ * are left and right bytes away (a pixel, or 0 at the border).
+ */
+#define STENCIL(value, a, r, b, i, left, right) \
+    value(a[(i) - (left)], a[i], a[(i) + (right)], \
+          r[(i) - (left)], r[i], r[(i) + (right)], \
+          b[(i) - (left)], b[i], b[(i) + (right)])
+
+#define DEFINE_STENCIL_ROWS(name, value) \
+\
+static void name##_row_scalar(const unsigned char *a, const unsigned char *r, \
+                              const unsigned char *b, unsigned char *out, \
+                              int x0, int x1, int width, int ps) { \
+    for (int x = x0; x < x1; x++) { \
+        int left = x > 0 ? ps : 0; \
+        int right = x < width - 1 ? ps : 0; \
+        for (int c = 0; c < ps; c++) { \
+            out[ps * x + c] = STENCIL(value, a, r, b, ps * x + c, left, right); \
+        } \
+    } \
+} \
+\
+ALWAYS_INLINE void name##_span(const unsigned char *restrict a, \
+                               const unsigned char *restrict r, \
+                               const unsigned char *restrict b, \
+                               unsigned char *restrict out, \
+                               int x0, int x1, int width, int ps) { \
+    /* The border pixels need clamping; everything between them doesn't. */ \
+    if (x0 == 0) { \
+        name##_row_scalar(a, r, b, out, 0, 1, width, ps); \
+        x0 = 1; \
+    } \
+    int end = x1 < width - 1 ? x1 : width - 1; \
+    for (int i = ps * x0; i < ps * end; i++) { \
+        out[i] = STENCIL(value, a, r, b, i, ps, ps); \
+    } \
+    if (x1 == width && width > 1) { \
+        name##_row_scalar(a, r, b, out, width - 1, width, width, ps); \
+    } \
+} \
+\
+static void name##_row_vector(const unsigned char *a, const unsigned char *r, \
+                              const unsigned char *b, unsigned char *out, \
+                              int x0, int x1, int width, int ps) { \
+    FOR_PIXEL_SIZE(ps, name##_SPAN); \
+}
+
+#define blur_SPAN(ps) blur_span(a, r, b, out, x0, x1, width, ps)
+#define edge_SPAN(ps) edge_span(a, r, b, out, x0, x1, width, ps)
+
+DEFINE_STENCIL_ROWS(blur, blur_value)
+DEFINE_STENCIL_ROWS(edge, edge_value)
+
+
+/******************************************************************************
+ * Convolution with a kernel from the request (see Convolution in kernels.h).
+ * Rows are fed through a ring of the size rows around the current one, so
+ * each source row is prepared once: padded with copies of its edge pixels
+ * (so that the vector loops run over the border pixels too, without any
+ * clamping), or, for a separable kernel, run through the row pass.
+ *****************************************************************************/
+
+// Convolve the rows [y0, y1) of src into dst, with the ring in scratch.
+typedef void (*ConvolveFunction)(const Convolution *conv, const Image *src,
+                                 Image *dst, int y0, int y1, void *scratch);
+
+// Bytes in a row with r padding pixels either side, rounded up to keep
+// the rows of the ring aligned.
+#define PADDED_ROW_SIZE(width, r, ps) \
+    ((((size_t) (width) + 2 * (r)) * (ps) + 63) & ~(size_t) 63)
+
+
+ALWAYS_INLINE unsigned char clamp_byte(int value) {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+
+ALWAYS_INLINE void pad_row(const unsigned char *restrict row,
+                           unsigned char *restrict padded, int width, int r,
+                           int ps) {
+    memcpy(padded + r * ps, row, (size_t) width * ps);
+    for (int k = 0; k < r; k++) {
+        memcpy(padded + k * ps, row, ps);
+        memcpy(padded + (r + width + k) * ps, row + (width - 1) * ps, ps);
+    }
+}
+
+
+/*
+ * Convolve one row with the whole kernel. rows are the padded rows around
+ * it, top first, each pointing at its first pixel; acc holds len sums.
+ */
+ALWAYS_INLINE void convolve_span(const unsigned char *const *rows,
+                                 unsigned char *restrict out,
+                                 int *restrict acc, int len, int ps,
+                                 const Convolution *conv) {
+    int n = conv->size;
+    int r = n / 2;
+    int shift = conv->shift;
+    int offset = conv->offset;
+    int w[CONVOLVE_MAX_SIZE * CONVOLVE_MAX_SIZE];
+    memcpy(w, conv->weights, sizeof(w));
+
+#define TAP3(p, k) (w[k] * p[i - ps] + w[(k) + 1] * p[i] + w[(k) + 2] * p[i + ps])
+#define TAP5(p, k) (w[k] * p[i - 2 * ps] + w[(k) + 1] * p[i - ps] + w[(k) + 2] * p[i] + \
+                    w[(k) + 3] * p[i + ps] + w[(k) + 4] * p[i + 2 * ps])
+    if (n == 3) {
+        const unsigned char *restrict a = rows[0];
+        const unsigned char *restrict b = rows[1];
+        const unsigned char *restrict c = rows[2];
+        for (int i = 0; i < len; i++) {
+            out[i] = clamp_byte((offset + TAP3(a, 0) + TAP3(b, 3) + TAP3(c, 6)) >> shift);
+        }
+        return;
+    }
+    if (n == 5) {
+        const unsigned char *restrict a = rows[0];
+        const unsigned char *restrict b = rows[1];
+        const unsigned char *restrict c = rows[2];
+        const unsigned char *restrict d = rows[3];
+        const unsigned char *restrict e = rows[4];
+        for (int i = 0; i < len; i++) {
+            out[i] = clamp_byte((offset + TAP5(a, 0) + TAP5(b, 5) + TAP5(c, 10) +
+                                 TAP5(d, 15) + TAP5(e, 20)) >> shift);
+        }
+        return;
+    }
+#undef TAP3
+#undef TAP5
+
+    // Other sizes add up one coefficient at a time across the row.
+    for (int i = 0; i < len; i++) {
+        acc[i] = offset;
+    }
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < n; j++) {
+            int weight = w[n * k + j];
+            const unsigned char *restrict p = rows[k] + (j - r) * ps;
+            if (weight != 0) {
+                for (int i = 0; i < len; i++) {
+                    acc[i] += weight * p[i];
+                }
+            }
+        }
+    }
+    for (int i = 0; i < len; i++) {
+        out[i] = clamp_byte(acc[i] >> shift);
+    }
+}
+
+
+/*
+ * The row pass of a separable kernel, on one padded row.
+ */
+ALWAYS_INLINE void row_pass(const unsigned char *restrict p, int *restrict sums,
+                            int len, int ps, const Convolution *conv) {
+    int n = conv->size;
+    int r = n / 2;
+    int w[CONVOLVE_MAX_SIZE];
+    memcpy(w, conv->row_weights, sizeof(w));
+    if (n == 5) {
+        for (int i = 0; i < len; i++) {
+            sums[i] = w[0] * p[i - 2 * ps] + w[1] * p[i - ps] + w[2] * p[i] +
+                      w[3] * p[i + ps] + w[4] * p[i + 2 * ps];
+        }
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        sums[i] = 0;
+    }
+    for (int j = 0; j < n; j++) {
+        int weight = w[j];
+        const unsigned char *restrict q = p + (j - r) * ps;
+        for (int i = 0; i < len; i++) {
+            sums[i] += weight * q[i];
+        }
+    }
+}
+
+
+/*
+ * The column pass of a separable kernel, over the row sums around one row.
+ */
+ALWAYS_INLINE void column_pass(const int *const *rows, unsigned char *restrict out,
+                               int *restrict acc, int len,
+                               const Convolution *conv) {
+    int n = conv->size;
+    int shift = conv->shift;
+    int offset = conv->offset;
+    int w[CONVOLVE_MAX_SIZE];
+    memcpy(w, conv->column_weights, sizeof(w));
+    if (n == 5) {
+        const int *restrict a = rows[0];
+        const int *restrict b = rows[1];
+        const int *restrict c = rows[2];
+        const int *restrict d = rows[3];
+        const int *restrict e = rows[4];
+        for (int i = 0; i < len; i++) {
+            out[i] = clamp_byte((offset + w[0] * a[i] + w[1] * b[i] + w[2] * c[i] +
+                                 w[3] * d[i] + w[4] * e[i]) >> shift);
+        }
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        acc[i] = offset;
+    }
+    for (int k = 0; k < n; k++) {
+        int weight = w[k];
+        const int *restrict q = rows[k];
+        for (int i = 0; i < len; i++) {
+            acc[i] += weight * q[i];
+        }
+    }
+    for (int i = 0; i < len; i++) {
+        out[i] = clamp_byte(acc[i] >> shift);
+    }
+}
+
+
+/*
+ * The scalar versions clamp the neighbours of every pixel instead, and so
+ * read the source rows directly.
+ */
+static void convolve_row_scalar(const unsigned char *const *rows,
+                                unsigned char *out, int width, int ps,
+                                const Convolution *conv) {
+    int n = conv->size;
+    int r = n / 2;
+    for (int x = 0; x < width; x++) {
+        for (int c = 0; c < ps; c++) {
+            int sum = conv->offset;
+            for (int k = 0; k < n; k++) {
+                for (int j = 0; j < n; j++) {
+                    int sx = x + j - r < 0 ? 0 : x + j - r >= width ? width - 1 : x + j - r;
+                    sum += conv->weights[n * k + j] * rows[k][ps * sx + c];
+                }
+            }
+            out[ps * x + c] = clamp_byte(sum >> conv->shift);
+        }
+    }
+}
+
+
+static void row_pass_scalar(const unsigned char *row, int *sums, int width,
+                            int ps, const Convolution *conv) {
+    int n = conv->size;
+    int r = n / 2;
+    for (int x = 0; x < width; x++) {
+        for (int c = 0; c < ps; c++) {
+            int sum = 0;
+            for (int j = 0; j < n; j++) {
+                int sx = x + j - r < 0 ? 0 : x + j - r >= width ? width - 1 : x + j - r;
+                sum += conv->row_weights[j] * row[ps * sx + c];
+            }
+            sums[ps * x + c] = sum;
+        }
+    }
+}
+
+
+static void column_pass_scalar(const int *const *rows, unsigned char *out,
+                               int len, const Convolution *conv) {
+    for (int i = 0; i < len; i++) {
+        int sum = conv->offset;
+        for (int k = 0; k < conv->size; k++) {
+            sum += conv->column_weights[k] * rows[k][i];
+        }
+        out[i] = clamp_byte(sum >> conv->shift);
+    }
+}
+
+
+/*
+ * Return the bytes of scratch space a band needs for the ring.
+ */
+static size_t convolve_scratch_size(const Convolution *conv, int width, int ps) {
+    int n = conv->size;
+    // The padded rows, then the row sums, then a row of sums for the
+    // general loops.
+    return n * PADDED_ROW_SIZE(width, n / 2, ps) +
+           (n + 1) * (size_t) width * ps * sizeof(int);
+}
+
+
+ALWAYS_INLINE void convolve_rows(const Convolution *conv, const Image *src,
+                                 Image *dst, int y0, int y1, void *scratch,
+                                 int ps, int vector) {
+    int n = conv->size;
+    int r = n / 2;
+    int width = src->width;
+    int len = width * ps;
+    size_t padded_size = PADDED_ROW_SIZE(width, r, ps);
+    unsigned char *padded = scratch;
+    int *sums = (int *) (padded + n * padded_size);
+    int *acc = sums + (size_t) n * len;
+    // Source row sy is prepared into slot sy mod n.
+    const unsigned char *byte_ring[CONVOLVE_MAX_SIZE];
+    const int *sum_ring[CONVOLVE_MAX_SIZE];
+
+    for (int sy = y0 - r; sy < y1 + r; sy++) {
+        int slot = (sy + n) % n;
+        int clamped = sy < 0 ? 0 : sy >= src->height ? src->height - 1 : sy;
+        const unsigned char *row = src->pixels + (size_t) src->stride * clamped;
+        if (conv->separable) {
+            int *row_sums = sums + (size_t) slot * len;
+            if (vector) {
+                pad_row(row, padded, width, r, ps);
+                row_pass(padded + r * ps, row_sums, len, ps, conv);
+            } else {
+                row_pass_scalar(row, row_sums, width, ps, conv);
+            }
+            sum_ring[slot] = row_sums;
+        } else if (vector) {
+            unsigned char *p = padded + slot * padded_size;
+            pad_row(row, p, width, r, ps);
+            byte_ring[slot] = p + r * ps;
+        } else {
+            byte_ring[slot] = row;
+        }
+
+        // Once the last row it needs is ready, output row y can be made
+        // from the rows around it, ordered from the top of the image.
+        int y = sy - r;
+        if (y < y0) {
+            continue;
+        }
+        const unsigned char *byte_rows[CONVOLVE_MAX_SIZE];
+        const int *sum_rows[CONVOLVE_MAX_SIZE];
+        for (int k = 0; k < n; k++) {
+            int from_slot = (y - r + (src->bottom_up ? n - 1 - k : k) + 2 * n) % n;
+            byte_rows[k] = byte_ring[from_slot];
+            sum_rows[k] = sum_ring[from_slot];
+        }
+        unsigned char *out = dst->pixels + (size_t) dst->stride * y;
+        if (conv->separable) {
+            if (vector) {
+                column_pass(sum_rows, out, acc, len, conv);
+            } else {
+                column_pass_scalar(sum_rows, out, len, conv);
+            }
+        } else if (vector) {
+            convolve_span(byte_rows, out, acc, len, ps, conv);
+        } else {
+            convolve_row_scalar(byte_rows, out, width, ps, conv);
+        }
+    }
+}
+
+
+static void convolve_rows_scalar(const Convolution *conv, const Image *src,
+                                 Image *dst, int y0, int y1, void *scratch) {
+    convolve_rows(conv, src, dst, y0, y1, scratch, src->pixel_size, 0);
+}
+
+#define CONVOLVE_ROWS(ps) convolve_rows(conv, src, dst, y0, y1, scratch, ps, 1)
+
+static void convolve_rows_vector(const Convolution *conv, const Image *src,
+                                 Image *dst, int y0, int y1, void *scratch) {
+    FOR_PIXEL_SIZE(src->pixel_size, CONVOLVE_ROWS);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void greyscale_row_avx2(const unsigned char *above,
+                                    const unsigned char *row,
+                                    const unsigned char *below,
+                                    unsigned char *out, int x0, int x1, int width,
+                                    int ps) {
+    FOR_PIXEL_SIZE(ps, GREYSCALE_SPAN);
+}
+
+
+AVX2 static void blur_row_avx2(const unsigned char *a, const unsigned char *r,
+                               const unsigned char *b, unsigned char *out,
+                               int x0, int x1, int width, int ps) {
+    FOR_PIXEL_SIZE(ps, blur_SPAN);
+}
+
+
+AVX2 static void edge_row_avx2(const unsigned char *a, const unsigned char *r,
+                               const unsigned char *b, unsigned char *out,
+                               int x0, int x1, int width, int ps) {
+    FOR_PIXEL_SIZE(ps, edge_SPAN);
+}
+
+
+AVX2 static void convolve_rows_avx2(const Convolution *conv, const Image *src,
+                                    Image *dst, int y0, int y1, void *scratch) {
+    FOR_PIXEL_SIZE(src->pixel_size, CONVOLVE_ROWS);
+}
+#else
+#define greyscale_row_avx2 NULL
+#define blur_row_avx2 NULL
+#define edge_row_avx2 NULL
+#define convolve_rows_avx2 NULL
+#endif
+
+
+static const char *kernel_names[KERNEL_COUNT] = {
+    "greyscale", "gaussian_blur", "edge_detection"
+};
+static const char *variant_names[VARIANT_COUNT] = {
+    "scalar", "vector", "avx2"
+};
+
+static const RowFunction row_functions[KERNEL_COUNT][VARIANT_COUNT] = {
+    {greyscale_row_scalar, greyscale_row_vector, greyscale_row_avx2},
+    {blur_row_scalar, blur_row_vector, blur_row_avx2},
+    {edge_row_scalar, edge_row_vector, edge_row_avx2},
+};
+
+static const ConvolveFunction convolve_functions[VARIANT_COUNT] = {
+    convolve_rows_scalar, convolve_rows_vector, convolve_rows_avx2
+};
+
+
+int find_kernel(const char *name) {
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        if (strcmp(kernel_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+const char *kernel_name(int kernel) {
+    return kernel_names[kernel];
+}
+
+
+const char *variant_name(int variant) {
+    return variant_names[variant];
+}
+
+
+int find_variant(const char *name) {
+    for (int i = 0; i < VARIANT_COUNT; i++) {
+        if (strcmp(variant_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+int variant_supported(int variant) {
+    if (variant < 0 || variant >= VARIANT_COUNT) {
+        return 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (variant == VARIANT_AVX2) {
+        return __builtin_cpu_supports("avx2") != 0;
+    }
+#endif
+    return row_functions[0][variant] != NULL;
+}
+
+
+void default_kernel_params(KernelParams *params) {
+    params->variant = variant_supported(VARIANT_AVX2) ? VARIANT_AVX2 : VARIANT_VECTOR;
+    params->tile_rows = 64;
+    params->tile_cols = 0;
+    params->threads = 1;
+}
+
+
+// The rows [y0, y1) of an image, processed by one thread.
+typedef struct {
+    const Image *src;
+    Image *dst;
+    RowFunction function;
+    const KernelParams *params;
+    const Convolution *conv;    // For a convolution, instead of function.
+    void *scratch;
+    int y0;
+    int y1;
+    int threaded;
+} Band;
+
+
+static void *run_band(void *arg) {
+    Band *band = arg;
+    const Image *src = band->src;
+    int width = src->width;
+    int tile_cols = band->params->tile_cols > 0 ? band->params->tile_cols : width;
+    for (int ty = band->y0; ty < band->y1; ty += band->params->tile_rows) {
+        int ty_end = ty + band->params->tile_rows;
+        if (ty_end > band->y1) {
+            ty_end = band->y1;
+        }
+        for (int tx = 0; tx < width; tx += tile_cols) {
+            int tx_end = tx + tile_cols < width ? tx + tile_cols : width;
+            for (int y = ty; y < ty_end; y++) {
+                const unsigned char *row = src->pixels + (size_t) src->stride * y;
+                const unsigned char *above = y > 0 ? row - src->stride : row;
+                const unsigned char *below = y < src->height - 1 ? row + src->stride : row;
+                band->function(above, row, below,
+                               band->dst->pixels + (size_t) band->dst->stride * y,
+                               tx, tx_end, width, src->pixel_size);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static void *run_convolution_band(void *arg) {
+    Band *band = arg;
+    convolve_functions[band->params->variant](band->conv, band->src, band->dst,
+                                              band->y0, band->y1, band->scratch);
+    return NULL;
+}
+
+
+/*
+ * Split the rows of src into one band per thread, and run them.
+ * Return 0 on success, or -1 if memory runs out.
+ */
+static int run_bands(const Image *src, Image *dst, const KernelParams *params,
+                     RowFunction function, const Convolution *conv,
+                     size_t scratch_size, void *(*run)(void *)) {
+    int threads = params->threads < src->height ? params->threads : src->height;
+    Band *bands = malloc(threads * sizeof(Band));
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    char *scratch = scratch_size > 0 ? malloc(threads * scratch_size) : NULL;
+    if (bands == NULL || ids == NULL || (scratch_size > 0 && scratch == NULL)) {
+        free(bands);
+        free(ids);
+        free(scratch);
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        bands[i].src = src;
+        bands[i].dst = dst;
+        bands[i].function = function;
+        bands[i].params = params;
+        bands[i].conv = conv;
+        bands[i].scratch = scratch + i * scratch_size;
+        bands[i].y0 = (long) src->height * i / threads;
+        bands[i].y1 = (long) src->height * (i + 1) / threads;
+        bands[i].threaded = 0;
+    }
+    // This thread takes the first band; if a thread can't be started, its
+    // band is run here too.
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, run, &bands[i]) == 0) {
+            bands[i].threaded = 1;
+        } else {
+            run(&bands[i]);
+        }
+    }
+    run(&bands[0]);
+    for (int i = 1; i < threads; i++) {
+        if (bands[i].threaded) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    free(bands);
+    free(ids);
+    free(scratch);
+    return 0;
+}
+
+
+int run_kernel(int kernel, const Image *src, Image *dst,
+               const KernelParams *params) {
+    if (kernel < 0 || kernel >= KERNEL_COUNT || !variant_supported(params->variant) ||
+            params->tile_rows < 1 || params->tile_cols < 0 || params->threads < 1 ||
+            dst->width != src->width || dst->height != src->height ||
+            dst->pixel_size != src->pixel_size) {
+        return -1;
+    }
+    return run_bands(src, dst, params, row_functions[kernel][params->variant],
+                     NULL, 0, run_band);
+}
+
+
+int run_convolution(const Convolution *conv, const Image *src, Image *dst,
+                    const KernelParams *params) {
+    if (!variant_supported(params->variant) || params->threads < 1 ||
+            dst->width != src->width || dst->height != src->height ||
+            dst->pixel_size != src->pixel_size) {
+        return -1;
+    }
+    return run_bands(src, dst, params, NULL, conv,
+                     convolve_scratch_size(conv, src->width, src->pixel_size),
+                     run_convolution_band);
+}
+
+
+/******************************************************************************
+ * Setting up a convolution
+ *****************************************************************************/
+
+/*
+ * Parse an integer from *s in [min, max] into value, and move *s past it.
+ * Return 0 on success, or -1 if there isn't one.
+ */
+static int parse_int(const char **s, long min, long max, int *value) {
+    char *end;
+    long n = strtol(*s, &end, 10);
+    if (end == *s || n < min || n > max) {
+        return -1;
+    }
+    *value = n;
+    *s = end;
+    return 0;
+}
+
+
+/*
+ * Like parse_int, but s must hold nothing else. An empty or missing s
+ * leaves value alone.
+ */
+static int parse_optional_int(const char *s, long min, long max, int *value) {
+    if (s == NULL || *s == '\0') {
+        return 0;
+    }
+    return parse_int(&s, min, max, value) < 0 || *s != '\0' ? -1 : 0;
+}
+
+
+/*
+ * Return num / den << shift, rounded to the nearest integer.
+ */
+static long fixed_point(long num, long den, int shift) {
+    long scaled = num * (1L << shift);
+    if (den < 0) {
+        scaled = -scaled;
+        den = -den;
+    }
+    return scaled >= 0 ? (scaled + den / 2) / den : -((-scaled + den / 2) / den);
+}
+
+
+/*
+ * Return 1 if the kernel is a column times a row, storing in row and col
+ * the position of a non-zero coefficient (whose row and column are then
+ * multiples of the others), or 0 if it isn't.
+ */
+static int find_separation(const Convolution *conv, int *row, int *col) {
+    int n = conv->size;
+    const int *c = conv->coefficients;
+    int pivot = 0;
+    while (pivot < n * n && c[pivot] == 0) {
+        pivot++;
+    }
+    if (pivot == n * n) {
+        return 0;
+    }
+    *row = pivot / n;
+    *col = pivot % n;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if ((long) c[n * i + j] * c[pivot] != (long) c[n * i + *col] * c[n * *row + j]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Work out the fixed-point form of the kernel in conv.
+ * Return 0 on success, or -1 if the sums can't fit in 32 bits.
+ */
+static int plan_convolution(Convolution *conv) {
+    int n = conv->size;
+    const int *c = conv->coefficients;
+    int row = 0;
+    int col = 0;
+    // A separable kernel takes 2n multiplies per output rather than n * n,
+    // but needs a second pass, which doesn't pay off for 3x3.
+    conv->separable = n >= 5 && find_separation(conv, &row, &col);
+    // Use as many fraction bits as the sums have room for.
+    for (int shift = CONVOLVE_MAX_SHIFT; shift >= 0; shift--) {
+        long largest = 0;
+        if (conv->separable) {
+            long row_total = 0;
+            long column_total = 0;
+            for (int k = 0; k < n; k++) {
+                conv->row_weights[k] = c[n * row + k];
+                conv->column_weights[k] = fixed_point(c[n * k + col],
+                        (long) c[n * row + col] * conv->divisor, shift);
+                row_total += labs(conv->row_weights[k]);
+                column_total += labs(conv->column_weights[k]);
+            }
+            largest = 255 * row_total * column_total;
+        } else {
+            for (int k = 0; k < n * n; k++) {
+                conv->weights[k] = fixed_point(c[k], conv->divisor, shift);
+                largest += 255 * labs(conv->weights[k]);
+            }
+        }
+        long offset = conv->bias * (1L << shift) + (shift > 0 ? 1L << (shift - 1) : 0);
+        if (largest + labs(offset) <= INT_MAX) {
+            conv->shift = shift;
+            conv->offset = offset;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+int make_convolution(Convolution *conv, const char *size,
+                     const char *coefficients, const char *divisor,
+                     const char *bias) {
+    memset(conv, 0, sizeof(*conv));
+    if (coefficients == NULL) {
+        return -1;
+    }
+    // Forms send the commas as %2C, and spaces as +.
+    int count = 0;
+    const char *s = coefficients;
+    while (*s != '\0') {
+        while (*s == '+') {
+            s++;
+        }
+        if (count == CONVOLVE_MAX_SIZE * CONVOLVE_MAX_SIZE ||
+                parse_int(&s, -CONVOLVE_MAX_COEFFICIENT, CONVOLVE_MAX_COEFFICIENT,
+                          &conv->coefficients[count]) < 0) {
+            return -1;
+        }
+        count++;
+        while (*s == '+') {
+            s++;
+        }
+        if (*s == ',') {
+            s++;
+        } else if (strncasecmp(s, "%2C", 3) == 0) {
+            s += 3;
+        } else if (*s != '\0') {
+            return -1;
+        }
+    }
+
+    while (conv->size * conv->size < count) {
+        conv->size++;
+    }
+    if (parse_optional_int(size, 1, CONVOLVE_MAX_SIZE, &conv->size) < 0 ||
+            conv->size % 2 == 0 || conv->size * conv->size != count) {
+        return -1;
+    }
+    int sum = 0;
+    for (int k = 0; k < count; k++) {
+        sum += conv->coefficients[k];
+    }
+    conv->divisor = sum != 0 ? sum : 1;
+    if (parse_optional_int(divisor, -CONVOLVE_MAX_DIVISOR, CONVOLVE_MAX_DIVISOR,
+                           &conv->divisor) < 0 || conv->divisor == 0 ||
+            parse_optional_int(bias, -CONVOLVE_MAX_BIAS, CONVOLVE_MAX_BIAS,
+                               &conv->bias) < 0) {
+        return -1;
+    }
+    return plan_convolution(conv);
+}
+
+
+void convolution_name(const Convolution *conv, char *buf, size_t size) {
+    int n = snprintf(buf, size, "%s%d:", CONVOLVE_PREFIX, conv->size);
+    for (int k = 0; k < conv->size * conv->size && n < size; k++) {
+        n += snprintf(buf + n, size - n, k > 0 ? ",%d" : "%d", conv->coefficients[k]);
+    }
+    if (n < size) {
+        snprintf(buf + n, size - n, ":%d:%d", conv->divisor, conv->bias);
+    }
+}
+
+
+int is_convolution(const char *filter) {
+    return strncmp(filter, CONVOLVE_PREFIX, strlen(CONVOLVE_PREFIX)) == 0;
+}
+
+
+int parse_convolution(const char *filter, Convolution *conv) {
+    char copy[CONVOLVE_MAX_NAME];
+    char *fields[4];
+    if (!is_convolution(filter) ||
+            snprintf(copy, sizeof(copy), "%s", filter + strlen(CONVOLVE_PREFIX)) >= sizeof(copy)) {
+        return -1;
+    }
+    char *s = copy;
+    for (int i = 0; i < 4; i++) {
+        fields[i] = s;
+        s = strchr(s, ':');
+        if ((s == NULL) != (i == 3)) {
+            return -1;
+        }
+        if (s != NULL) {
+            *s++ = '\0';
+        }
+    }
+    // The divisor and bias are always named, so an empty one is an error.
+    if (*fields[2] == '\0' || *fields[3] == '\0') {
+        return -1;
+    }
+    return make_convolution(conv, fields[0], fields[1], fields[2], fields[3]);
+}
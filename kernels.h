@@ -0,0 +1,145 @@
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#include "bitmap.h"
+
+// Filters that the server runs itself, instead of executing a program from
+// the filters directory.
+enum {
+    KERNEL_GREYSCALE,
+    KERNEL_GAUSSIAN_BLUR,
+    KERNEL_EDGE_DETECTION,
+    KERNEL_COUNT
+};
+
+// Implementations of each kernel. All of them give identical output:
+//   scalar: clamps the neighbours of every pixel,
+//   vector: handles the border separately so the rest of each row is a
+//           branch-free loop that the compiler vectorises,
+//   avx2:   the vector code compiled for AVX2 (x86 CPUs that support it).
+enum {
+    VARIANT_SCALAR,
+    VARIANT_VECTOR,
+    VARIANT_AVX2,
+    VARIANT_COUNT
+};
+
+// How a kernel walks an image. Rows are split into equal bands, one per
+// thread, and each band is processed in tiles of tile_rows by tile_cols
+// pixels so that the rows a tile reads stay in cache.
+typedef struct {
+    int variant;
+    int tile_rows;
+    int tile_cols;    // 0 means whole rows.
+    int threads;
+} KernelParams;
+
+// The convolve filter takes its kernel from the request: a square of size
+// by size integer coefficients, listed row by row from the top left, and
+// each output channel is the weighted sum of the input channel around it,
+// divided by divisor, plus bias, and clamped to 0..255. Edge pixels are
+// repeated beyond the border. A convolution is named for the result store
+// and job workers by CONVOLVE_PREFIX followed by its parameters.
+#define CONVOLVE_FILTER "convolve"
+#define CONVOLVE_PREFIX "convolve:"
+#define CONVOLVE_MAX_SIZE 9
+#define CONVOLVE_MAX_COEFFICIENT 4096
+#define CONVOLVE_MAX_DIVISOR (1 << 20)
+#define CONVOLVE_MAX_BIAS 1024
+#define CONVOLVE_MAX_NAME 640   // Room for any convolution's name.
+// The sums are done in 32-bit fixed point with at most this many fraction
+// bits, fewer if the coefficients are large.
+#define CONVOLVE_MAX_SHIFT 16
+
+typedef struct {
+    int size;          // Odd, up to CONVOLVE_MAX_SIZE.
+    int coefficients[CONVOLVE_MAX_SIZE * CONVOLVE_MAX_SIZE];
+    int divisor;
+    int bias;
+    // The kernel in fixed point: each output is (the weighted sum of the
+    // inputs + offset) >> shift. A separable kernel (a column times a row,
+    // with size of 5 or more) is applied as a pass of row_weights along
+    // each row and then a pass of column_weights down each column;
+    // otherwise weights holds the whole kernel.
+    int separable;
+    int shift;
+    int offset;
+    int weights[CONVOLVE_MAX_SIZE * CONVOLVE_MAX_SIZE];
+    int row_weights[CONVOLVE_MAX_SIZE];
+    int column_weights[CONVOLVE_MAX_SIZE];
+} Convolution;
+
+
+/*
+ * Return the kernel with the given filter name, or -1 if there isn't one.
+ */
+int find_kernel(const char *name);
+
+/*
+ * Return the filter name of the kernel, or the name of the variant.
+ */
+const char *kernel_name(int kernel);
+const char *variant_name(int variant);
+
+/*
+ * Return the variant with the given name, or -1 if there isn't one.
+ */
+int find_variant(const char *name);
+
+/*
+ * Return 1 if the variant can run on this CPU, 0 otherwise.
+ */
+int variant_supported(int variant);
+
+/*
+ * Set params to values that are reasonable on any machine: the fastest
+ * supported variant, one thread, and tiles of whole rows.
+ */
+void default_kernel_params(KernelParams *params);
+
+/*
+ * Run the kernel on src, writing the result into dst, which must have the
+ * same dimensions and pixel size (see create_bitmap_like).
+ * Return 0 on success, or -1 if the parameters are invalid.
+ */
+int run_kernel(int kernel, const Image *src, Image *dst,
+               const KernelParams *params);
+
+/*
+ * Set up conv from the query parameters of a convolve request: the kernel
+ * size (optional for a square number of coefficients), the coefficients
+ * separated by commas, the divisor (the sum of the coefficients by
+ * default, or 1 if that is 0) and the bias (0 by default).
+ * Return 0 on success, or -1 if they don't make a valid kernel.
+ */
+int make_convolution(Convolution *conv, const char *size,
+                     const char *coefficients, const char *divisor,
+                     const char *bias);
+
+/*
+ * Write the filter name of conv into buf, which should be CONVOLVE_MAX_NAME
+ * bytes.
+ */
+void convolution_name(const Convolution *conv, char *buf, size_t size);
+
+/*
+ * Return 1 if filter names a convolution, 0 otherwise.
+ */
+int is_convolution(const char *filter);
+
+/*
+ * Set up conv from a filter name made by convolution_name.
+ * Return 0 on success, or -1 if the name isn't a valid convolution.
+ */
+int parse_convolution(const char *filter, Convolution *conv);
+
+/*
+ * Run the convolution on src, like run_kernel. Convolutions keep the rows
+ * they need in a ring as they work down each band, so only the variant and
+ * number of threads in params are used.
+ * Return 0 on success, or -1 if the parameters are invalid.
+ */
+int run_convolution(const Convolution *conv, const Image *src, Image *dst,
+                    const KernelParams *params);
+
+#endif /* KERNELS_H_ */
@@ -0,0 +1,607 @@
+/*
+ * A load generator for image_server.
+ *
+ * Usage: loadgen [-h host] [-p port] [-c concurrency] [-r rate]
+ *                [-d seconds] [-n requests] [-m mix] [-u upload_file]
+ *                [-R replay_file] [-s trickle_ms] [-C]
+ *
+ * By default this runs a closed loop: each of the -c connections sends its
+ * next request as soon as the previous response has arrived. With -r, it
+ * runs an open loop instead, starting requests at a fixed rate (per second)
+ * no matter how fast the server answers, using up to -c connections at once.
+ * Latency in open-loop mode is measured from when each request was *meant*
+ * to start, so a stalled server can't hide its queueing delay by slowing
+ * down the load (coordinated omission).
+ *
+ * The mix is a comma-separated list of weighted request kinds:
+ *   main:<weight>                      GET /main.html
+ *   filter:<image>:<filter>:<weight>   GET /image-filter?image=..&filter=..
+ *   upload:<weight>                    POST /image-upload of the -u file
+ * e.g. "main:1,filter:dog.bmp:copy:4,upload:1".
+ *
+ * With -R, requests are replayed in order (and then repeated) from a file.
+ * Each line is either a request like "GET /image-filter?image=a.bmp&filter=copy",
+ * or a line logged by image_server: "Request parsed: [GET] [/image-filter]"
+ * followed by debug lines "  image -> a.bmp" for its query parameters.
+ * Replayed uploads send the -u file.
+ *
+ * -s sends upload bodies slowly, TRICKLE_CHUNK bytes at a time with a
+ * pause of trickle_ms between them, like a client on a slow link.
+ *
+ * -C checks afterwards that the server counts no connections as open (see
+ * /metrics), waiting up to CHECK_WAIT_SEC for the last responses to end,
+ * and exits with status 1 if it still does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "socket.h"
+#include "request.h"
+
+#ifndef PORT
+#define PORT 30000
+#endif
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_CONCURRENCY 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_MIX "main:1,filter:dog.bmp:copy:1"
+#define DEFAULT_UPLOAD "dog.bmp"
+
+#define UPLOAD_BOUNDARY "loadgen-boundary-7d3f9a"
+
+#define TRICKLE_CHUNK 4096
+#define CHECK_WAIT_SEC 5
+
+// Kinds of requests.
+enum {
+    REQ_MAIN,
+    REQ_FILTER,
+    REQ_UPLOAD,
+    REQ_GET       // A replayed GET of an arbitrary target.
+};
+
+typedef struct {
+    int kind;
+    char target[MAXLINE];   // Request target for REQ_FILTER and REQ_GET.
+    int weight;
+} RequestSpec;
+
+// Per-connection state and results. Each worker thread keeps its own
+// latencies so recording them needs no locking.
+typedef struct {
+    pthread_t thread;
+    unsigned int seed;
+    long *latencies;        // Nanoseconds.
+    size_t num_latencies;
+    size_t cap_latencies;
+    long statuses[6];       // Responses by status class (1xx..5xx); [0] for failures.
+} Worker;
+
+static const char *host = DEFAULT_HOST;
+static int port = PORT;
+static long rate;                 // Requests per second; 0 for a closed loop.
+static long max_requests;         // 0 for no limit.
+static long start_ns;
+static long end_ns;
+
+static RequestSpec *specs;
+static int num_specs;
+static int total_weight;
+static int replay;
+
+static char *upload_data;
+static long upload_size;
+static long trickle_ms;           // Pause between pieces of an upload body.
+
+static long next_request;         // Shared request counter.
+
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+static void sleep_until(long when_ns) {
+    long delta = when_ns - now_ns();
+    if (delta > 0) {
+        struct timespec ts = {delta / 1000000000L, delta % 1000000000L};
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+static RequestSpec *add_spec(void) {
+    specs = realloc(specs, sizeof(RequestSpec) * (num_specs + 1));
+    RequestSpec *spec = &specs[num_specs++];
+    memset(spec, 0, sizeof(*spec));
+    spec->weight = 1;
+    return spec;
+}
+
+
+/*
+ * Parse a request mix (see the top of this file) into specs.
+ */
+static void parse_mix(const char *mix) {
+    char *copy = strdup(mix);
+    char *saveptr;
+    for (char *entry = strtok_r(copy, ",", &saveptr); entry != NULL;
+            entry = strtok_r(NULL, ",", &saveptr)) {
+        char *fields[4];
+        int n = 0;
+        char *field_save;
+        for (char *f = strtok_r(entry, ":", &field_save); f != NULL && n < 4;
+                f = strtok_r(NULL, ":", &field_save)) {
+            fields[n++] = f;
+        }
+        RequestSpec *spec = add_spec();
+        if (n == 2 && strcmp(fields[0], "main") == 0) {
+            spec->kind = REQ_MAIN;
+            spec->weight = strtol(fields[1], NULL, 10);
+        } else if (n == 2 && strcmp(fields[0], "upload") == 0) {
+            spec->kind = REQ_UPLOAD;
+            spec->weight = strtol(fields[1], NULL, 10);
+        } else if (n == 4 && strcmp(fields[0], "filter") == 0) {
+            spec->kind = REQ_FILTER;
+            snprintf(spec->target, MAXLINE, "%s?image=%s&filter=%s",
+                     IMAGE_FILTER, fields[1], fields[2]);
+            spec->weight = strtol(fields[3], NULL, 10);
+        } else {
+            fprintf(stderr, "Bad mix entry: %s\n", entry);
+            exit(1);
+        }
+        total_weight += spec->weight;
+    }
+    free(copy);
+    if (total_weight <= 0) {
+        fprintf(stderr, "The request mix has no weight\n");
+        exit(1);
+    }
+}
+
+
+/*
+ * Add a replayed request for the given method and target.
+ */
+static void add_replayed(const char *method, const char *target) {
+    RequestSpec *spec = add_spec();
+    if (strcmp(method, POST) == 0 && strcmp(target, IMAGE_UPLOAD) == 0) {
+        spec->kind = REQ_UPLOAD;
+    } else if (strcmp(method, GET) == 0) {
+        spec->kind = REQ_GET;
+        snprintf(spec->target, MAXLINE, "%s", target);
+    } else {
+        num_specs--;
+    }
+}
+
+
+/*
+ * Read the requests to replay from a file (see the top of this file).
+ */
+static void parse_replay(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[MAXLINE];
+    // A logged request is only added once all of its parameters are read.
+    char logged_method[16];
+    char logged_target[MAXLINE];
+    int have_logged = 0;
+    int num_params = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char method[16];
+        char target[MAXLINE];
+        char *logged = strstr(line, "Request parsed: [");
+        char *arrow = strstr(line, " -> ");
+        if (logged != NULL) {
+            if (have_logged) {
+                add_replayed(logged_method, logged_target);
+            }
+            have_logged = sscanf(logged, "Request parsed: [%15[^]]] [%511[^]]]",
+                                 logged_method, logged_target) == 2;
+            num_params = 0;
+        } else if (arrow != NULL) {
+            // A query parameter of the logged request: "<name> -> <value>".
+            char *name = arrow;
+            while (name > line && name[-1] != ' ') {
+                name--;
+            }
+            char value[MAXLINE / 2];
+            if (have_logged && sscanf(arrow + 4, "%511s", value) == 1) {
+                size_t len = strlen(logged_target);
+                snprintf(logged_target + len, sizeof(logged_target) - len,
+                         "%c%.*s=%s", num_params++ == 0 ? '?' : '&',
+                         (int) (arrow - name), name, value);
+            }
+        } else if (sscanf(line, "%15s %1023s", method, target) == 2 &&
+                   target[0] == '/') {
+            add_replayed(method, target);
+        }
+    }
+    if (have_logged) {
+        add_replayed(logged_method, logged_target);
+    }
+    fclose(in);
+    if (num_specs == 0) {
+        fprintf(stderr, "No requests to replay in %s\n", path);
+        exit(1);
+    }
+    replay = 1;
+}
+
+
+static void load_upload(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    upload_size = st.st_size;
+    upload_data = malloc(upload_size);
+    if (read(fd, upload_data, upload_size) != upload_size) {
+        perror("read");
+        exit(1);
+    }
+    close(fd);
+}
+
+
+/*
+ * Write all len bytes of buf to the socket fd. Return 0 on success and -1
+ * on error (including the server closing the connection, which mustn't
+ * raise SIGPIPE).
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Write the upload body, all at once or, with -s, in paced pieces.
+ * Return 0 on success and -1 on error.
+ */
+static int write_upload(int fd) {
+    if (trickle_ms == 0) {
+        return write_all(fd, upload_data, upload_size);
+    }
+    for (long sent = 0; sent < upload_size; sent += TRICKLE_CHUNK) {
+        long len = upload_size - sent < TRICKLE_CHUNK ? upload_size - sent : TRICKLE_CHUNK;
+        if (write_all(fd, upload_data + sent, len) < 0) {
+            return -1;
+        }
+        usleep(trickle_ms * 1000);
+    }
+    return 0;
+}
+
+
+/*
+ * Send the request number n described by spec, and read the whole response.
+ * Return the response's status code, or -1 if the request failed.
+ */
+static int do_request(const RequestSpec *spec, long n) {
+    int soc = try_connect_to_server(port, host);
+    if (soc < 0) {
+        return -1;
+    }
+
+    char head[2 * MAXLINE];
+    int len;
+    int failed;
+    if (spec->kind == REQ_UPLOAD) {
+        // The server refuses to overwrite images, so every upload gets its
+        // own name.
+        char part[MAXLINE];
+        int part_len = snprintf(part, sizeof(part),
+                "--" UPLOAD_BOUNDARY "\r\n"
+                "Content-Disposition: form-data; name=\"bitmap\"; "
+                "filename=\"loadgen-%d-%ld.bmp\"\r\n"
+                "Content-Type: image/bmp\r\n\r\n", getpid(), n);
+        const char *trailer = "\r\n--" UPLOAD_BOUNDARY "--\r\n";
+        len = snprintf(head, sizeof(head),
+                "POST %s HTTP/1.1\r\n"
+                "Host: %s\r\n"
+                "Content-Type: multipart/form-data; boundary=" UPLOAD_BOUNDARY "\r\n"
+                "Content-Length: %ld\r\n\r\n%s",
+                IMAGE_UPLOAD, host, part_len + upload_size + strlen(trailer), part);
+        failed = write_all(soc, head, len) < 0 ||
+                 write_upload(soc) < 0 ||
+                 write_all(soc, trailer, strlen(trailer)) < 0;
+    } else {
+        const char *target = spec->kind == REQ_MAIN ? MAIN_HTML : spec->target;
+        len = snprintf(head, sizeof(head),
+                "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", target, host);
+        failed = write_all(soc, head, len) < 0;
+    }
+    // Read the status code, then the rest of the response; the server
+    // closes the connection after each response. Even if sending failed,
+    // the server may have answered early (a 413 for an upload, say) and
+    // closed the connection; that answer is the request's status.
+    char status_line[13];
+    int got = 0;
+    ssize_t r = 0;
+    while (got < 12 && (r = read(soc, status_line + got, 12 - got)) > 0) {
+        got += r;
+    }
+    int status = -1;
+    if (got == 12 && strncmp(status_line, "HTTP/", 5) == 0) {
+        status_line[12] = '\0';
+        status = strtol(status_line + 9, NULL, 10);
+    }
+    char buf[16 * 1024];
+    while (r > 0 && (r = read(soc, buf, sizeof(buf))) > 0) {
+    }
+    if (r < 0 && !failed) {
+        status = -1;
+    }
+    close(soc);
+    return status;
+}
+
+
+/*
+ * Return the server's image_server_active_connections gauge, not counting
+ * the /metrics request that reads it, or -1 if /metrics can't be read.
+ */
+static long active_connections(void) {
+    int soc = try_connect_to_server(port, host);
+    if (soc < 0) {
+        return -1;
+    }
+    char head[MAXLINE];
+    int len = snprintf(head, sizeof(head), "GET /metrics HTTP/1.1\r\nHost: %s\r\n\r\n", host);
+    if (write_all(soc, head, len) < 0) {
+        close(soc);
+        return -1;
+    }
+    size_t cap = 64 * 1024;
+    size_t got = 0;
+    char *body = malloc(cap + 1);
+    ssize_t r;
+    while ((r = read(soc, body + got, cap - got)) > 0) {
+        got += r;
+        if (got == cap) {
+            cap *= 2;
+            body = realloc(body, cap + 1);
+        }
+    }
+    close(soc);
+    body[got] = '\0';
+    const char *name = "\nimage_server_active_connections ";
+    char *line = strstr(body, name);
+    long value = line != NULL ? strtol(line + strlen(name), NULL, 10) - 1 : -1;
+    free(body);
+    return value;
+}
+
+
+/*
+ * Pick the next request spec: in order when replaying, otherwise at random
+ * according to the mix weights.
+ */
+static const RequestSpec *pick_spec(Worker *w, long n) {
+    if (replay) {
+        return &specs[n % num_specs];
+    }
+    int pick = rand_r(&w->seed) % total_weight;
+    for (int i = 0; i < num_specs; i++) {
+        pick -= specs[i].weight;
+        if (pick < 0) {
+            return &specs[i];
+        }
+    }
+    return &specs[num_specs - 1];
+}
+
+
+static void record_latency(Worker *w, long latency) {
+    if (w->num_latencies == w->cap_latencies) {
+        w->cap_latencies = w->cap_latencies ? 2 * w->cap_latencies : 1024;
+        w->latencies = realloc(w->latencies, sizeof(long) * w->cap_latencies);
+    }
+    w->latencies[w->num_latencies++] = latency;
+}
+
+
+static void *run_worker(void *arg) {
+    Worker *w = arg;
+    while (1) {
+        long n = __atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED);
+        if (max_requests > 0 && n >= max_requests) {
+            break;
+        }
+        long intended;
+        if (rate > 0) {
+            intended = start_ns + n * 1000000000L / rate;
+            if (intended >= end_ns) {
+                break;
+            }
+            sleep_until(intended);
+        } else {
+            intended = now_ns();
+            if (intended >= end_ns) {
+                break;
+            }
+        }
+
+        int status = do_request(pick_spec(w, n), n);
+        record_latency(w, now_ns() - intended);
+        if (status >= 100 && status < 600) {
+            w->statuses[status / 100]++;
+        } else {
+            w->statuses[0]++;
+        }
+    }
+    return NULL;
+}
+
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Return the given percentile of the sorted latencies, in milliseconds.
+ */
+static double percentile(const long *sorted, size_t n, double p) {
+    size_t i = (size_t) (p / 100 * n);
+    if (i >= n) {
+        i = n - 1;
+    }
+    return sorted[i] / 1e6;
+}
+
+
+int main(int argc, char **argv) {
+    int concurrency = DEFAULT_CONCURRENCY;
+    int duration = DEFAULT_DURATION;
+    const char *mix = DEFAULT_MIX;
+    const char *upload_path = DEFAULT_UPLOAD;
+    const char *replay_path = NULL;
+    int check = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:r:d:n:m:u:R:s:C")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            concurrency = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            max_requests = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'u':
+            upload_path = optarg;
+            break;
+        case 'R':
+            replay_path = optarg;
+            break;
+        case 's':
+            trickle_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'C':
+            check = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-c concurrency] "
+                    "[-r rate] [-d seconds] [-n requests] [-m mix] "
+                    "[-u upload_file] [-R replay_file] [-s trickle_ms] [-C]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (concurrency < 1) {
+        concurrency = 1;
+    }
+
+    if (replay_path != NULL) {
+        parse_replay(replay_path);
+    } else {
+        parse_mix(mix);
+    }
+    for (int i = 0; i < num_specs; i++) {
+        if (specs[i].kind == REQ_UPLOAD) {
+            load_upload(upload_path);
+            break;
+        }
+    }
+
+    Worker *workers = calloc(concurrency, sizeof(Worker));
+    start_ns = now_ns();
+    end_ns = start_ns + duration * 1000000000L;
+    for (int i = 0; i < concurrency; i++) {
+        workers[i].seed = start_ns + i;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    size_t total = 0;
+    long statuses[6] = {0};
+    for (int i = 0; i < concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].num_latencies;
+        for (int s = 0; s < 6; s++) {
+            statuses[s] += workers[i].statuses[s];
+        }
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    long *all = malloc(sizeof(long) * (total > 0 ? total : 1));
+    size_t n = 0;
+    for (int i = 0; i < concurrency; i++) {
+        memcpy(all + n, workers[i].latencies, sizeof(long) * workers[i].num_latencies);
+        n += workers[i].num_latencies;
+    }
+    qsort(all, total, sizeof(long), compare_longs);
+
+    printf("mode: %s, concurrency %d", rate > 0 ? "open loop" : "closed loop",
+           concurrency);
+    if (rate > 0) {
+        printf(", target rate %ld/s", rate);
+    }
+    printf("\nrequests: %zu in %.2fs (%.1f req/s)\n", total, elapsed,
+           total / elapsed);
+    printf("status: 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, failed %ld\n",
+           statuses[2], statuses[3], statuses[4], statuses[5],
+           statuses[0] + statuses[1]);
+    if (total > 0) {
+        printf("latency (ms): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+               percentile(all, total, 50), percentile(all, total, 90),
+               percentile(all, total, 99), percentile(all, total, 99.9),
+               all[total - 1] / 1e6);
+    }
+
+    if (check) {
+        long open = active_connections();
+        for (int i = 0; i < CHECK_WAIT_SEC * 10 && open != 0; i++) {
+            usleep(100 * 1000);
+            open = active_connections();
+        }
+        printf("active connections after the run: %ld\n", open);
+        if (open != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
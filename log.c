@@ -0,0 +1,505 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "log.h"
+
+#define LOG_MAX_ARGS 8
+#define LOG_STR_SPACE 160
+
+// Size of the buffer the background thread formats records into; it is
+// written out whenever it fills up or the ring runs dry.
+#define LOG_BATCH_SIZE (64 * 1024)
+
+// Longest line a single record formats to.
+#define MAXLOGLINE 1024
+
+// How long the background thread sleeps when the ring is empty.
+#define LOG_IDLE_NS (10 * 1000000L)
+
+// How long a slot can stay reserved but unwritten (because the process
+// writing it died or was stopped, say) before the background thread gives
+// up on it.
+#define LOG_STALL_NS (200 * 1000000L)
+
+// Set in a slot's seq, with the writer's pid in the low bits, while the
+// writer copies its record into the slot.
+#define SEQ_WRITING (1UL << 63)
+
+// Types of the arguments a conversion consumes.
+enum {
+    ARG_NONE,     // "%%", or a conversion we don't support.
+    ARG_INT,
+    ARG_LONG,
+    ARG_DOUBLE,
+    ARG_STR,
+    ARG_PTR
+};
+
+typedef union {
+    long l;
+    double d;
+    int str;      // Offset of a string argument in the record's strs.
+    void *p;
+} LogArg;
+
+typedef struct {
+    long time_ns;
+    const char *format;
+    int level;
+    int pid;
+    LogArg args[LOG_MAX_ARGS];
+    char strs[LOG_STR_SPACE];
+} LogRecord;
+
+// A ring slot. seq implements a bounded multi-producer queue: a slot at
+// position pos is free for producers when seq == pos, and ready for the
+// consumer when seq == pos + 1. A producer that has reserved the slot
+// (moved head past pos) builds its record aside, then moves seq from pos
+// to SEQ_WRITING | pid while it copies the record in. The consumer can
+// abandon a slot that stays reserved by moving seq from pos to the next
+// lap itself, in which case the producer's move fails and it drops the
+// record; a slot being copied into is only abandoned if its writer died.
+typedef struct {
+    unsigned long seq;
+    LogRecord rec;
+} LogSlot;
+
+typedef struct {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long dropped __attribute__((aligned(64)));
+    unsigned long suppressed;
+    long window;                  // The second the rate limit applies to,
+    long window_count;            // and the records kept in it so far.
+    LogSlot slots[LOG_RING_SIZE] __attribute__((aligned(64)));
+} LogRing;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static LogRing *ring;
+static int min_level = DEFAULT_LOG_LEVEL;
+static int rate_limit;
+
+
+/*
+ * Parse the conversion specification starting at the '%' at format,
+ * storing its length in *len. Return the type of argument it consumes.
+ */
+static int parse_spec(const char *format, int *len) {
+    const char *p = format + 1;
+    if (*p == '%') {
+        *len = 2;
+        return ARG_NONE;
+    }
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+        p++;
+    }
+    while ((*p >= '0' && *p <= '9') || *p == '.') {
+        p++;
+    }
+    int is_long = 0;
+    while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) {
+        if (*p != 'h') {
+            is_long = 1;
+        }
+        p++;
+    }
+    int type = ARG_NONE;
+    if (*p != '\0' && strchr("diouxXc", *p) != NULL) {
+        type = is_long ? ARG_LONG : ARG_INT;
+    } else if (*p != '\0' && strchr("fFeEgGaA", *p) != NULL) {
+        type = ARG_DOUBLE;
+    } else if (*p == 's') {
+        type = ARG_STR;
+    } else if (*p == 'p') {
+        type = ARG_PTR;
+    }
+    if (*p != '\0') {
+        p++;
+    }
+    *len = p - format;
+    return type;
+}
+
+
+/*
+ * Format the prefix of a log line into buf, returning its length.
+ */
+static int format_prefix(char *buf, size_t size, long time_ns, int level, int pid) {
+    time_t secs = time_ns / 1000000000L;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    int n = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(buf + n, size - n, ".%03ld [%s] [%d] ",
+                  (time_ns / 1000000L) % 1000, level_names[level], pid);
+    return n;
+}
+
+
+static long realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * Format a record as a line into buf, returning the length of the line
+ * (truncated to fit in size).
+ */
+static int format_record(char *buf, size_t size, const LogRecord *slot) {
+    int n = format_prefix(buf, size, slot->time_ns, slot->level, slot->pid);
+    const char *f = slot->format;
+    int arg = 0;
+    while (*f != '\0' && n < size - 1) {
+        if (*f != '%') {
+            buf[n++] = *f++;
+            continue;
+        }
+        int len;
+        int type = parse_spec(f, &len);
+        char spec[32];
+        if (len >= sizeof(spec) || (type != ARG_NONE && arg == LOG_MAX_ARGS)) {
+            break;
+        }
+        memcpy(spec, f, len);
+        spec[len] = '\0';
+        f += len;
+
+        const LogArg *a = &slot->args[arg];
+        int written = 0;
+        switch (type) {
+        case ARG_NONE:
+            written = snprintf(buf + n, size - n, "%s", strcmp(spec, "%%") == 0 ? "%" : spec);
+            break;
+        case ARG_INT:
+            written = snprintf(buf + n, size - n, spec, (int) a->l);
+            break;
+        case ARG_LONG:
+            written = snprintf(buf + n, size - n, spec, a->l);
+            break;
+        case ARG_DOUBLE:
+            written = snprintf(buf + n, size - n, spec, a->d);
+            break;
+        case ARG_STR:
+            written = snprintf(buf + n, size - n, spec, slot->strs + a->str);
+            break;
+        case ARG_PTR:
+            written = snprintf(buf + n, size - n, spec, a->p);
+            break;
+        }
+        if (type != ARG_NONE) {
+            arg++;
+        }
+        n += written;
+        if (n > size - 1) {
+            n = size - 1;
+        }
+    }
+    // Records are lines; drop the format's own newline, if any, and add one.
+    if (n > 0 && buf[n - 1] == '\n') {
+        n--;
+    }
+    buf[n++] = '\n';
+    return n;
+}
+
+
+/*
+ * Copy the arguments described by format from args into the slot.
+ */
+static void capture_args(LogRecord *slot, const char *format, va_list args) {
+    int arg = 0;
+    int str_used = 0;
+    for (const char *f = format; *f != '\0' && arg < LOG_MAX_ARGS; ) {
+        if (*f != '%') {
+            f++;
+            continue;
+        }
+        int len;
+        int type = parse_spec(f, &len);
+        f += len;
+        LogArg *a = &slot->args[arg];
+        switch (type) {
+        case ARG_NONE:
+            continue;
+        case ARG_INT:
+            a->l = va_arg(args, int);
+            break;
+        case ARG_LONG:
+            a->l = va_arg(args, long);
+            break;
+        case ARG_DOUBLE:
+            a->d = va_arg(args, double);
+            break;
+        case ARG_PTR:
+            a->p = va_arg(args, void *);
+            break;
+        case ARG_STR: {
+            const char *s = va_arg(args, const char *);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            int room = LOG_STR_SPACE - str_used - 1;
+            int n = strlen(s);
+            if (n > room) {
+                n = room > 0 ? room : 0;
+            }
+            memcpy(slot->strs + str_used, s, n);
+            slot->strs[str_used + n] = '\0';
+            a->str = str_used;
+            str_used += room > 0 ? n + 1 : 0;
+            break;
+        }
+        }
+        arg++;
+    }
+}
+
+
+/*
+ * Return 1 if a record below LOG_WARN may be kept under the rate limit.
+ */
+static int within_rate_limit(long time_ns) {
+    long second = time_ns / 1000000000L;
+    long window = __atomic_load_n(&ring->window, __ATOMIC_RELAXED);
+    if (window != second &&
+            __atomic_compare_exchange_n(&ring->window, &window, second, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ring->window_count, 0, __ATOMIC_RELAXED);
+    }
+    return __atomic_fetch_add(&ring->window_count, 1, __ATOMIC_RELAXED) < rate_limit;
+}
+
+
+void log_msg(int level, const char *format, ...) {
+    if (level < min_level) {
+        return;
+    }
+    va_list args;
+    long now = realtime_ns();
+
+    if (ring == NULL) {
+        // Not set up yet: write the line straight away.
+        char line[MAXLOGLINE];
+        int n = format_prefix(line, sizeof(line), now, level, getpid());
+        va_start(args, format);
+        n += vsnprintf(line + n, sizeof(line) - n, format, args);
+        va_end(args);
+        if (n > sizeof(line) - 1) {
+            n = sizeof(line) - 1;
+        }
+        if (line[n - 1] != '\n') {
+            line[n++] = '\n';
+        }
+        if (write(STDERR_FILENO, line, n) < 0) {
+            // Nowhere left to report this.
+        }
+        return;
+    }
+
+    if (level < LOG_WARN && rate_limit > 0 && !within_rate_limit(now)) {
+        __atomic_fetch_add(&ring->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Reserve a slot.
+    unsigned long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    LogSlot *slot;
+    while (1) {
+        slot = &ring->slots[pos % LOG_RING_SIZE];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) (seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer hasn't caught up with this slot: the ring is full.
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    LogRecord rec;
+    rec.time_ns = now;
+    rec.format = format;
+    rec.level = level;
+    rec.pid = getpid();
+    va_start(args, format);
+    capture_args(&rec, format, args);
+    va_end(args);
+    unsigned long reserved = pos;
+    if (!__atomic_compare_exchange_n(&slot->seq, &reserved, SEQ_WRITING | rec.pid, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        // We took too long, and the consumer has moved on without us.
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    slot->rec = rec;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+unsigned long log_dropped(void) {
+    return ring != NULL ? __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+
+unsigned long log_suppressed(void) {
+    return ring != NULL ? __atomic_load_n(&ring->suppressed, __ATOMIC_RELAXED) : 0;
+}
+
+
+/******************************************************************************
+ * Background flushing
+ *****************************************************************************/
+
+static void flush_batch(char *batch, int *len) {
+    int done = 0;
+    while (done < *len) {
+        ssize_t n = write(STDERR_FILENO, batch + done, *len - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    *len = 0;
+}
+
+
+static int alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/*
+ * Give up on the slot at position tail, which has been reserved for too
+ * long. Return 1 if it was abandoned, 0 if it must still be waited for.
+ */
+static int abandon_slot(LogSlot *slot, unsigned long tail) {
+    unsigned long seq = tail;
+    if (__atomic_compare_exchange_n(&slot->seq, &seq, tail + LOG_RING_SIZE, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Its writer hadn't started copying, and now never will.
+        return 1;
+    }
+    if ((seq & SEQ_WRITING) && !alive(seq & ~SEQ_WRITING)) {
+        __atomic_store_n(&slot->seq, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Body of the background thread: format ready records in order and write
+ * them out in batches.
+ */
+static void *flush_logs(void *arg) {
+    char *batch = malloc(LOG_BATCH_SIZE);
+    int len = 0;
+    unsigned long tail = 0;
+    unsigned long reported_dropped = 0;
+    unsigned long reported_suppressed = 0;
+    long stalled_since = 0;
+    long reported_at = 0;
+
+    while (1) {
+        LogSlot *slot = &ring->slots[tail % LOG_RING_SIZE];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == tail + 1) {
+            if (len > LOG_BATCH_SIZE - MAXLOGLINE) {
+                flush_batch(batch, &len);
+            }
+            len += format_record(batch + len, MAXLOGLINE, &slot->rec);
+            __atomic_store_n(&slot->seq, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            tail++;
+            stalled_since = 0;
+            continue;
+        }
+
+        long now = realtime_ns();
+        if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) != tail) {
+            // The slot is reserved but not written yet. Wait for it, unless
+            // its writer seems to have died or stalled part-way through.
+            if (stalled_since == 0) {
+                stalled_since = now;
+            } else if (now - stalled_since > LOG_STALL_NS && abandon_slot(slot, tail)) {
+                __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+                tail++;
+                stalled_since = 0;
+                continue;
+            }
+        }
+
+        // Out of records for now: write out the batch, and report (at most
+        // once a second) anything that was lost since last time.
+        unsigned long dropped = log_dropped();
+        unsigned long suppressed = log_suppressed();
+        if ((dropped != reported_dropped || suppressed != reported_suppressed) &&
+                now - reported_at >= 1000000000L) {
+            LogRecord note;
+            note.time_ns = now;
+            note.level = LOG_WARN;
+            note.pid = getpid();
+            note.format = "log: %lu records dropped, %lu suppressed by rate limit";
+            note.args[0].l = dropped - reported_dropped;
+            note.args[1].l = suppressed - reported_suppressed;
+            len += format_record(batch + len, MAXLOGLINE, &note);
+            reported_dropped = dropped;
+            reported_suppressed = suppressed;
+            reported_at = now;
+        }
+        if (len > 0) {
+            flush_batch(batch, &len);
+        }
+        struct timespec idle = {0, LOG_IDLE_NS};
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+
+int log_init(int level, int limit) {
+    min_level = level;
+    rate_limit = limit;
+    LogRing *mem = mmap(NULL, sizeof(LogRing), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    for (unsigned long i = 0; i < LOG_RING_SIZE; i++) {
+        mem->slots[i].seq = i;
+    }
+    ring = mem;
+
+    // The background thread must never take signals meant for the rest of
+    // the process (SIGCHLD read through a signalfd, say), so start it with
+    // every signal blocked.
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    int status = pthread_create(&thread, NULL, flush_logs, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        ring = NULL;
+        munmap(mem, sizeof(LogRing));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+// Log levels, from least to most severe.
+enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+#define DEFAULT_LOG_LEVEL LOG_INFO
+
+// Default maximum number of records per second below LOG_WARN; any more
+// are counted and suppressed. Warnings and errors are never suppressed.
+#define DEFAULT_LOG_RATE 1000
+
+// Number of records the ring can hold before new ones are dropped.
+#define LOG_RING_SIZE 4096
+
+
+/*
+ * Set up asynchronous logging for this process and any children it forks
+ * afterwards: log records go into a shared lock-free ring, and a background
+ * thread of this process formats them and writes them to stderr in batches.
+ * Records below min_level are discarded, and at most rate_limit records per
+ * second below LOG_WARN are kept (0 means no limit).
+ *
+ * Until this is called, log_msg writes to stderr synchronously.
+ * Return 0 on success, or -1 on failure.
+ */
+int log_init(int min_level, int rate_limit);
+
+/*
+ * Log a message with a printf-style format. The format string must be a
+ * literal (only a pointer to it is stored); the arguments are copied into
+ * a fixed-size binary record, and formatted later by the background thread.
+ * Conversions with '*' widths or precisions aren't supported, and string
+ * arguments may be truncated.
+ *
+ * This never blocks: if the ring is full, the record is dropped and counted.
+ */
+void log_msg(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Return the total number of records dropped because the ring was full,
+ * and suppressed by the rate limit.
+ */
+unsigned long log_dropped(void);
+unsigned long log_suppressed(void);
+
+#endif /* LOG_H_ */
@@ -0,0 +1,566 @@
+#define _GNU_SOURCE        /* sched_getcpu */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+#include "response.h"
+#include "reply.h"
+#include "trace.h"
+#include "perf.h"
+
+
+// Latency histograms are HDR-style: log-linear buckets of microseconds with
+// eight sub-buckets per power of two (so a bucket is at most 12.5% wide),
+// from 1us up to about two minutes. Values below 1 << HIST_SUB_BITS get a
+// bucket each.
+#define HIST_SUB_BITS 3
+#define HIST_MAX_EXPONENT 26
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+#define MAX_METRIC_SHARDS 64
+
+// "Other" series for filters that didn't get a slot of their own.
+#define OTHER_FILTER MAX_METRIC_FILTERS
+
+typedef struct {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long sum_us;
+} Histogram;
+
+// Status codes that requests are counted under; anything else is "other".
+static const int statuses[] = {200, 303, 400, 404, 408, 413, 500, 503};
+#define STATUS_COUNT (sizeof(statuses) / sizeof(statuses[0]) + 1)
+
+static const char *route_names[ROUTE_COUNT] = {
+    "main_html", "image_filter", "image_upload", "metrics", "trace", "other"
+};
+static const char *phase_names[PHASE_COUNT] = {
+    "parse", "queue", "filter", "send"
+};
+
+// One shard of every metric. Each CPU updates its own shard, and a scrape
+// adds them all up.
+typedef struct {
+    long counters[COUNTER_COUNT];
+    long gauges[GAUGE_COUNT];
+    unsigned long requests[ROUTE_COUNT][STATUS_COUNT];
+    Histogram route_latency[ROUTE_COUNT];
+    Histogram phases[MAX_METRIC_FILTERS + 1][PHASE_COUNT];
+    unsigned long profiled_runs[MAX_METRIC_FILTERS + 1];
+    unsigned long perf_counts[MAX_METRIC_FILTERS + 1][PERF_COUNTER_COUNT];
+} __attribute__((aligned(64))) MetricsShard;
+
+// Filter name slots are claimed with a compare-and-swap on their state.
+#define SLOT_FREE 0
+#define SLOT_CLAIMING 1
+#define SLOT_READY 2
+
+typedef struct {
+    int filter_state[MAX_METRIC_FILTERS];
+    char filter_names[MAX_METRIC_FILTERS][MAX_METRIC_FILTER_NAME];
+    int num_shards;
+    MetricsShard shards[];
+} MetricsRegion;
+
+static MetricsRegion *region;
+
+// The request being responded to by this process.
+static long request_accepted_ns;
+static long request_parsed_ns;
+static long request_dispatched_ns;
+static int request_status;
+
+
+int metrics_init(void) {
+    int num_shards = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_shards < 1) {
+        num_shards = 1;
+    } else if (num_shards > MAX_METRIC_SHARDS) {
+        num_shards = MAX_METRIC_SHARDS;
+    }
+    size_t size = sizeof(MetricsRegion) + num_shards * sizeof(MetricsShard);
+    // Anonymous shared mappings start out zeroed.
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    region = mem;
+    region->num_shards = num_shards;
+    return 0;
+}
+
+
+long metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * Return the shard for the CPU this process is running on. Migrating
+ * between CPUs in the middle of an update is harmless, since all updates
+ * are atomic; it just means the shard is shared for a moment.
+ */
+static MetricsShard *local_shard(void) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+    return &region->shards[cpu % region->num_shards];
+}
+
+
+static void atomic_add(long *p, long n) {
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+
+static void atomic_inc(unsigned long *p, unsigned long n) {
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+
+void metrics_add(int counter, long n) {
+    if (region != NULL) {
+        atomic_add(&local_shard()->counters[counter], n);
+    }
+}
+
+
+void metrics_gauge_add(int gauge, long n) {
+    if (region != NULL) {
+        atomic_add(&local_shard()->gauges[gauge], n);
+    }
+}
+
+
+/*
+ * Return the histogram bucket for a value in microseconds.
+ */
+static int hist_bucket(unsigned long us) {
+    if (us < (1 << HIST_SUB_BITS)) {
+        return us;
+    }
+    int exponent = 63 - __builtin_clzl(us);
+    if (exponent > HIST_MAX_EXPONENT) {
+        return HIST_BUCKETS - 1;
+    }
+    int sub = (us >> (exponent - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+
+/*
+ * Return the (exclusive) upper bound of a histogram bucket in microseconds.
+ */
+static unsigned long hist_bucket_limit(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket + 1;
+    }
+    int exponent = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned long sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    return ((1UL << HIST_SUB_BITS) + sub + 1) << (exponent - HIST_SUB_BITS);
+}
+
+
+static void hist_record(Histogram *h, long ns) {
+    unsigned long us = ns > 0 ? ns / 1000 : 0;
+    atomic_inc(&h->count[hist_bucket(us)], 1);
+    atomic_inc(&h->sum_us, us);
+}
+
+
+/*
+ * Return the slot for the filter with the given name, claiming a free one
+ * if it hasn't been seen before.
+ */
+static int filter_slot(const char *filter) {
+    if (strlen(filter) >= MAX_METRIC_FILTER_NAME) {
+        return OTHER_FILTER;
+    }
+    for (int i = 0; i < MAX_METRIC_FILTERS; i++) {
+        int state = __atomic_load_n(&region->filter_state[i], __ATOMIC_ACQUIRE);
+        if (state == SLOT_FREE) {
+            int expected = SLOT_FREE;
+            if (__atomic_compare_exchange_n(&region->filter_state[i], &expected,
+                    SLOT_CLAIMING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                strcpy(region->filter_names[i], filter);
+                __atomic_store_n(&region->filter_state[i], SLOT_READY,
+                                 __ATOMIC_RELEASE);
+                return i;
+            }
+            state = expected;
+        }
+        // A slot that is still being claimed might be for this very
+        // filter; skipping it at worst splits the filter's series in two.
+        if (state == SLOT_READY && strcmp(region->filter_names[i], filter) == 0) {
+            return i;
+        }
+    }
+    return OTHER_FILTER;
+}
+
+
+static int status_index(int status) {
+    for (int i = 0; i < STATUS_COUNT - 1; i++) {
+        if (statuses[i] == status) {
+            return i;
+        }
+    }
+    return STATUS_COUNT - 1;
+}
+
+
+void metrics_note_status(int status) {
+    request_status = status;
+}
+
+
+int metrics_status(void) {
+    return request_status;
+}
+
+
+const char *metrics_route_name(int route) {
+    return route_names[route];
+}
+
+
+void metrics_request_begin(long accepted_ns, long parsed_ns) {
+    request_accepted_ns = accepted_ns;
+    request_parsed_ns = parsed_ns;
+    request_dispatched_ns = metrics_now_ns();
+    request_status = 0;
+}
+
+
+void metrics_filter_phases(const char *filter, long filter_ns, long send_ns) {
+    if (region == NULL) {
+        return;
+    }
+    Histogram *h = local_shard()->phases[filter_slot(filter)];
+    hist_record(&h[PHASE_PARSE], request_parsed_ns - request_accepted_ns);
+    hist_record(&h[PHASE_QUEUE], request_dispatched_ns - request_parsed_ns);
+    hist_record(&h[PHASE_FILTER], filter_ns);
+    hist_record(&h[PHASE_SEND], send_ns);
+}
+
+
+void metrics_filter_counters(const char *filter,
+                             const unsigned long counts[PERF_COUNTER_COUNT]) {
+    if (region == NULL) {
+        return;
+    }
+    MetricsShard *shard = local_shard();
+    int slot = filter_slot(filter);
+    atomic_inc(&shard->profiled_runs[slot], 1);
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        atomic_inc(&shard->perf_counts[slot][i], counts[i]);
+    }
+}
+
+
+void metrics_count_request(int route, int status, long latency_ns) {
+    if (region == NULL) {
+        return;
+    }
+    MetricsShard *shard = local_shard();
+    atomic_inc(&shard->requests[route][status_index(status)], 1);
+    hist_record(&shard->route_latency[route], latency_ns);
+}
+
+
+void metrics_request_end(int route) {
+    metrics_count_request(route, request_status,
+                          metrics_now_ns() - request_accepted_ns);
+}
+
+
+int metrics_route(const ReqData *req) {
+    if (strcmp(req->method, GET) == 0) {
+        if (strcmp(req->path, MAIN_HTML) == 0) {
+            return ROUTE_MAIN_HTML;
+        } else if (strcmp(req->path, IMAGE_FILTER) == 0) {
+            return ROUTE_IMAGE_FILTER;
+        } else if (strcmp(req->path, METRICS) == 0) {
+            return ROUTE_METRICS;
+        } else if (strcmp(req->path, TRACE) == 0) {
+            return ROUTE_TRACE;
+        }
+    } else if (strcmp(req->method, POST) == 0 &&
+               strcmp(req->path, IMAGE_UPLOAD) == 0) {
+        return ROUTE_IMAGE_UPLOAD;
+    }
+    return ROUTE_OTHER;
+}
+
+
+/******************************************************************************
+ * Prometheus text exposition
+ *****************************************************************************/
+
+/*
+ * Add up a histogram across all shards.
+ */
+static void hist_sum(Histogram *total, size_t offset) {
+    memset(total, 0, sizeof(*total));
+    for (int s = 0; s < region->num_shards; s++) {
+        Histogram *h = (Histogram *) ((char *) &region->shards[s] + offset);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            total->count[b] += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+        }
+        total->sum_us += __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Write one histogram series with the given labels, skipping it if it is
+ * empty.
+ */
+static void write_histogram(FILE *out, const char *name, const char *labels,
+                            const Histogram *h) {
+    unsigned long total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        total += h->count[b];
+    }
+    if (total == 0) {
+        return;
+    }
+    unsigned long cumulative = 0;
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+        cumulative += h->count[b];
+        fprintf(out, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels,
+                hist_bucket_limit(b) / 1e6, cumulative);
+    }
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, total);
+    fprintf(out, "%s_sum{%s} %g\n", name, labels, h->sum_us / 1e6);
+    fprintf(out, "%s_count{%s} %lu\n", name, labels, total);
+}
+
+
+static long sum_counter(int counter) {
+    long total = 0;
+    for (int s = 0; s < region->num_shards; s++) {
+        total += __atomic_load_n(&region->shards[s].counters[counter],
+                                 __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+static long sum_gauge(int gauge) {
+    long total = 0;
+    for (int s = 0; s < region->num_shards; s++) {
+        total += __atomic_load_n(&region->shards[s].gauges[gauge],
+                                 __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+long metrics_gauge(int gauge) {
+    return region == NULL ? 0 : sum_gauge(gauge);
+}
+
+
+/*
+ * Write the hardware counter totals of each profiled filter, along with its
+ * instructions per cycle and estimated memory traffic.
+ */
+static void write_filter_counters(FILE *out) {
+    unsigned long runs[MAX_METRIC_FILTERS + 1] = {0};
+    unsigned long totals[MAX_METRIC_FILTERS + 1][PERF_COUNTER_COUNT] = {{0}};
+    const char *filters[MAX_METRIC_FILTERS + 1];
+    for (int f = 0; f <= MAX_METRIC_FILTERS; f++) {
+        // Filters only get counters once they have a slot, so it is ready.
+        filters[f] = f < MAX_METRIC_FILTERS ? region->filter_names[f] : "other";
+        for (int s = 0; s < region->num_shards; s++) {
+            MetricsShard *shard = &region->shards[s];
+            runs[f] += __atomic_load_n(&shard->profiled_runs[f], __ATOMIC_RELAXED);
+            for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+                totals[f][i] += __atomic_load_n(&shard->perf_counts[f][i],
+                                                __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    fprintf(out, "# HELP image_server_filter_profiled_runs_total Filter runs "
+            "counted with hardware counters.\n"
+            "# TYPE image_server_filter_profiled_runs_total counter\n");
+    for (int f = 0; f <= MAX_METRIC_FILTERS; f++) {
+        if (runs[f] > 0) {
+            fprintf(out, "image_server_filter_profiled_runs_total{filter=\"%s\"} %lu\n",
+                    filters[f], runs[f]);
+        }
+    }
+    fprintf(out, "# HELP image_server_filter_events_total User-space hardware "
+            "events counted while running each filter.\n"
+            "# TYPE image_server_filter_events_total counter\n");
+    for (int f = 0; f <= MAX_METRIC_FILTERS; f++) {
+        for (int i = 0; runs[f] > 0 && i < PERF_COUNTER_COUNT; i++) {
+            fprintf(out, "image_server_filter_events_total{filter=\"%s\",event=\"%s\"} %lu\n",
+                    filters[f], perf_counter_name(i), totals[f][i]);
+        }
+    }
+    fprintf(out, "# HELP image_server_filter_memory_bytes_total Memory traffic "
+            "of each filter, estimated from last-level cache misses.\n"
+            "# TYPE image_server_filter_memory_bytes_total counter\n");
+    for (int f = 0; f <= MAX_METRIC_FILTERS; f++) {
+        if (runs[f] > 0) {
+            fprintf(out, "image_server_filter_memory_bytes_total{filter=\"%s\"} %lu\n",
+                    filters[f], totals[f][PERF_CACHE_MISSES] * PERF_CACHE_LINE);
+        }
+    }
+    fprintf(out, "# HELP image_server_filter_instructions_per_cycle Instructions "
+            "per cycle of each filter over all its runs.\n"
+            "# TYPE image_server_filter_instructions_per_cycle gauge\n");
+    for (int f = 0; f <= MAX_METRIC_FILTERS; f++) {
+        if (runs[f] > 0 && totals[f][PERF_CYCLES] > 0) {
+            fprintf(out, "image_server_filter_instructions_per_cycle{filter=\"%s\"} %g\n",
+                    filters[f], (double) totals[f][PERF_INSTRUCTIONS] / totals[f][PERF_CYCLES]);
+        }
+    }
+}
+
+
+static void write_metrics(FILE *out) {
+    static const struct {
+        int counter;
+        const char *name;
+        const char *help;
+    } counters[] = {
+        {COUNTER_BYTES_IN, "image_server_received_bytes_total", "Bytes read from clients."},
+        {COUNTER_BYTES_OUT, "image_server_sent_bytes_total", "Bytes written to clients."},
+        {COUNTER_CONNECTIONS, "image_server_connections_total", "Connections accepted."},
+        {COUNTER_SHED, "image_server_shed_requests_total", "Requests answered with 503 by admission control."},
+        {COUNTER_TIMEOUTS, "image_server_timeouts_total", "Connections closed for missing a deadline."},
+        {COUNTER_RESULT_HITS, "image_server_result_hits_total", "Filter requests answered from the result store."},
+        {COUNTER_WARMED, "image_server_warmed_results_total", "Results computed in the background before being requested."},
+        {COUNTER_WARM_PREEMPTED, "image_server_warm_preempted_total", "Background runs abandoned for foreground requests."},
+        {COUNTER_REMOTE_JOBS, "image_server_remote_jobs_total", "Filter jobs run by a job worker."},
+        {COUNTER_REMOTE_FAILOVERS, "image_server_remote_failovers_total", "Filter jobs run locally because no job worker could run them."},
+        {COUNTER_IMAGE_CACHE_HITS, "image_server_image_cache_hits_total", "Source images found already decoded in the image cache."},
+        {COUNTER_IMAGE_CACHE_MISSES, "image_server_image_cache_misses_total", "Source images decoded into the image cache."},
+        {COUNTER_IMAGE_CACHE_EVICTIONS, "image_server_image_cache_evictions_total", "Images evicted from the image cache to make room."},
+        {COUNTER_RESULT_EVICTIONS, "image_server_result_evictions_total", "Results evicted from the result store to stay under its limit."},
+    };
+    for (int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %ld\n",
+                counters[i].name, counters[i].help, counters[i].name,
+                counters[i].name, sum_counter(counters[i].counter));
+    }
+
+    long open = sum_gauge(GAUGE_OPEN_CONNECTIONS);
+    long children = sum_gauge(GAUGE_RUNNING_CHILDREN);
+    long jobs = sum_gauge(GAUGE_RUNNING_JOBS);
+    long slots = sum_gauge(GAUGE_JOB_SLOTS);
+    fprintf(out, "# HELP image_server_active_connections Connections held by "
+            "an event loop or a child.\n# TYPE image_server_active_connections "
+            "gauge\nimage_server_active_connections %ld\n", open + children);
+    fprintf(out, "# HELP image_server_running_jobs Filter jobs running.\n"
+            "# TYPE image_server_running_jobs gauge\n"
+            "image_server_running_jobs %ld\n", jobs);
+    fprintf(out, "# HELP image_server_queued_jobs Filter jobs waiting for a "
+            "slot.\n# TYPE image_server_queued_jobs gauge\n"
+            "image_server_queued_jobs %ld\n", sum_gauge(GAUGE_QUEUED_JOBS));
+    fprintf(out, "# HELP image_server_worker_utilisation Fraction of filter "
+            "job slots in use.\n# TYPE image_server_worker_utilisation gauge\n"
+            "image_server_worker_utilisation %g\n",
+            slots > 0 ? (double) jobs / slots : 0.0);
+    fprintf(out, "# HELP image_server_image_cache_bytes Memory holding decoded "
+            "source images.\n# TYPE image_server_image_cache_bytes gauge\n"
+            "image_server_image_cache_bytes %ld\n", sum_gauge(GAUGE_IMAGE_CACHE_BYTES));
+    fprintf(out, "# HELP image_server_result_store_bytes Disk holding stored "
+            "filter results.\n# TYPE image_server_result_store_bytes gauge\n"
+            "image_server_result_store_bytes %ld\n", sum_gauge(GAUGE_RESULT_BYTES));
+
+    fprintf(out, "# HELP image_server_requests_total Requests by route and "
+            "status.\n# TYPE image_server_requests_total counter\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        for (int st = 0; st < STATUS_COUNT; st++) {
+            unsigned long n = 0;
+            for (int s = 0; s < region->num_shards; s++) {
+                n += __atomic_load_n(&region->shards[s].requests[r][st],
+                                     __ATOMIC_RELAXED);
+            }
+            if (n == 0) {
+                continue;
+            }
+            char status[16];
+            if (st < STATUS_COUNT - 1) {
+                sprintf(status, "%d", statuses[st]);
+            } else {
+                strcpy(status, "other");
+            }
+            fprintf(out, "image_server_requests_total{route=\"%s\",status=\"%s\"} %lu\n",
+                    route_names[r], status, n);
+        }
+    }
+
+    char labels[128];
+    Histogram h;
+    fprintf(out, "# HELP image_server_request_duration_seconds Time from "
+            "accept to response, by route.\n"
+            "# TYPE image_server_request_duration_seconds histogram\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        hist_sum(&h, offsetof(MetricsShard, route_latency[r]));
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+        write_histogram(out, "image_server_request_duration_seconds", labels, &h);
+    }
+
+    fprintf(out, "# HELP image_server_phase_duration_seconds Time spent in "
+            "each phase of a filter request, by filter.\n"
+            "# TYPE image_server_phase_duration_seconds histogram\n");
+    for (int f = 0; f <= MAX_METRIC_FILTERS; f++) {
+        const char *filter = "other";
+        if (f < MAX_METRIC_FILTERS) {
+            if (__atomic_load_n(&region->filter_state[f], __ATOMIC_ACQUIRE) != SLOT_READY) {
+                continue;
+            }
+            filter = region->filter_names[f];
+        }
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            hist_sum(&h, offsetof(MetricsShard, phases[f][p]));
+            snprintf(labels, sizeof(labels), "filter=\"%s\",phase=\"%s\"",
+                     filter, phase_names[p]);
+            write_histogram(out, "image_server_phase_duration_seconds", labels, &h);
+        }
+    }
+
+    if (perf_profiling()) {
+        write_filter_counters(out);
+    }
+}
+
+
+void metrics_response(int fd) {
+    if (region == NULL) {
+        not_found_response(fd);
+        return;
+    }
+    char *body;
+    size_t body_len;
+    FILE *out = open_memstream(&body, &body_len);
+    write_metrics(out);
+    fclose(out);
+
+    metrics_note_status(200);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n", body_len);
+    reply_add(&reply, body, body_len);
+    reply_send(&reply, 0);
+    free(body);
+}
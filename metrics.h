@@ -0,0 +1,151 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "request.h"
+#include "perf.h"
+
+#define METRICS "/metrics"
+
+// Routes that requests are counted under.
+enum {
+    ROUTE_MAIN_HTML,
+    ROUTE_IMAGE_FILTER,
+    ROUTE_IMAGE_UPLOAD,
+    ROUTE_METRICS,
+    ROUTE_TRACE,
+    ROUTE_OTHER,
+    ROUTE_COUNT
+};
+
+// Phases of a filter request, timed separately:
+//   parse:  from accept until the start line has been parsed,
+//   queue:  from then until a child has been forked to respond,
+//   filter: running the filter,
+//   send:   writing the result to the client.
+enum {
+    PHASE_PARSE,
+    PHASE_QUEUE,
+    PHASE_FILTER,
+    PHASE_SEND,
+    PHASE_COUNT
+};
+
+// Monotonic counters.
+enum {
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+    COUNTER_CONNECTIONS,
+    COUNTER_SHED,          // Requests answered with a 503.
+    COUNTER_TIMEOUTS,      // Connections closed for missing a deadline.
+    COUNTER_RESULT_HITS,   // Filter requests answered from the result store.
+    COUNTER_WARMED,        // Results computed ahead of time by the warmer.
+    COUNTER_WARM_PREEMPTED,  // Warmer runs abandoned for foreground work.
+    COUNTER_REMOTE_JOBS,   // Filter jobs run by a job worker.
+    COUNTER_REMOTE_FAILOVERS,  // Jobs run locally because no worker could.
+    COUNTER_IMAGE_CACHE_HITS,  // Source images found decoded in the cache.
+    COUNTER_IMAGE_CACHE_MISSES,  // Source images decoded into the cache.
+    COUNTER_IMAGE_CACHE_EVICTIONS,
+    COUNTER_RESULT_EVICTIONS,
+    COUNTER_COUNT
+};
+
+// Gauges; each is the sum of the increments and decrements made to it.
+enum {
+    GAUGE_OPEN_CONNECTIONS,   // Connections still held by an event loop.
+    GAUGE_RUNNING_CHILDREN,   // Children responding to a request.
+    GAUGE_RUNNING_JOBS,       // Children running a filter job.
+    GAUGE_JOB_SLOTS,          // Filter jobs allowed to run at once.
+    GAUGE_QUEUED_JOBS,
+    GAUGE_IMAGE_CACHE_BYTES,  // Memory holding decoded images.
+    GAUGE_RESULT_BYTES,       // Disk holding stored filter results.
+    GAUGE_COUNT
+};
+
+// Maximum number of distinct filters that get their own histograms;
+// any others share the "other" series.
+#define MAX_METRIC_FILTERS 16
+#define MAX_METRIC_FILTER_NAME 32
+
+
+/*
+ * Map the shared memory region that holds the metrics. This must be called
+ * before any processes are forked, so all of them update the same region.
+ * Return 0 on success, or -1 on failure (metrics are then disabled).
+ */
+int metrics_init(void);
+
+/*
+ * Return the current time of the monotonic clock in nanoseconds.
+ */
+long metrics_now_ns(void);
+
+/*
+ * Add n to the given counter or gauge.
+ * Updates are lock-free and go to a shard for the current CPU, so
+ * processes on different CPUs never contend for a cache line.
+ */
+void metrics_add(int counter, long n);
+void metrics_gauge_add(int gauge, long n);
+
+/*
+ * Return the current value of the gauge, summed over every shard.
+ */
+long metrics_gauge(int gauge);
+
+/*
+ * Record the status code of the response being sent by this process.
+ */
+void metrics_note_status(int status);
+
+/*
+ * Start timing the request being responded to by this (child) process,
+ * given the times at which it was accepted and its start line was parsed.
+ */
+void metrics_request_begin(long accepted_ns, long parsed_ns);
+
+/*
+ * Record the phases of a filter request: parse and queue times come from
+ * metrics_request_begin, and filter_ns and send_ns are measured by the
+ * caller.
+ */
+void metrics_filter_phases(const char *filter, long filter_ns, long send_ns);
+
+/*
+ * Add the hardware counter totals of one run of the filter (see perf.h).
+ */
+void metrics_filter_counters(const char *filter,
+                             const unsigned long counts[PERF_COUNTER_COUNT]);
+
+/*
+ * Count the request under the given route and the last noted status,
+ * and record its total latency.
+ */
+void metrics_request_end(int route);
+
+/*
+ * Count a request that the event loop answered itself, without forking.
+ */
+void metrics_count_request(int route, int status, long latency_ns);
+
+/*
+ * Return the route that the request is counted under.
+ */
+int metrics_route(const ReqData *req);
+
+/*
+ * Return the name that the route is exported under.
+ */
+const char *metrics_route_name(int route);
+
+/*
+ * Return the last status noted by this process.
+ */
+int metrics_status(void);
+
+/*
+ * Write all metrics to fd as an HTTP response in the Prometheus text
+ * exposition format.
+ */
+void metrics_response(int fd);
+
+#endif /* METRICS_H_ */
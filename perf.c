@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+#include "log.h"
+
+
+static const struct {
+    unsigned int type;
+    unsigned long config;
+    const char *name;
+} events[PERF_COUNTER_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, "cache_references"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, "branches"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+};
+
+static int profiling;
+
+
+/*
+ * There is no glibc wrapper for perf_event_open.
+ */
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                           int group_fd, unsigned long flags) {
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+
+int perf_init(int enabled) {
+    if (!enabled) {
+        return -1;
+    }
+    // Check that every event can actually be opened here (the PMU may be
+    // missing in a VM, or the paranoid setting may forbid it).
+    PerfGroup group;
+    if (perf_group_open(&group) < 0) {
+        perror("perf_event_open");
+        fprintf(stderr, "Filter profiling is unavailable\n");
+        return -1;
+    }
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        close(group.fds[i]);
+    }
+    profiling = 1;
+    return 0;
+}
+
+
+int perf_profiling(void) {
+    return profiling;
+}
+
+
+int perf_group_open(PerfGroup *group) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = (i == 0);     // The leader starts and stops the group.
+        attr.inherit = 1;             // Follow the filter into its process.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Inherited counters can't be read as a group, so each is read on
+        // its own, with the times needed to scale for multiplexing.
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int leader = (i == 0) ? -1 : group->fds[0];
+        group->fds[i] = perf_event_open(&attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        if (group->fds[i] < 0) {
+            for (int j = 0; j < i; j++) {
+                close(group->fds[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void perf_group_start(PerfGroup *group) {
+    ioctl(group->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+
+int perf_group_stop(PerfGroup *group, unsigned long counts[PERF_COUNTER_COUNT]) {
+    ioctl(group->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    int result = 0;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        // value, time enabled, time running
+        unsigned long values[3];
+        if (read(group->fds[i], values, sizeof(values)) != sizeof(values)) {
+            log_msg(LOG_WARN, "Couldn't read %s counter", events[i].name);
+            result = -1;
+            counts[i] = 0;
+        } else if (values[2] > 0 && values[2] < values[1]) {
+            counts[i] = (unsigned long) ((double) values[0] * values[1] / values[2]);
+        } else {
+            counts[i] = values[0];
+        }
+        close(group->fds[i]);
+    }
+    return result;
+}
+
+
+const char *perf_counter_name(int counter) {
+    return events[counter].name;
+}
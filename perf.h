@@ -0,0 +1,63 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+// Hardware events counted around each filter run when profiling is on.
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,
+    PERF_CACHE_MISSES,       // Usually last-level cache misses.
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_COUNT
+};
+
+// Bytes moved to or from memory per last-level cache miss, used to
+// estimate a filter's memory bandwidth.
+#define PERF_CACHE_LINE 64
+
+// A group of counters, one per event, scheduled onto the PMU together.
+typedef struct {
+    int fds[PERF_COUNTER_COUNT];
+} PerfGroup;
+
+
+/*
+ * Turn counter profiling of filters on, if enabled is non-zero and the
+ * kernel allows this process to count its own hardware events (see
+ * /proc/sys/kernel/perf_event_paranoid). Must be called before forking.
+ * Return 0 if profiling is on, or -1 otherwise.
+ */
+int perf_init(int enabled);
+
+/*
+ * Return 1 if filters are being profiled, 0 otherwise.
+ */
+int perf_profiling(void);
+
+/*
+ * Open a disabled group of counters for this process and any children it
+ * forks afterwards, counting user-space events only.
+ * Return 0 on success, or -1 on failure.
+ */
+int perf_group_open(PerfGroup *group);
+
+/*
+ * Reset the group's counters to zero and start counting.
+ */
+void perf_group_start(PerfGroup *group);
+
+/*
+ * Stop counting, store each counter's value in counts (scaled up if the
+ * counters had to share the PMU with other events), and close the group.
+ * Counts from children are only included once they have been reaped.
+ * Return 0 on success, or -1 if the counters could not be read.
+ */
+int perf_group_stop(PerfGroup *group, unsigned long counts[PERF_COUNTER_COUNT]);
+
+/*
+ * Return the name that the counter is exported under.
+ */
+const char *perf_counter_name(int counter);
+
+#endif /* PERF_H_ */
@@ -0,0 +1,748 @@
+#define _GNU_SOURCE  // memfd_create
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "remote.h"
+#include "socket.h"
+#include "request.h"
+#include "response.h"
+#include "metrics.h"
+#include "results.h"
+#include "sidecar.h"
+#include "store.h"
+#include "log.h"
+
+typedef struct {
+    char host[MAX_HOSTNAME];
+    int port;
+} RemoteWorker;
+
+typedef struct {
+    uint64_t point;
+    int worker;
+} RingPoint;
+
+static RemoteWorker workers[MAX_REMOTE_WORKERS];
+static int num_workers;
+static RingPoint ring[MAX_REMOTE_WORKERS * REMOTE_VNODES];
+static int ring_size;
+
+// Pooled connections to the workers. The pool belongs to one event loop:
+// its health thread connects and checks them, and the children it forks
+// borrow them for their jobs. A slot is claimed by moving it from
+// SLOT_FREE (or SLOT_BROKEN, to reconnect it) to SLOT_BUSY, and the health
+// thread takes back the slots of children that died holding them.
+enum {
+    SLOT_FREE,
+    SLOT_BUSY,
+    SLOT_BROKEN,
+};
+
+typedef struct {
+    int state;
+    int fd;
+    // Incremented whenever fd is replaced. A child only uses connections
+    // that were open when it was forked, since a socket opened later isn't
+    // in its descriptor table.
+    unsigned long generation;
+    pid_t borrower;           // The process holding a busy slot, or 0.
+} PoolSlot;
+
+typedef struct {
+    int healthy[MAX_REMOTE_WORKERS];
+    PoolSlot slots[MAX_REMOTE_WORKERS][REMOTE_POOL_SIZE];
+} RemotePool;
+
+static RemotePool *pool;
+static unsigned long forked_generation[MAX_REMOTE_WORKERS][REMOTE_POOL_SIZE];
+
+
+/******************************************************************************
+ * Framing
+ *****************************************************************************/
+
+/*
+ * Write or read exactly len bytes. Return 0 on success, or -1 if the
+ * connection failed, closed or timed out.
+ */
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Send a frame header, and the name after it if there is one.
+ * Return 0 on success, or -1.
+ */
+static int send_frame(int fd, int type, int status, const char *name,
+                      uint64_t body_len, const unsigned char *hash) {
+    FrameHeader h;
+    memset(&h, 0, sizeof(h));
+    size_t name_len = name == NULL ? 0 : strlen(name);
+    h.magic = htobe32(REMOTE_MAGIC);
+    h.type = htobe32(type);
+    h.status = htobe32(status);
+    h.name_len = htobe32(name_len);
+    h.body_len = htobe64(body_len);
+    if (hash != NULL) {
+        memcpy(h.hash, hash, SHA256_SIZE);
+    }
+    if (send_all(fd, &h, sizeof(h)) < 0) {
+        return -1;
+    }
+    return name_len > 0 ? send_all(fd, name, name_len) : 0;
+}
+
+
+/*
+ * Receive a frame header into h, converting it to host byte order, and
+ * its name into name, which has room for size bytes.
+ * Return 0 on success, or -1 if the connection failed or the frame is
+ * malformed.
+ */
+static int recv_frame(int fd, FrameHeader *h, char *name, size_t size) {
+    if (recv_all(fd, h, sizeof(*h)) < 0) {
+        return -1;
+    }
+    h->magic = be32toh(h->magic);
+    h->type = be32toh(h->type);
+    h->status = be32toh(h->status);
+    h->name_len = be32toh(h->name_len);
+    h->body_len = be64toh(h->body_len);
+    if (h->magic != REMOTE_MAGIC || h->name_len >= size ||
+            recv_all(fd, name, h->name_len) < 0) {
+        return -1;
+    }
+    name[h->name_len] = '\0';
+    return 0;
+}
+
+
+/*
+ * Send len bytes of the file in_fd, from its start.
+ * Return 0 on success, or -1.
+ */
+static int send_file(int fd, int in_fd, off_t len) {
+    off_t offset = 0;
+    while (offset < len) {
+        if (sendfile(fd, in_fd, &offset, len - offset) <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Receive len bytes into out_fd, hashing them into hash if it isn't NULL.
+ * Return 0 on success, or -1.
+ */
+static int recv_file(int fd, int out_fd, uint64_t len, unsigned char *hash) {
+    char buf[64 * 1024];
+    Sha256 ctx;
+    sha256_init(&ctx);
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len < sizeof(buf) ? len : sizeof(buf), 0);
+        if (n <= 0 || write(out_fd, buf, n) != n) {
+            return -1;
+        }
+        sha256_update(&ctx, buf, n);
+        len -= n;
+    }
+    if (hash != NULL) {
+        sha256_final(&ctx, hash);
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * Front end
+ *****************************************************************************/
+
+static uint64_t hash_point(const unsigned char *digest) {
+    uint64_t point = 0;
+    for (int i = 0; i < 8; i++) {
+        point = (point << 8) | digest[i];
+    }
+    return point;
+}
+
+
+static int compare_points(const void *a, const void *b) {
+    uint64_t x = ((const RingPoint *) a)->point;
+    uint64_t y = ((const RingPoint *) b)->point;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Put REMOTE_VNODES points for every worker on the ring, at the hashes of
+ * "host:port#n", so that adding or removing a worker only moves the images
+ * next to its points.
+ */
+static void build_ring(void) {
+    ring_size = 0;
+    for (int w = 0; w < num_workers; w++) {
+        for (int n = 0; n < REMOTE_VNODES; n++) {
+            char label[MAX_HOSTNAME + 32];
+            unsigned char digest[SHA256_SIZE];
+            Sha256 ctx;
+            snprintf(label, sizeof(label), "%.*s:%d#%d", MAX_HOSTNAME - 1,
+                     workers[w].host, workers[w].port, n);
+            sha256_init(&ctx);
+            sha256_update(&ctx, label, strlen(label));
+            sha256_final(&ctx, digest);
+            ring[ring_size].point = hash_point(digest);
+            ring[ring_size].worker = w;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(ring[0]), compare_points);
+}
+
+
+int remote_add_workers(const char *spec) {
+    char copy[MAXLINE];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char *saveptr;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+            item = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strrchr(item, ':');
+        if (colon == NULL || num_workers == MAX_REMOTE_WORKERS ||
+                colon - item >= MAX_HOSTNAME) {
+            return -1;
+        }
+        *colon = '\0';
+        strcpy(workers[num_workers].host, item);
+        workers[num_workers].port = strtol(colon + 1, NULL, 10);
+        num_workers++;
+    }
+    build_ring();
+    return 0;
+}
+
+
+int remote_enabled(void) {
+    return num_workers > 0;
+}
+
+
+static int claim_slot(PoolSlot *slot, int from) {
+    if (!__atomic_compare_exchange_n(&slot->state, &from, SLOT_BUSY, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_store_n(&slot->borrower, getpid(), __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+static void release_slot(PoolSlot *slot, int state) {
+    __atomic_store_n(&slot->borrower, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+}
+
+
+static int alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/*
+ * Mark the slots of worker w held by processes that have died as broken,
+ * since the job they were running may have been left half done.
+ */
+static void reclaim_slots(int w) {
+    for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+        PoolSlot *slot = &pool->slots[w][i];
+        pid_t borrower = __atomic_load_n(&slot->borrower, __ATOMIC_ACQUIRE);
+        // Only the borrower clears its pid, so if it is still there the
+        // slot hasn't been released, and never will be.
+        if (borrower != 0 && !alive(borrower) &&
+                __atomic_compare_exchange_n(&slot->borrower, &borrower, 0, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            log_msg(LOG_WARN, "Process [%d] died holding a connection to %s:%d",
+                    borrower, workers[w].host, workers[w].port);
+            release_slot(slot, SLOT_BROKEN);
+        }
+    }
+}
+
+
+static void set_timeout(int fd, long ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+/*
+ * Open a connection to worker w, set up for jobs. Return it, or -1.
+ */
+static int connect_worker(int w) {
+    int fd = try_connect_to_server(workers[w].port, workers[w].host);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        set_timeout(fd, REMOTE_JOB_SEC * 1000L);
+    }
+    return fd;
+}
+
+
+/*
+ * Return 1 if the worker on the other end of fd answers a ping in time,
+ * 0 otherwise.
+ */
+static int ping(int fd) {
+    FrameHeader h;
+    char name[1];
+    set_timeout(fd, REMOTE_PING_MS);
+    int ok = send_frame(fd, FRAME_PING, 0, NULL, 0, NULL) == 0 &&
+             recv_frame(fd, &h, name, sizeof(name)) == 0 && h.type == FRAME_PONG;
+    set_timeout(fd, REMOTE_JOB_SEC * 1000L);
+    return ok;
+}
+
+
+/*
+ * Reconnect worker w's broken connections, then ping it on a free one.
+ * While the worker is down, reconnecting is tried less and less often.
+ */
+static void check_worker(int w) {
+    static long retry_at[MAX_REMOTE_WORKERS];
+    static long backoff_ms[MAX_REMOTE_WORKERS];
+    long now = metrics_now_ns();
+    reclaim_slots(w);
+    if (now < retry_at[w]) {
+        return;
+    }
+
+    int connected = 0;
+    for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+        PoolSlot *slot = &pool->slots[w][i];
+        if (claim_slot(slot, SLOT_BROKEN)) {
+            int fd = connect_worker(w);
+            if (slot->fd >= 0) {
+                close(slot->fd);
+            }
+            __atomic_add_fetch(&slot->generation, 1, __ATOMIC_SEQ_CST);
+            slot->fd = fd;
+            release_slot(slot, fd >= 0 ? SLOT_FREE : SLOT_BROKEN);
+            if (fd < 0) {
+                break;
+            }
+        }
+        connected |= slot->fd >= 0;
+    }
+
+    int healthy = 0;
+    if (connected) {
+        healthy = pool->healthy[w];
+        for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+            PoolSlot *slot = &pool->slots[w][i];
+            if (claim_slot(slot, SLOT_FREE)) {
+                healthy = ping(slot->fd);
+                release_slot(slot, healthy ? SLOT_FREE : SLOT_BROKEN);
+                break;
+            }
+        }
+    }
+    if (!healthy) {
+        // The other idle connections are most likely dead too.
+        for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+            if (claim_slot(&pool->slots[w][i], SLOT_FREE)) {
+                release_slot(&pool->slots[w][i], SLOT_BROKEN);
+            }
+        }
+        backoff_ms[w] = backoff_ms[w] == 0 ? REMOTE_HEALTH_MS : backoff_ms[w] * 2;
+        if (backoff_ms[w] > REMOTE_MAX_BACKOFF_MS) {
+            backoff_ms[w] = REMOTE_MAX_BACKOFF_MS;
+        }
+        retry_at[w] = now + backoff_ms[w] * 1000000L;
+    } else {
+        backoff_ms[w] = 0;
+    }
+    if (healthy != pool->healthy[w]) {
+        log_msg(healthy ? LOG_INFO : LOG_WARN, "Job worker %s:%d is %s",
+                workers[w].host, workers[w].port, healthy ? "up" : "down");
+    }
+    __atomic_store_n(&pool->healthy[w], healthy, __ATOMIC_RELEASE);
+}
+
+
+static void *health_thread(void *arg) {
+    while (1) {
+        usleep(REMOTE_HEALTH_MS * 1000L);
+        for (int w = 0; w < num_workers; w++) {
+            check_worker(w);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Remember which connections the new child has, for its use of the pool.
+ */
+static void snapshot_generations(void) {
+    for (int w = 0; w < num_workers; w++) {
+        for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+            forked_generation[w][i] =
+                __atomic_load_n(&pool->slots[w][i].generation, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+
+void remote_pool_init(void) {
+    pool = mmap(NULL, sizeof(RemotePool), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("mmap");
+        pool = NULL;
+        return;
+    }
+    for (int w = 0; w < num_workers; w++) {
+        for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+            pool->slots[w][i].state = SLOT_BROKEN;
+            pool->slots[w][i].fd = -1;
+        }
+        check_worker(w);
+    }
+    pthread_atfork(NULL, NULL, snapshot_generations);
+
+    // The event loop takes SIGCHLD through a signalfd, so the thread must
+    // not take it instead.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, health_thread, NULL) != 0) {
+        perror("pthread_create");
+    } else {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/*
+ * Return the first healthy worker at or after the hash's point on the
+ * ring, or -1 if none are healthy.
+ */
+static int pick_worker(const unsigned char hash[SHA256_SIZE]) {
+    uint64_t point = hash_point(hash);
+    int lo = 0, hi = ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].point < point) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = 0; i < ring_size; i++) {
+        int w = ring[(lo + i) % ring_size].worker;
+        if (__atomic_load_n(&pool->healthy[w], __ATOMIC_ACQUIRE)) {
+            return w;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Borrow a pooled connection to worker w, or open a new one if none are
+ * free. Store the pool slot in *slot (-1 for a new connection).
+ * Return the connection, or -1.
+ */
+static int borrow_connection(int w, int *slot) {
+    for (int i = 0; i < REMOTE_POOL_SIZE; i++) {
+        PoolSlot *s = &pool->slots[w][i];
+        if (claim_slot(s, SLOT_FREE)) {
+            if (s->generation == forked_generation[w][i] && s->fd >= 0) {
+                *slot = i;
+                return s->fd;
+            }
+            release_slot(s, SLOT_FREE);
+        }
+    }
+    *slot = -1;
+    return connect_worker(w);
+}
+
+
+/*
+ * Return a connection from borrow_connection, which is broken if ok is 0.
+ */
+static void return_connection(int w, int slot, int fd, int ok) {
+    if (slot < 0) {
+        close(fd);
+    } else {
+        release_slot(&pool->slots[w][slot], ok ? SLOT_FREE : SLOT_BROKEN);
+    }
+}
+
+
+// run_job's result when the job failed on this side. The connection is
+// left partway through the exchange, but the worker is fine.
+#define JOB_LOCAL_ERROR -2
+
+/*
+ * Run the job on the connection fd. Store the result's descriptor in
+ * *result_fd, or -1 if the worker couldn't run the filter.
+ * Return 0 if the exchange completed, -1 if the connection failed or the
+ * worker broke the protocol, or JOB_LOCAL_ERROR.
+ */
+static int run_job(int fd, const char *filter, const char *image_path,
+                   const unsigned char hash[SHA256_SIZE], int *result_fd) {
+    FrameHeader h;
+    char name[1];
+    *result_fd = -1;
+    if (send_frame(fd, FRAME_JOB, 0, filter, 0, hash) < 0 ||
+            recv_frame(fd, &h, name, sizeof(name)) < 0) {
+        return -1;
+    }
+    if (h.type == FRAME_NEED) {
+        struct stat st;
+        int image_fd = open(image_path, O_RDONLY);
+        if (image_fd < 0 || fstat(image_fd, &st) < 0) {
+            if (image_fd >= 0) {
+                close(image_fd);
+            }
+            return JOB_LOCAL_ERROR;
+        }
+        int sent = send_frame(fd, FRAME_IMAGE, 0, NULL, st.st_size, hash) == 0 &&
+                   send_file(fd, image_fd, st.st_size) == 0;
+        close(image_fd);
+        if (!sent || recv_frame(fd, &h, name, sizeof(name)) < 0) {
+            return -1;
+        }
+    }
+    if (h.type != FRAME_RESULT) {
+        return -1;
+    }
+    if (h.status != JOB_OK) {
+        return h.body_len == 0 ? 0 : -1;
+    }
+    int out = memfd_create("remote-result", MFD_CLOEXEC);
+    if (out < 0) {
+        perror("memfd_create");
+        return JOB_LOCAL_ERROR;
+    }
+    if (recv_file(fd, out, h.body_len, NULL) < 0) {
+        close(out);
+        return -1;
+    }
+    lseek(out, 0, SEEK_SET);
+    *result_fd = out;
+    return 0;
+}
+
+
+int remote_run_filter(const char *filter, const char *image_path,
+                      const unsigned char hash[SHA256_SIZE]) {
+    if (pool == NULL) {
+        return -1;
+    }
+    int w = pick_worker(hash);
+    if (w < 0) {
+        metrics_add(COUNTER_REMOTE_FAILOVERS, 1);
+        return -1;
+    }
+    int slot;
+    int result_fd = -1;
+    int fd = borrow_connection(w, &slot);
+    int result = fd < 0 ? -1 : run_job(fd, filter, image_path, hash, &result_fd);
+    if (fd >= 0) {
+        return_connection(w, slot, fd, result == 0);
+    }
+    if (result == JOB_LOCAL_ERROR) {
+        log_msg(LOG_WARN, "Job %s for %s:%d failed here; running it locally",
+                filter, workers[w].host, workers[w].port);
+    } else if (result < 0) {
+        // Leave it to the health check to bring the worker back.
+        __atomic_store_n(&pool->healthy[w], 0, __ATOMIC_RELEASE);
+        log_msg(LOG_WARN, "Job worker %s:%d failed; running %s locally",
+                workers[w].host, workers[w].port, filter);
+    }
+    if (result_fd < 0) {
+        metrics_add(COUNTER_REMOTE_FAILOVERS, 1);
+    } else {
+        metrics_add(COUNTER_REMOTE_JOBS, 1);
+    }
+    return result_fd;
+}
+
+
+/******************************************************************************
+ * Worker
+ *****************************************************************************/
+
+/*
+ * Receive a FRAME_IMAGE holding the contents with the given hash into the
+ * blob store. Return 0 on success, or -1.
+ */
+static int receive_image(int fd, const unsigned char hash[SHA256_SIZE]) {
+    FrameHeader h;
+    char name[1];
+    char tmp_path[MAXLINE];
+    unsigned char actual[SHA256_SIZE];
+    if (recv_frame(fd, &h, name, sizeof(name)) < 0 || h.type != FRAME_IMAGE ||
+            h.body_len > DEFAULT_MAX_UPLOAD_BYTES) {
+        return -1;
+    }
+    int out = store_create_upload(tmp_path, sizeof(tmp_path));
+    if (out < 0) {
+        return -1;
+    }
+    int received = recv_file(fd, out, h.body_len, actual);
+    close(out);
+    if (received < 0 || memcmp(actual, hash, SHA256_SIZE) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    if (store_commit_blob(tmp_path, hash) > 0) {
+        char path[MAX_BLOB_PATH];
+        store_blob_path(hash, path, sizeof(path));
+        make_sidecar(path, hash);
+    }
+    return 0;
+}
+
+
+/*
+ * Answer one FRAME_JOB for filter. Return 0 on success, or -1 if the
+ * connection failed.
+ */
+static int serve_job(int fd, const char *filter, const unsigned char hash[SHA256_SIZE]) {
+    char path[MAX_BLOB_PATH];
+    store_blob_path(hash, path, sizeof(path));
+    if (access(path, R_OK) < 0) {
+        if (send_frame(fd, FRAME_NEED, 0, NULL, 0, hash) < 0 ||
+                receive_image(fd, hash) < 0) {
+            return -1;
+        }
+    }
+
+    int result_fd = -1;
+    if (strchr(filter, '/') == NULL) {
+        result_fd = open_result(path, filter);
+        if (result_fd < 0) {
+            result_fd = run_named_filter(filter, path);
+            if (result_fd >= 0) {
+                save_result(path, filter, result_fd);
+            }
+        }
+    }
+    struct stat st;
+    if (result_fd < 0 || fstat(result_fd, &st) < 0) {
+        log_msg(LOG_WARN, "Job %s failed", filter);
+        if (result_fd >= 0) {
+            close(result_fd);
+        }
+        return send_frame(fd, FRAME_RESULT, JOB_FAILED, NULL, 0, hash);
+    }
+    int sent = send_frame(fd, FRAME_RESULT, JOB_OK, NULL, st.st_size, hash) == 0 &&
+               send_file(fd, result_fd, st.st_size) == 0;
+    close(result_fd);
+    return sent ? 0 : -1;
+}
+
+
+/*
+ * Answer frames from a front end until it disconnects.
+ */
+static void serve_connection(int fd) {
+    FrameHeader h;
+    char filter[MAXLINE];
+    while (recv_frame(fd, &h, filter, sizeof(filter)) == 0) {
+        int result;
+        if (h.type == FRAME_PING) {
+            result = send_frame(fd, FRAME_PONG, 0, NULL, 0, NULL);
+        } else if (h.type == FRAME_JOB) {
+            long start = metrics_now_ns();
+            result = serve_job(fd, filter, h.hash);
+            log_msg(LOG_INFO, "Job %s took %ld us", filter,
+                    (metrics_now_ns() - start) / 1000);
+        } else {
+            result = -1;
+        }
+        if (result < 0) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+
+void run_job_server(int listenfd) {
+    if ((mkdir(STORE_DIR, 0755) < 0 && errno != EEXIST) ||
+            (mkdir(BLOB_DIR, 0755) < 0 && errno != EEXIST) ||
+            (mkdir(CACHE_DIR, 0755) < 0 && errno != EEXIST) ||
+            (mkdir(SIDECAR_DIR, 0755) < 0 && errno != EEXIST)) {
+        perror("mkdir");
+        exit(1);
+    }
+    // Connections are long-lived, so each gets its own process, reaped
+    // automatically.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &sa, NULL);
+    while (1) {
+        int fd = accept_connection(listenfd);
+        if (fd < 0) {
+            continue;
+        }
+        int pid = fork();
+        if (pid == 0) {
+            close(listenfd);
+            // Filters run by the connection wait for their own children.
+            sa.sa_flags = 0;
+            sigaction(SIGCHLD, &sa, NULL);
+            serve_connection(fd);
+            exit(0);
+        } else if (pid < 0) {
+            perror("fork");
+        }
+        close(fd);
+    }
+}
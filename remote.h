@@ -0,0 +1,91 @@
+#ifndef REMOTE_H_
+#define REMOTE_H_
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+// Filter jobs can be run by other image_server processes started as job
+// workers (-J), over a framed TCP protocol. Every frame starts with a
+// FrameHeader, with its integers in network byte order, followed by
+// name_len bytes of name and body_len bytes of body:
+//
+//   front end                               worker
+//   FRAME_PING                          ->
+//                                       <-  FRAME_PONG
+//   FRAME_JOB (name: filter, hash)      ->
+//                                       <-  FRAME_NEED, if it doesn't have
+//   FRAME_IMAGE (body: the bitmap)      ->  the image with that hash
+//                                       <-  FRAME_RESULT (status, body)
+//
+// The front end picks a worker for each job by consistent hashing on the
+// image's content hash, so that the same image always goes to the same
+// worker while it is healthy, and its cached results stay useful there.
+#define REMOTE_MAGIC 0x494d474a   // "IMGJ"
+
+enum {
+    FRAME_PING,
+    FRAME_PONG,
+    FRAME_JOB,
+    FRAME_NEED,
+    FRAME_IMAGE,
+    FRAME_RESULT,
+};
+
+// Statuses of a FRAME_RESULT.
+#define JOB_OK 0
+#define JOB_FAILED 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t status;
+    uint32_t name_len;
+    uint64_t body_len;
+    unsigned char hash[SHA256_SIZE];
+} FrameHeader;
+
+#define MAX_REMOTE_WORKERS 16
+#define REMOTE_POOL_SIZE 4        // Pooled connections per worker, per event loop.
+#define REMOTE_VNODES 64          // Points per worker on the hash ring.
+#define REMOTE_HEALTH_MS 1000     // Time between health checks.
+#define REMOTE_PING_MS 200        // Time allowed to answer a health check.
+#define REMOTE_MAX_BACKOFF_MS 30000  // Longest wait between reconnects.
+#define REMOTE_JOB_SEC 30         // Longest gap between reads during a job.
+
+
+/*
+ * Add the job workers listed in spec, as comma-separated host:port pairs.
+ * Return 0 on success, or -1 if spec is malformed or lists too many.
+ */
+int remote_add_workers(const char *spec);
+
+/*
+ * Return 1 if any job workers were added, 0 otherwise.
+ */
+int remote_enabled(void);
+
+/*
+ * Set up this event loop's connection pool and start checking the health
+ * of the workers in a background thread. Children forked afterwards share
+ * the pool.
+ */
+void remote_pool_init(void);
+
+/*
+ * Run filter on the image at image_path, whose contents hash to hash, on
+ * the worker that owns the hash.
+ * Return a file descriptor for a temporary file holding the result,
+ * positioned at its start, or -1 if no worker could run it (the caller
+ * then runs it locally).
+ */
+int remote_run_filter(const char *filter, const char *image_path,
+                      const unsigned char hash[SHA256_SIZE]);
+
+/*
+ * Serve filter jobs from front ends on listenfd, forking a process per
+ * connection. Never returns.
+ */
+void run_job_server(int listenfd);
+
+#endif /* REMOTE_H_ */
@@ -0,0 +1,106 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "reply.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+
+
+void reply_init(Reply *reply, int fd) {
+    reply->fd = fd;
+    reply->count = 0;
+    reply->used = 0;
+}
+
+
+void reply_add(Reply *reply, const void *buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (reply->count == REPLY_MAX_PIECES) {
+        reply_send(reply, 1);
+    }
+    if (reply->count > 0) {
+        struct iovec *last = &reply->pieces[reply->count - 1];
+        if ((char *)last->iov_base + last->iov_len == buf) {
+            // Contiguous with the last piece, as formatted pieces usually are.
+            last->iov_len += len;
+            return;
+        }
+    }
+    reply->pieces[reply->count].iov_base = (void *)buf;
+    reply->pieces[reply->count].iov_len = len;
+    reply->count++;
+}
+
+
+void reply_add_str(Reply *reply, const char *str) {
+    reply_add(reply, str, strlen(str));
+}
+
+
+void reply_printf(Reply *reply, const char *format, ...) {
+    va_list args;
+    for (int tries = 0; tries < 2; tries++) {
+        size_t room = REPLY_SCRATCH_SIZE - reply->used;
+        va_start(args, format);
+        int n = vsnprintf(reply->scratch + reply->used, room, format, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < room) {
+            char *piece = reply->scratch + reply->used;
+            reply->used += n;
+            reply_add(reply, piece, n);
+            return;
+        }
+        // Out of scratch space: send what is there, which frees all of it.
+        reply_send(reply, 1);
+    }
+    log_msg(LOG_WARN, "reply_printf: piece longer than %d bytes dropped",
+            REPLY_SCRATCH_SIZE);
+}
+
+
+int reply_send(Reply *reply, int more) {
+    struct msghdr msg = {0};
+    msg.msg_iov = reply->pieces;
+    msg.msg_iovlen = reply->count;
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    int result = 0;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(reply->fd, &msg, flags);
+        if (n < 0 && errno == ENOTSOCK) {
+            // Not a socket (say, a file in a test), so there is no MSG_MORE.
+            n = writev(reply->fd, msg.msg_iov, msg.msg_iovlen);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_WARN, "sendmsg: %s", strerror(errno));
+            result = -1;
+            break;
+        }
+        metrics_add(COUNTER_BYTES_OUT, n);
+        trace_response_bytes();
+        // Skip past what was sent, which may end part-way through a piece.
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    reply->count = 0;
+    reply->used = 0;
+    return result;
+}
@@ -0,0 +1,57 @@
+#ifndef REPLY_H_
+#define REPLY_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// A Reply collects the pieces of a response (status line, headers, body)
+// so that they go to the client in one writev-style call, and so in as few
+// TCP segments as possible, instead of one small write each.
+//
+// Pieces added with reply_add are referenced, not copied, and must stay
+// valid until the reply is sent. Pieces added with reply_printf are
+// formatted into the reply's own scratch space. If either runs out, the
+// pieces so far are sent early, marked as having more to follow.
+#define REPLY_MAX_PIECES 64
+#define REPLY_SCRATCH_SIZE 8192
+
+typedef struct {
+    int fd;
+    int count;
+    struct iovec pieces[REPLY_MAX_PIECES];
+    size_t used;
+    char scratch[REPLY_SCRATCH_SIZE];
+} Reply;
+
+
+/*
+ * Start an empty reply to the client on fd.
+ */
+void reply_init(Reply *reply, int fd);
+
+/*
+ * Add len bytes at buf to the reply, without copying them.
+ */
+void reply_add(Reply *reply, const void *buf, size_t len);
+
+/*
+ * Add a nul-terminated string to the reply, without copying it.
+ */
+void reply_add_str(Reply *reply, const char *str);
+
+/*
+ * Format a piece of the reply, as printf does, into its scratch space.
+ */
+void reply_printf(Reply *reply, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Send everything added to the reply, and count it as sent to the client.
+ * If more is non-zero, the kernel is told that more data (say, a sendfile
+ * body) follows straight away, so that it doesn't send a short segment
+ * with just the headers.
+ * The reply is empty again afterwards. Return 0, or -1 if sending failed.
+ */
+int reply_send(Reply *reply, int more);
+
+#endif /* REPLY_H_ */
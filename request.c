@@ -1,6 +1,12 @@
 #include "request.h"
 #include "response.h"
+#include "metrics.h"
+#include "log.h"
+#include "bitmap.h"
+#include "uring.h"
+#include <errno.h>
 #include <string.h>
+#include <sys/socket.h>
 
 
 /******************************************************************************
@@ -10,6 +16,9 @@ ClientState *init_clients(int n) {
     ClientState *clients = malloc(sizeof(ClientState) * n);
     for (int i = 0; i < n; i++) {
         clients[i].sock = -1;  // -1 here indicates available entry
+        clients[i].num_bytes = 0;
+        clients[i].reqData = NULL;
+        timer_init(&clients[i].timer);
     }
     return clients;
 }
@@ -17,6 +26,7 @@ ClientState *init_clients(int n) {
 /*
  * Remove the client from the client array, free any memory allocated for
  * fields of the ClientState struct, and close the socket.
+ * The caller is responsible for cancelling the client's timer.
  */
 void remove_client(ClientState *cs) {
     if (cs->reqData != NULL) {
@@ -96,19 +106,24 @@ int read_from_client(ClientState *client) {
     if (read_result <= -1){
         return -1;
     }else{
-        client->num_bytes+=read_result;
-        client->buf[client->num_bytes] = '\0';
+        note_client_read(client, read_result);
         return read_result;
     }
     return -1;
 }
 
 
+void note_client_read(ClientState *client, int n) {
+    client->num_bytes += n;
+    client->buf[client->num_bytes] = '\0';
+    metrics_add(COUNTER_BYTES_IN, n);
+}
+
+
 /*****************************************************************************
  * Parsing the start line of an HTTP request.
  ****************************************************************************/
 // Helper function declarations.
-void parse_query(ReqData *req, const char *str);
 void update_fdata(Fdata *f, const char *str);
 void fdata_free(Fdata *f);
 void log_request(const ReqData *req);
@@ -182,7 +197,7 @@ void parse_query(ReqData *req, const char *str) {
 
     //char *str_copy=malloc(sizeof(char)*MAXLINE);
     char str_copy[sizeof(char)*MAXLINE];
-    strncpy(str_copy, str, strlen(str));
+    snprintf(str_copy, sizeof(str_copy), "%s", str);
     strtok(str_copy, " ");
     strtok(NULL, "?");
 
@@ -191,7 +206,8 @@ void parse_query(ReqData *req, const char *str) {
     int counter = 0;
     char **pairs=malloc(sizeof(char*)*MAX_QUERY_PARAMS);
     char *query_result = strtok(queries, "&");
-    while(query_result!=NULL){
+    // Parameters beyond MAX_QUERY_PARAMS are ignored.
+    while(query_result!=NULL && counter < MAX_QUERY_PARAMS){
         pairs[counter] = query_result;
         query_result = strtok(NULL, "&");
         counter++;
@@ -201,6 +217,10 @@ void parse_query(ReqData *req, const char *str) {
     for (int index = 0; index < counter; index++){
         char *name = strtok(pairs[index], "=");
         char *value =  strtok(NULL, "=");
+        if (value == NULL) {
+            // An empty form field, e.g. "bias=".
+            value = "";
+        }
 
         char *param_name = malloc(sizeof(char)*(strlen(name)+1));
         char *param_value = malloc(sizeof(char)*(strlen(value)+1));
@@ -218,12 +238,12 @@ void parse_query(ReqData *req, const char *str) {
 
 
 /*
- * Print information stored in the given request data to stderr.
+ * Log information stored in the given request data.
  */
 void log_request(const ReqData *req) {
-    fprintf(stderr, "Request parsed: [%s] [%s]\n", req->method, req->path);
+    log_msg(LOG_INFO, "Request parsed: [%s] [%s]", req->method, req->path);
     for (int i = 0; i < MAX_QUERY_PARAMS && req->params[i].name != NULL; i++) {
-        fprintf(stderr, "  %s -> %s\n",
+        log_msg(LOG_DEBUG, "  %s -> %s",
                 req->params[i].name, req->params[i].value);
     }
 }
@@ -302,6 +322,153 @@ char *get_bitmap_filename(ClientState *client, const char *boundary) {
     return filename;
 }
 
+static long max_upload_bytes = DEFAULT_MAX_UPLOAD_BYTES;
+static int max_upload_dimension = DEFAULT_MAX_DIMENSION;
+
+
+void set_upload_limits(long max_bytes, int max_dimension) {
+    max_upload_bytes = max_bytes;
+    max_upload_dimension = max_dimension;
+}
+
+
+/*
+ * Check the bitmap headers at the start of client->buf against the upload
+ * limits, and store the dimensions and file size in info.
+ * Return 0 if the upload can go ahead, or UPLOAD_INVALID or
+ * UPLOAD_TOO_LARGE.
+ */
+static int check_upload_header(ClientState *client, UploadInfo *info) {
+    const unsigned char *header = (const unsigned char *) client->buf;
+    int offset;
+    if (parse_bitmap_header(header, &offset, &info->width, &info->height) < 0) {
+        return UPLOAD_INVALID;
+    }
+    info->size = read_bitmap_file_size(header);
+    if (info->width > max_upload_dimension || info->height > max_upload_dimension) {
+        return UPLOAD_TOO_LARGE;
+    }
+    // The size must leave room for the pixels, which the rest of the server
+    // relies on when reading the file.
+    if (info->size < offset + (long) BMP_ROW_SIZE(info->width) * info->height) {
+        return UPLOAD_INVALID;
+    }
+    if (info->size > max_upload_bytes) {
+        return UPLOAD_TOO_LARGE;
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for the next completion on ring, for at most timeout_ms (or forever
+ * if it is -1). Return it, or NULL if the wait timed out or failed.
+ */
+static struct io_uring_cqe *wait_completion(Uring *ring, int timeout_ms) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(ring)) == NULL) {
+        if (uring_submit(ring, 1, timeout_ms) < 0 && errno != EINTR) {
+            return NULL;
+        }
+    }
+    return cqe;
+}
+
+
+/*
+ * The rest of save_file_upload, through io_uring: the pixels are received
+ * in UPLOAD_CHUNK pieces, and each piece is written to the file and hashed
+ * while the next one is being received, with one system call per piece.
+ * The first piece is what is already in client->buf.
+ * Return the number of bytes written, or UPLOAD_CLOSED.
+ */
+static long save_upload_with_uring(Uring *ring, ClientState *client, int file_fd,
+                                   const UploadInfo *info, Sha256 *hash) {
+    // The event loop's idle timeout, from respond_to_client.
+    struct timeval idle = {0, 0};
+    socklen_t idle_len = sizeof(idle);
+    getsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &idle, &idle_len);
+    int timeout_ms = idle.tv_sec > 0 || idle.tv_usec > 0 ?
+                     idle.tv_sec * 1000 + idle.tv_usec / 1000 : -1;
+
+    char *bufs[2] = {malloc(UPLOAD_CHUNK), malloc(UPLOAD_CHUNK)};
+    char *pending = client->buf;
+    long pending_len = client->num_bytes < info->size ? client->num_bytes : info->size;
+    long received = pending_len;
+    long written = 0;
+    long result = UPLOAD_CLOSED;
+    int next = 0;
+    int outstanding = 0;
+    client->num_bytes = 0;
+    while (pending_len > 0) {
+        int receiving = received < info->size;
+        if (receiving) {
+            long len = info->size - received < UPLOAD_CHUNK ?
+                       info->size - received : UPLOAD_CHUNK;
+            uring_prep(ring, IORING_OP_RECV, client->sock, bufs[next], len, 0, 0);
+        }
+        uring_prep(ring, IORING_OP_WRITE, file_fd, pending, pending_len, written, 1);
+        uring_submit(ring, 0, -1);
+        // Hash the piece while the kernel is writing it.
+        sha256_update(hash, pending, pending_len);
+
+        long got = 0;
+        for (outstanding = receiving + 1; outstanding > 0; ) {
+            struct io_uring_cqe *cqe = wait_completion(ring, timeout_ms);
+            if (cqe == NULL) {
+                // The client stopped sending.
+                goto done;
+            }
+            int res = cqe->res;
+            int is_write = cqe->user_data == 1;
+            uring_seen(ring);
+            outstanding--;
+            if (is_write && res != pending_len) {
+                errno = res < 0 ? -res : EIO;
+                perror("write");
+                exit(1);
+            } else if (!is_write) {
+                if (res <= 0) {
+                    goto done;
+                }
+                got = res;
+                metrics_add(COUNTER_BYTES_IN, res);
+            }
+        }
+        written += pending_len;
+        pending = bufs[next];
+        pending_len = got;
+        received += got;
+        next ^= 1;
+    }
+    result = written;
+
+done:
+    // The kernel may still be receiving into a buffer or writing from one.
+    // Cancel the receive (user data 0), and wait for whatever is left to
+    // finish before freeing them; the cancellation completes as user data 2.
+    if (outstanding > 0) {
+        uring_prep(ring, IORING_OP_ASYNC_CANCEL, -1, (void *) 0, 0, 0, 2);
+        uring_submit(ring, 0, -1);
+        while (outstanding > 0) {
+            struct io_uring_cqe *cqe = wait_completion(ring, -1);
+            if (cqe == NULL) {
+                // Leave the buffers to the ring rather than risk the kernel
+                // writing into freed memory.
+                return result;
+            }
+            if (cqe->user_data != 2) {
+                outstanding--;
+            }
+            uring_seen(ring);
+        }
+    }
+    free(bufs[0]);
+    free(bufs[1]);
+    return result;
+}
+
+
 /*
  * Read the file data from the socket and write it to the file descriptor
  * file_fd.
@@ -312,38 +479,65 @@ char *get_bitmap_filename(ClientState *client, const char *boundary) {
  *    - extract the file size from the bitmap data, and use that to determine
  * how many bytes to read from the socket and write to the file
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd) {
-    // Read in the next two lines: Content-Type line, and empty line
-    remove_buffered_line(client);
-    remove_buffered_line(client);
-
-    int error;
-    int bytes_written=0;
-
-    // Getting size of file
-    int size;
-    memcpy(&size, &(client->buf[2]), sizeof(int));
-    while(bytes_written<size){
-        read_from_client(client);
-        // Writing last of data
-        if (size-bytes_written-client->num_bytes<=0){
-            error = write(file_fd, client->buf, size-bytes_written);
-            if (error!=size-bytes_written){
-                perror("write");
-                exit(1);
-            }
-            bytes_written+=size-bytes_written;
-        }else{
-            error = write(file_fd, client->buf, client->num_bytes);
-            if (error!=client->num_bytes){
-                perror("write");
-                exit(1);
+int save_file_upload(ClientState *client, const char *boundary, int file_fd,
+                     UploadInfo *info) {
+    // Skip the rest of the part's headers (its Content-Type line), up to
+    // the empty line before the data.
+    while (1) {
+        int where = find_network_newline(client->buf, client->num_bytes);
+        if (where < 0) {
+            if (read_from_client(client) <= 0) {
+                return UPLOAD_CLOSED;
             }
-            bytes_written+=client->num_bytes;
+            continue;
+        }
+        remove_buffered_line(client);
+        if (where == 2) {
+            break;
+        }
+    }
+
+    // Validate the bitmap before accepting any of it.
+    while (client->num_bytes < BMP_HEADER_SIZE) {
+        if (read_from_client(client) <= 0) {
+            return UPLOAD_CLOSED;
+        }
+    }
+    int error = check_upload_header(client, info);
+    if (error < 0) {
+        return error;
+    }
+
+    Sha256 hash;
+    sha256_init(&hash);
+    Uring ring;
+    if (uring_enabled() && uring_init(&ring, 4) == 0) {
+        long result = save_upload_with_uring(&ring, client, file_fd, info, &hash);
+        uring_close(&ring);
+        if (result >= 0) {
+            sha256_final(&hash, info->hash);
+        }
+        return result;
+    }
+    long bytes_written = 0;
+    while (bytes_written < info->size) {
+        if (client->num_bytes == 0 && read_from_client(client) <= 0) {
+            // The client closed the connection or stopped sending.
+            return UPLOAD_CLOSED;
+        }
+        // Writing buffered data, but nothing past the end of the file
+        int chunk = client->num_bytes;
+        if (chunk > info->size - bytes_written) {
+            chunk = info->size - bytes_written;
         }
-        if (client->num_bytes==MAXLINE-1){
-            client->num_bytes=0;
+        if (write(file_fd, client->buf, chunk) != chunk) {
+            perror("write");
+            exit(1);
         }
+        sha256_update(&hash, client->buf, chunk);
+        bytes_written += chunk;
+        client->num_bytes = 0;
     }
+    sha256_final(&hash, info->hash);
     return bytes_written;
 }
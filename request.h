@@ -6,8 +6,11 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "timer_wheel.h"
+#include "sha256.h"
 
-#define MAX_QUERY_PARAMS 5
+
+#define MAX_QUERY_PARAMS 8    // Enough for a convolve request (see kernels.h).
 #define MAXLINE 1024
 
 // String constants for parsing HTTP requests.
@@ -22,6 +25,18 @@
 
 #define POST_BOUNDARY_HEADER "Content-Type: multipart/form-data; boundary="
 
+// Default limits on uploaded bitmaps: enough for an 8K image.
+#define DEFAULT_MAX_UPLOAD_BYTES (128L * 1024 * 1024)
+#define DEFAULT_MAX_DIMENSION 16384
+
+// Errors from save_file_upload.
+#define UPLOAD_CLOSED -1       // The client went away or stalled.
+#define UPLOAD_INVALID -2      // The data isn't a 24-bit bitmap.
+#define UPLOAD_TOO_LARGE -3    // The bitmap is over the upload limits.
+
+// Uploads are received this much at a time when io_uring is used.
+#define UPLOAD_CHUNK (64 * 1024)
+
 
 // A struct representing a key-value pair as a query params
 typedef struct formdata {
@@ -52,9 +67,25 @@ typedef struct {
                          // (must be between 0 and MAXLINE - 1).
     ReqData *reqData;    // The data parsed from the first line of the HTTP
                          // request from the client.
+    Timer timer;         // Fires when the client has taken too long to send
+                         // its start line, or has gone idle.
+    unsigned long header_deadline;  // The tick by which the whole start line
+                                    // must have arrived.
+    long accepted_ns;    // When the connection was accepted, when its first
+    long first_byte_ns;  // bytes arrived, and when its start line was
+    long parsed_ns;      // parsed (monotonic clock).
 } ClientState;
 
 
+// What is learnt about an uploaded bitmap while it is being saved.
+typedef struct {
+    int width;
+    int height;
+    long size;                         // Bytes in the bitmap file.
+    unsigned char hash[SHA256_SIZE];   // SHA-256 of the bitmap file.
+} UploadInfo;
+
+
 /*
  * Returns an array of ClientStates of the given size.
  */
@@ -78,6 +109,19 @@ void remove_client(ClientState *cs);
  */
 int read_from_client(ClientState *client);
 
+/*
+ * Account for n bytes that were read into the client buffer, after its
+ * first client->num_bytes bytes, by other means (such as io_uring).
+ */
+void note_client_read(ClientState *client, int n);
+
+/*
+ * Search the first inbuf characters of buf for a network newline ("\r\n").
+ * Return the index *immediately after* the location of the '\n'
+ * if the network newline is found, or -1 otherwise.
+ */
+int find_network_newline(const char *buf, int inbuf);
+
 
 /******************************************************************************
  * Functions for parsing parts of the HTTP request
@@ -88,6 +132,12 @@ int read_from_client(ClientState *client);
  */
 int parse_req_start_line(ClientState *client);
 
+/*
+ * Initializes req->params from the key-value pairs in the query of the
+ * given start line.
+ */
+void parse_query(ReqData *req, const char *str);
+
 
 /*
  * Return the boundary string for this request.
@@ -120,14 +170,27 @@ char *get_bitmap_filename(ClientState *client, const char *boundary);
  * Use the boundary string to determine when the file data stops,
  * as described on the assignment handout.
  *
- * Return 0 if boundary string was found at the end of the request,
- * and -1 otherwise (this indicates a bad request).
+ * The bitmap's headers are checked before anything is written, so a bad
+ * or oversized upload is rejected without reading the rest of it. Its
+ * dimensions, size and hash are stored in info as it is saved.
+ *
+ * Return the number of bytes written, or UPLOAD_CLOSED if the client closed
+ * the connection or timed out before the whole file arrived, UPLOAD_INVALID
+ * if it isn't a 24-bit bitmap, or UPLOAD_TOO_LARGE if it is over the limits
+ * set by set_upload_limits.
  *
  * HINT: You may assume that the characters "\r\n--<boundary>--\r\n" are
  * guaranteed to be the last characters in the request data.
  * Just remember there's no null-terminator.
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd);
+int save_file_upload(ClientState *client, const char *boundary, int file_fd,
+                     UploadInfo *info);
+
+/*
+ * Set the largest bitmap file, in bytes, and the largest width and height
+ * that save_file_upload accepts.
+ */
+void set_upload_limits(long max_bytes, int max_dimension);
 
 
 #endif /* REQUEST_H_*/
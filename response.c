@@ -1,6 +1,8 @@
+#define _GNU_SOURCE  // memfd_create
 #define MAXLINE 1024
 #define IMAGE_DIR "images/"
 
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,11 +10,30 @@
 #include <dirent.h>  // Used to inspect directory contents.
 #include "response.h"
 #include "request.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include "perf.h"
+#include "bitmap.h"
+#include "kernels.h"
+#include "tuner.h"
+#include "sidecar.h"
+#include "store.h"
+#include "results.h"
+#include "warmer.h"
+#include "remote.h"
+#include "reply.h"
+#include "imcache.h"
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 // Functions for internal use only.
-void write_image_list(int fd);
-void write_image_response_header(int fd);
+void write_image_list(Reply *reply);
+void write_image_response_header(Reply *reply);
 
 
 /*
@@ -25,47 +46,204 @@ void main_html_response(int fd) {
         "HTTP/1.1 200 OK\r\n"
         "Content-type: text/html\r\n\r\n";
 
-    if(write(fd, header, strlen(header)) == -1) {
-        perror("write");
+    metrics_note_status(200);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_add_str(&reply, header);
+
+    // The page is mapped and sent in place, with the image list spliced in
+    // after the "<script>" line.
+    int page_fd = open("main.html", O_RDONLY);
+    struct stat st;
+    char *page = MAP_FAILED;
+    if (page_fd >= 0 && fstat(page_fd, &st) == 0 && st.st_size > 0) {
+        page = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, page_fd, 0);
     }
-
-    FILE *in_fp = fopen("main.html", "r");
-    char buf[MAXLINE];
-    while (fgets(buf, MAXLINE, in_fp) > 0) {
-        if(write(fd, buf, strlen(buf)) == -1) {
-            perror("write");
-        }
+    if (page_fd >= 0) {
+        close(page_fd);
+    }
+    if (page == MAP_FAILED) {
+        perror("main.html");
+        reply_send(&reply, 0);
+        return;
+    }
+    char *end = page + st.st_size;
+    char *line = page;
+    while (line < end) {
+        char *next = memchr(line, '\n', end - line);
+        next = next == NULL ? end : next + 1;
         // Insert a bit of dynamic Javascript into the HTML page.
         // This assumes there's only one "<script>" element in the page.
-        if (strncmp(buf, "<script>", strlen("<script>")) == 0) {
-            write_image_list(fd);
+        if ((size_t)(end - line) >= strlen("<script>") &&
+                strncmp(line, "<script>", strlen("<script>")) == 0) {
+            reply_add(&reply, page, next - page);
+            write_image_list(&reply);
+            reply_add(&reply, next, end - next);
+            break;
         }
+        line = next;
+    }
+    if (line >= end) {
+        reply_add(&reply, page, st.st_size);
     }
-    fclose(in_fp);
+    reply_send(&reply, 0);
+    munmap(page, st.st_size);
 }
 
 
 /*
- * Write image directory contents to the given fd, in the format
+ * Add image directory contents to the reply, in the format
  * "var filenames = ['<filename1>', '<filename2>', ...];\n"
  *
  * This is actually a line of Javascript that's used to populate the form
  * when the webpage is loaded.
  */
-void write_image_list(int fd) {
+void write_image_list(Reply *reply) {
     DIR *d = opendir(IMAGE_DIR);
     struct dirent *dir;
 
-    dprintf(fd, "var filenames = [");
+    reply_add_str(reply, "var filenames = [");
     if (d != NULL) {
         while ((dir = readdir(d)) != NULL) {
             if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) {
-                dprintf(fd, "'%s', ", dir->d_name);
+                reply_printf(reply, "'%s', ", dir->d_name);
             }
         }
         closedir(d);
     }
-    dprintf(fd, "];\n");
+    reply_add_str(reply, "];\n");
+}
+
+
+/*
+ * Run the filter executable at filter_path on the image at image_path.
+ * Return a file descriptor for a temporary file holding the filter's output,
+ * positioned at its start, or -1 if the filter couldn't be run or failed.
+ */
+static int run_filter(const char *filter_path, const char *image_path) {
+    int image_fd = open(image_path, O_RDONLY);
+    if (image_fd < 0) {
+        perror("open");
+        return -1;
+    }
+    int result_fd = memfd_create("filter-result", MFD_CLOEXEC);
+    if (result_fd < 0) {
+        perror("memfd_create");
+        close(image_fd);
+        return -1;
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(image_fd);
+        close(result_fd);
+        return -1;
+    } else if (pid == 0) {
+        if (dup2(image_fd, fileno(stdin)) == -1 ||
+                dup2(result_fd, fileno(stdout)) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+        execl(filter_path, filter_path, NULL);
+        perror("execl");
+        exit(1);
+    }
+    close(image_fd);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+        log_msg(LOG_WARN, "Filter %s failed", filter_path);
+        close(result_fd);
+        return -1;
+    }
+    lseek(result_fd, 0, SEEK_SET);
+    return result_fd;
+}
+
+
+/*
+ * Run the built-in kernel, or the convolution conv if it isn't NULL, on the
+ * image at image_path, in this process.
+ * The decoded image comes from the image cache, which shares it with other
+ * requests; failing that, its sidecar is used if it is up to date, and
+ * otherwise the bitmap is decoded.
+ * Return a file descriptor for a temporary file holding the filtered
+ * bitmap, positioned at its start, or -1 on failure.
+ */
+static int run_builtin_filter(int kernel, const Convolution *conv,
+                              const char *image_path) {
+    Image src, dst;
+    int entry = imcache_get(image_path, &src);
+    if (entry == IMCACHE_FAILED) {
+        log_msg(LOG_WARN, "Couldn't decode %s", image_path);
+        return -1;
+    }
+    trace_mark(MARK_DECODED);
+    if (create_bitmap_like(&dst, &src) < 0) {
+        imcache_release(entry, &src);
+        return -1;
+    }
+    // Convolutions take the threads and variant tuned for the Gaussian
+    // blur, the nearest of the fixed kernels.
+    int result = conv != NULL ?
+            run_convolution(conv, &src, &dst, tuned_params(KERNEL_GAUSSIAN_BLUR)) :
+            run_kernel(kernel, &src, &dst, tuned_params(kernel));
+    imcache_release(entry, &src);
+    trace_mark(MARK_KERNEL_DONE);
+
+    int result_fd = -1;
+    if (result == 0) {
+        result_fd = memfd_create("filter-result", MFD_CLOEXEC);
+        if (result_fd < 0) {
+            perror("memfd_create");
+        } else if (write_bitmap(result_fd, &dst) < 0) {
+            perror("write");
+            close(result_fd);
+            result_fd = -1;
+        } else {
+            lseek(result_fd, 0, SEEK_SET);
+        }
+    }
+    free_bitmap(&dst);
+    return result_fd;
+}
+
+
+int run_named_filter(const char *filter, const char *image_path) {
+    int kernel = find_kernel(filter);
+    Convolution conv;
+    if (kernel >= 0) {
+        return run_builtin_filter(kernel, NULL, image_path);
+    } else if (parse_convolution(filter, &conv) == 0) {
+        return run_builtin_filter(-1, &conv, image_path);
+    }
+    char filter_path[MAXLINE + sizeof(FILTER_DIR)];
+    snprintf(filter_path, sizeof(filter_path), "%s%s", FILTER_DIR, filter);
+    return run_filter(filter_path, image_path);
+}
+
+
+/*
+ * Copy the whole of the file result_fd to the socket fd.
+ */
+static void send_result(int fd, int result_fd) {
+    struct stat st;
+    if (fstat(result_fd, &st) < 0) {
+        perror("fstat");
+        return;
+    }
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t n = sendfile(fd, result_fd, &offset, st.st_size - offset);
+        if (n <= 0) {
+            perror("sendfile");
+            return;
+        }
+        metrics_add(COUNTER_BYTES_OUT, n);
+        trace_response_bytes();
+    }
 }
 
 
@@ -81,9 +259,8 @@ void write_image_list(int fd) {
  * 2. If the request is invalid, send an informative error message as a response
  *    using the internal_server_error_response function.
  *
- * 3. Otherwise, write an appropriate HTTP header for a bitmap file (we've
- *    provided a function to do so), and then use dup2 and execl to run
- *    the specified image filter and write the output directly to the socket.
+ * 3. Otherwise, run the specified image filter on the image, and send its
+ *    output to the client after an appropriate HTTP header for a bitmap file.
  */
 void image_filter_response(int fd, const ReqData *reqData) {
     // Input validation
@@ -95,24 +272,44 @@ void image_filter_response(int fd, const ReqData *reqData) {
     int readable_file=0;
     char image[MAXLINE];
     char filter[MAXLINE];
+    // The kernel of a convolution.
+    const char *size = NULL;
+    const char *coefficients = NULL;
+    const char *divisor = NULL;
+    const char *bias = NULL;
 
     for (int index=0; index<MAX_QUERY_PARAMS; index++){
         if (reqData->params[index].name != NULL){
-            if (strcmp(reqData->params[index].name, "filter")==0){
-                strcpy(filter, reqData->params[index].value);
+            const char *name = reqData->params[index].name;
+            const char *value = reqData->params[index].value;
+            if (strcmp(name, "filter")==0){
+                strcpy(filter, value);
                 correct_filter=1;
-            }else if (strcmp(reqData->params[index].name, "image")==0){
-                strcpy(image, reqData->params[index].value);
+            }else if (strcmp(name, "image")==0){
+                strcpy(image, value);
                 correct_image=1;
+            }else if (strcmp(name, "size")==0){
+                size = value;
+            }else if (strcmp(name, "kernel")==0){
+                coefficients = value;
+            }else if (strcmp(name, "divisor")==0){
+                divisor = value;
+            }else if (strcmp(name, "bias")==0){
+                bias = value;
             }
         }
-        if (correct_filter && correct_image){
-            break;
-        }
     }
     char image_path[MAXLINE];
     char filter_path[MAXLINE];
+    Convolution conv;
     if (correct_filter && correct_image){
+        // From here on a convolution is named after its kernel, so that
+        // the results of different kernels are kept apart.
+        if (strcmp(filter, CONVOLVE_FILTER) == 0 &&
+                make_convolution(&conv, size, coefficients, divisor, bias) == 0) {
+            convolution_name(&conv, filter, sizeof(filter));
+        }
+
         if (strstr(filter, "/")!=NULL){
             no_slash = 0;
         }
@@ -130,7 +327,10 @@ void image_filter_response(int fd, const ReqData *reqData) {
         strcat(&image_path[7], image);
         strcat(&filter_path[8], filter);
 
-        if (access(filter_path, X_OK)==0){
+        // Built-in filters run in this process, and take precedence over
+        // programs of the same name.
+        if (find_kernel(filter) >= 0 || parse_convolution(filter, &conv) == 0 ||
+                access(filter_path, X_OK)==0){
             correct_executable=1;
         }
 
@@ -152,30 +352,95 @@ void image_filter_response(int fd, const ReqData *reqData) {
 
     if (invalid==1){
         internal_server_error_response(fd, "Invalid query parameters");
-    }else{
-        // Write header data
-        write_image_response_header(fd);
-        if (dup2(fd, fileno(stdout))==-1){
-            perror("dup2");
-            exit(1);
-        }
-        FILE *filefd = fopen(image_path, "rb");
+        return;
+    }
 
-        //int filefd = open(image_path, O_RDWR);
-        if (filefd==NULL){
-            perror("open");
-            exit(1);
+    warmer_note_request(image_path);
+    // Every convolution is traced and measured as one filter.
+    const char *label = is_convolution(filter) ? CONVOLVE_FILTER : filter;
+
+    // Run the filter into a temporary file rather than straight into the
+    // socket, so that the filter and the transfer can be timed separately
+    // (and a failing filter can still get an error response).
+    trace_set_filter(label);
+    trace_mark(MARK_FILTER_START);
+    long filter_start = metrics_now_ns();
+    int result_fd = open_result(image_path, filter);
+    int stored = result_fd >= 0;
+    if (stored) {
+        metrics_add(COUNTER_RESULT_HITS, 1);
+    } else if (remote_enabled()) {
+        // Images in the blob store go to the job worker that owns their
+        // hash; anything it can't run is run here instead.
+        unsigned char hash[SHA256_SIZE];
+        if (store_blob_hash(image_path, hash) == 0) {
+            result_fd = remote_run_filter(filter, image_path, hash);
         }
-        if (dup2(fileno(filefd), fileno(stdin))==-1){
-            perror("dup2");
-            exit(1);
+    }
+    if (result_fd < 0) {
+        // When profiling, the counters are inherited by an external
+        // filter's process or a kernel's threads, and their counts are
+        // added to ours once they exit.
+        PerfGroup perf;
+        int profiled = perf_profiling() && perf_group_open(&perf) == 0;
+        if (profiled) {
+            perf_group_start(&perf);
         }
-        execl(filter_path, filter_path, NULL);
-        fprintf(stderr, "Error: execl did not run");
-        exit(1);
+        result_fd = run_named_filter(filter, image_path);
+        if (profiled) {
+            unsigned long counts[PERF_COUNTER_COUNT];
+            if (perf_group_stop(&perf, counts) == 0 && result_fd >= 0) {
+                metrics_filter_counters(label, counts);
+            }
+        }
+    }
+    trace_mark(MARK_FILTER_END);
+    if (result_fd < 0) {
+        internal_server_error_response(fd, "Filter failed");
+        return;
+    }
+    long send_start = metrics_now_ns();
+    // The header is held back until sendfile starts on the body, so that
+    // the two share the first segment.
+    Reply reply;
+    reply_init(&reply, fd);
+    write_image_response_header(&reply);
+    reply_send(&reply, 1);
+    send_result(fd, result_fd);
+    metrics_filter_phases(label, send_start - filter_start,
+                          metrics_now_ns() - send_start);
+    // Keep the result for the next request, once this one is answered.
+    if (!stored) {
+        save_result(image_path, filter, result_fd);
     }
+    close(result_fd);
+}
+
+
+// The temporary file of the upload in progress, and its client's socket,
+// for upload_timed_out.
+static char upload_tmp_path[MAXLINE];
+static int upload_sock = -1;
 
 
+/*
+ * SIGALRM handler for the upload's body timeout, set by the event loop:
+ * remove the partial upload, answer 408 and exit. Only async-signal-safe
+ * calls (and the lock-free metrics) are used here.
+ */
+static void upload_timed_out(int sig) {
+    static const char response[] =
+        "HTTP/1.1 408 Request Timeout\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n\r\n"
+        "Request timed out.\r\n";
+    if (upload_tmp_path[0] != '\0') {
+        unlink(upload_tmp_path);
+    }
+    send(upload_sock, response, sizeof(response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    metrics_note_status(408);
+    metrics_request_end(ROUTE_IMAGE_UPLOAD);
+    _exit(1);
 }
 
 
@@ -189,13 +454,19 @@ void image_filter_response(int fd, const ReqData *reqData) {
  * steps, so at each step it's a bit easier for you to test your code.
  */
 void image_upload_response(ClientState *client) {
+    upload_sock = client->sock;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = upload_timed_out;
+    sigaction(SIGALRM, &sa, NULL);
+
     // First, extract the boundary string for the request.
     char *boundary = get_boundary(client);
     if (boundary == NULL) {
         bad_request_response(client->sock, "Couldn't find boundary string in request.");
         exit(1);
     }
-    fprintf(stderr, "Boundary string: %s\n", boundary);
+    log_msg(LOG_DEBUG, "Boundary string: %s", boundary);
 
     // Use the boundary string to extract the name of the uploaded bitmap file.
     char *filename = get_bitmap_filename(client, boundary);
@@ -210,16 +481,53 @@ void image_upload_response(ClientState *client) {
     strcpy(path, IMAGE_DIR);
     strcat(path, filename);
 
-    fprintf(stderr, "Bitmap path: %s\n", path);
+    log_msg(LOG_INFO, "Bitmap path: %s", path);
 
     if (access(path, F_OK) >= 0) {
         bad_request_response(client->sock, "File already exists.");
         exit(1);
     }
 
-    FILE *file = fopen(path, "wb");
-    save_file_upload(client, boundary, fileno(file));
-    fclose(file);
+    // The upload goes into the blob store under a temporary name, and is
+    // only linked into the image directory once its hash is known.
+    char *tmp_path = upload_tmp_path;
+    int file_fd = store_create_upload(tmp_path, sizeof(upload_tmp_path));
+    if (file_fd < 0) {
+        exit(1);
+    }
+    UploadInfo info;
+    int result = save_file_upload(client, boundary, file_fd, &info);
+    // The whole body is in, or never will be; the rest is up to us.
+    alarm(0);
+    close(file_fd);
+    if (result < 0) {
+        // Don't keep a partial or rejected image.
+        unlink(tmp_path);
+        if (result == UPLOAD_INVALID) {
+            bad_request_response(client->sock, "The upload isn't a 24-bit bitmap.");
+        } else if (result == UPLOAD_TOO_LARGE) {
+            log_msg(LOG_INFO, "Rejected %dx%d upload of %ld bytes",
+                    info.width, info.height, info.size);
+            payload_too_large_response(client->sock, "The bitmap is too large.");
+        }
+        exit(1);
+    }
+    int added = store_commit_upload(tmp_path, info.hash, path);
+    if (added < 0) {
+        bad_request_response(client->sock, "File already exists.");
+        exit(1);
+    }
+    char hex[SHA256_HEX_SIZE];
+    sha256_hex(info.hash, hex);
+    log_msg(LOG_INFO, "Uploaded %dx%d bitmap, %ld bytes, sha256 %s%s",
+            info.width, info.height, info.size, hex,
+            added ? "" : " (already stored)");
+    // Index new contents straight away, with the hash computed on the way
+    // in. Contents that were already stored have their sidecar.
+    if (added) {
+        make_sidecar(path, info.hash);
+    }
+    warmer_note_upload(path);
     free(boundary);
     free(filename);
     free(path);
@@ -228,15 +536,27 @@ void image_upload_response(ClientState *client) {
 
 
 /*
- * Write the header for a bitmap image response to the given fd.
+ * Add the header for a bitmap image response to the reply.
  */
-void write_image_response_header(int fd) {
+void write_image_response_header(Reply *reply) {
     char *response =
         "HTTP/1.1 200 OK\r\n"
         "Content-Type: image/bmp\r\n"
         "Content-Disposition: attachment; filename=\"output.bmp\"\r\n\r\n";
 
-    write(fd, response, strlen(response));
+    metrics_note_status(200);
+    reply_add_str(reply, response);
+}
+
+
+/*
+ * Send a response that is a single fixed string.
+ */
+static void send_response(int fd, const char *response) {
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_add_str(&reply, response);
+    reply_send(&reply, 0);
 }
 
 
@@ -245,7 +565,19 @@ void not_found_response(int fd) {
         "HTTP/1.1 404 Not Found\r\n"
         "Content-Type: text/plain\r\n\r\n"
         "Page not found.\r\n";
-    write(fd, response, strlen(response));
+    metrics_note_status(404);
+    send_response(fd, response);
+}
+
+
+void request_timeout_response(int fd) {
+    char *response =
+        "HTTP/1.1 408 Request Timeout\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n\r\n"
+        "Request timed out.\r\n";
+    metrics_note_status(408);
+    send_response(fd, response);
 }
 
 
@@ -261,7 +593,26 @@ void internal_server_error_response(int fd, const char *message) {
         "<p>%s<p>\r\n"
         "</body></html>\r\n";
 
-    dprintf(fd, response, message);
+    metrics_note_status(500);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply, response, message);
+    reply_send(&reply, 0);
+}
+
+
+void service_unavailable_response(int fd, int retry_after) {
+    char *response =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Type: text/plain\r\n"
+        "Retry-After: %d\r\n\r\n"
+        "Server busy; please try again later.\r\n";
+
+    metrics_note_status(503);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply, response, retry_after);
+    reply_send(&reply, 0);
 }
 
 
@@ -278,12 +629,14 @@ void bad_request_response(int fd, const char *message) {
         "<h1>Bad Request</h1>\r\n"
         "<p>%s<p>\r\n"
         "</body></html>\r\n";
-    char header_buf[MAXLINE];
     char body_buf[MAXLINE];
-    sprintf(body_buf, response_body, message);
-    sprintf(header_buf, response_header, strlen(body_buf));
-    write(fd, header_buf, strlen(header_buf));
-    write(fd, body_buf, strlen(body_buf));
+    snprintf(body_buf, sizeof(body_buf), response_body, message);
+    metrics_note_status(400);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply, response_header, (int)strlen(body_buf));
+    reply_add_str(&reply, body_buf);
+    reply_send(&reply, 0);
     // Because we are making some simplfications with the HTTP protocol
     // the browser will get a "connection reset" message. This happens
     // because our server is closing the connection and terminating the process.
@@ -292,10 +645,42 @@ void bad_request_response(int fd, const char *message) {
 }
 
 
+void payload_too_large_response(int fd, const char *message) {
+    char *response_header =
+        "HTTP/1.1 413 Payload Too Large\r\n"
+        "Content-Type: text/html\r\n"
+        "Connection: close\r\n"
+        "Content-Length: %d\r\n\r\n";
+    char *response_body =
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+        "<html><head>\r\n"
+        "<title>413 Payload Too Large</title>\r\n"
+        "</head><body>\r\n"
+        "<h1>Payload Too Large</h1>\r\n"
+        "<p>%s<p>\r\n"
+        "</body></html>\r\n";
+    char body_buf[MAXLINE];
+    snprintf(body_buf, sizeof(body_buf), response_body, message);
+    metrics_note_status(413);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply, response_header, (int)strlen(body_buf));
+    reply_add_str(&reply, body_buf);
+    reply_send(&reply, 0);
+    // Send the response on its way before the unread upload makes closing
+    // the socket reset the connection.
+    shutdown(fd, SHUT_WR);
+}
+
+
 void see_other_response(int fd, const char *other) {
     char *response =
         "HTTP/1.1 303 See Other\r\n"
         "Location: %s\r\n\r\n";
 
-    dprintf(fd, response, other);
+    metrics_note_status(303);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply, response, other);
+    reply_send(&reply, 0);
 }
@@ -17,6 +17,13 @@ void main_html_response(int fd);
  */
 void image_filter_response(int fd, const ReqData *reqData);
 
+/*
+ * Run the named filter, built-in or from FILTER_DIR, on the image at
+ * image_path. Return a file descriptor for a temporary file holding the
+ * result, positioned at its start, or -1 if the filter failed.
+ */
+int run_named_filter(const char *filter, const char *image_path);
+
 
 /*
  * Respond to an image-upload request.
@@ -30,9 +37,18 @@ void image_upload_response(ClientState *client);
  * Some of them can be customized with a message.
  */
 void not_found_response(int fd);
+void request_timeout_response(int fd);
 void bad_request_response(int fd, const char *message);
 void internal_server_error_response(int fd, const char *message);
 
+// Sent when the server is too busy to take on the request; the client is
+// asked to try again after retry_after seconds.
+void service_unavailable_response(int fd, int retry_after);
+
+// Sent when an upload is over the size limits. The client is told that the
+// connection is closing, since the rest of its upload is never read.
+void payload_too_large_response(int fd, const char *message);
+
 // This one takes a resource name instead, and redirects the client
 // to that resource.
 void see_other_response(int fd, const char *other);
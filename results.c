@@ -0,0 +1,505 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "results.h"
+#include "store.h"
+#include "request.h"
+#include "kernels.h"
+#include "metrics.h"
+#include "log.h"
+
+// Room for a result path: the directory and a key in hex, plus a
+// temporary suffix.
+#define MAX_RESULT_PATH (sizeof(RESULT_DIR) + 2 * RESULT_KEY_SIZE + 32)
+
+#define INDEX_SIZE (sizeof(ResultIndexHeader) + RESULT_INDEX_SLOTS * sizeof(ResultIndexEntry))
+
+// The index is rebuilt without removed and damaged entries once this many
+// slots are no longer empty, to keep probe sequences short.
+#define MAX_USED_SLOTS (RESULT_INDEX_SLOTS / 4 * 3)
+
+// Bookkeeping for the index, shared by every process but not persisted.
+typedef struct {
+    pthread_mutex_t lock;
+    long total;     // Bytes in the indexed results.
+    long used;      // Slots that aren't empty.
+} IndexState;
+
+static ResultIndexEntry *entries;
+static IndexState *state;
+static long max_bytes;
+
+
+/*
+ * Return the hash of the fields of e other than check.
+ */
+static uint64_t entry_check(const ResultIndexEntry *e) {
+    // FNV-1a.
+    const unsigned char *bytes = (const unsigned char *) e;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(ResultIndexEntry, check); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+static int entry_empty(const ResultIndexEntry *e) {
+    static const ResultIndexEntry empty;
+    return memcmp(e, &empty, sizeof(empty)) == 0;
+}
+
+
+/*
+ * Return 1 if e is whole and holds a result, 0 otherwise.
+ */
+static int entry_live(const ResultIndexEntry *e) {
+    return e->size > 0 && e->check == entry_check(e);
+}
+
+
+static void write_entry(ResultIndexEntry *e, const unsigned char key[RESULT_KEY_SIZE],
+                        uint64_t size, int64_t last_use) {
+    memcpy(e->key, key, RESULT_KEY_SIZE);
+    e->size = size;
+    e->last_use = last_use;
+    e->check = entry_check(e);
+}
+
+
+/*
+ * Return the slot holding key, or -1. If insert isn't NULL, store there the
+ * slot where key should be added: the first one in its probe sequence that
+ * is empty, removed or damaged. The index must be locked.
+ */
+static long find_slot(const unsigned char key[RESULT_KEY_SIZE], long *insert) {
+    uint64_t start;
+    memcpy(&start, key, sizeof(start));
+    long reusable = -1;
+    for (long i = 0; i < RESULT_INDEX_SLOTS; i++) {
+        long slot = (start + i) & (RESULT_INDEX_SLOTS - 1);
+        ResultIndexEntry *e = &entries[slot];
+        if (entry_empty(e)) {
+            if (reusable < 0) {
+                reusable = slot;
+            }
+            break;
+        }
+        if (entry_live(e) && memcmp(e->key, key, RESULT_KEY_SIZE) == 0) {
+            return slot;
+        }
+        if (reusable < 0 && !entry_live(e)) {
+            reusable = slot;
+        }
+    }
+    if (insert != NULL) {
+        *insert = reusable;
+    }
+    return -1;
+}
+
+
+static void lock_index(void) {
+    if (pthread_mutex_lock(&state->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&state->lock);
+    }
+}
+
+
+/*
+ * Write the path of the result with the given key into buf.
+ */
+static void key_path(const unsigned char key[RESULT_KEY_SIZE], char *buf, size_t size) {
+    int n = snprintf(buf, size, "%s", RESULT_DIR);
+    for (int i = 0; i < RESULT_KEY_SIZE && n + 2 < size; i++) {
+        n += snprintf(buf + n, size - n, "%02x", key[i]);
+    }
+}
+
+
+/*
+ * Compute the key of the result of filter on the image at image_path.
+ * Return 0 on success, or -1 if the image has no blob.
+ */
+static int result_key(const char *image_path, const char *filter,
+                      unsigned char key[RESULT_KEY_SIZE]) {
+    unsigned char hash[SHA256_SIZE];
+    if (store_blob_hash(image_path, hash) < 0) {
+        return -1;
+    }
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, hash, SHA256_SIZE);
+    sha256_update(&ctx, filter, strlen(filter));
+    sha256_final(&ctx, hash);
+    memcpy(key, hash, RESULT_KEY_SIZE);
+    return 0;
+}
+
+
+/*
+ * Rebuild the index in place with only its live entries. The index must
+ * be locked.
+ */
+static void compact_index(void) {
+    ResultIndexEntry *live = malloc(sizeof(ResultIndexEntry) * RESULT_INDEX_SLOTS);
+    if (live == NULL) {
+        return;
+    }
+    long count = 0;
+    for (long i = 0; i < RESULT_INDEX_SLOTS; i++) {
+        if (entry_live(&entries[i])) {
+            live[count++] = entries[i];
+        }
+    }
+    memset(entries, 0, sizeof(ResultIndexEntry) * RESULT_INDEX_SLOTS);
+    for (long i = 0; i < count; i++) {
+        long slot;
+        find_slot(live[i].key, &slot);
+        entries[slot] = live[i];
+    }
+    state->used = count;
+    free(live);
+}
+
+
+static int compare_last_use(const void *a, const void *b) {
+    int64_t x = entries[*(const long *) a].last_use;
+    int64_t y = entries[*(const long *) b].last_use;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * If the results are over the size limit, remove the least recently used
+ * from the index until they are RESULT_EVICT_TO of it, and store their
+ * keys in a new array in *evicted for the caller to unlink once the index
+ * is unlocked. Return the number removed. The index must be locked.
+ */
+static long evict_results(unsigned char (**evicted)[RESULT_KEY_SIZE]) {
+    *evicted = NULL;
+    if (state->total <= max_bytes) {
+        return 0;
+    }
+    long *slots = malloc(sizeof(long) * RESULT_INDEX_SLOTS);
+    *evicted = malloc(RESULT_KEY_SIZE * RESULT_INDEX_SLOTS);
+    if (slots == NULL || *evicted == NULL) {
+        free(slots);
+        free(*evicted);
+        *evicted = NULL;
+        return 0;
+    }
+    long count = 0;
+    for (long i = 0; i < RESULT_INDEX_SLOTS; i++) {
+        if (entry_live(&entries[i])) {
+            slots[count++] = i;
+        }
+    }
+    qsort(slots, count, sizeof(long), compare_last_use);
+    long target = max_bytes * RESULT_EVICT_TO;
+    long removed = 0;
+    for (long i = 0; i < count && state->total > target; i++) {
+        ResultIndexEntry *e = &entries[slots[i]];
+        memcpy((*evicted)[removed++], e->key, RESULT_KEY_SIZE);
+        state->total -= e->size;
+        metrics_gauge_add(GAUGE_RESULT_BYTES, -(long) e->size);
+        write_entry(e, e->key, 0, e->last_use);
+    }
+    free(slots);
+    return removed;
+}
+
+
+/*
+ * Unlink the results evicted by evict_results, and free the array.
+ */
+static void unlink_evicted(unsigned char (*evicted)[RESULT_KEY_SIZE], long count) {
+    for (long i = 0; i < count; i++) {
+        char path[MAX_RESULT_PATH];
+        key_path(evicted[i], path, sizeof(path));
+        unlink(path);
+    }
+    if (count > 0) {
+        metrics_add(COUNTER_RESULT_EVICTIONS, count);
+        log_msg(LOG_DEBUG, "Evicted %ld result(s) from the result store", count);
+    }
+    free(evicted);
+}
+
+
+/*
+ * Record that the result with the given key, of size bytes, was just
+ * stored or used, adding it to the index if it isn't there, and evict
+ * results if the store is now over its limit.
+ * Return 0, or -1 if the index records a different size for it (the
+ * result file is then damaged).
+ */
+static int index_note(const unsigned char key[RESULT_KEY_SIZE], uint64_t size,
+                      int stored) {
+    int64_t now = time(NULL);
+    int result = 0;
+    unsigned char (*evicted)[RESULT_KEY_SIZE] = NULL;
+    long evicted_count = 0;
+    lock_index();
+    long insert;
+    long slot = find_slot(key, &insert);
+    if (slot >= 0) {
+        ResultIndexEntry *e = &entries[slot];
+        if (e->size != size && !stored) {
+            result = -1;
+        } else if (e->size != size || e->last_use != now) {
+            // Rewritten only when it changes, so that hits on the same
+            // result mostly leave the page clean.
+            state->total += size - e->size;
+            metrics_gauge_add(GAUGE_RESULT_BYTES, (long) size - (long) e->size);
+            write_entry(e, key, size, now);
+        }
+    } else {
+        if (insert < 0 || (entry_empty(&entries[insert]) && state->used >= MAX_USED_SLOTS)) {
+            compact_index();
+            find_slot(key, &insert);
+        }
+        if (insert >= 0) {
+            if (entry_empty(&entries[insert])) {
+                state->used++;
+            }
+            write_entry(&entries[insert], key, size, now);
+            state->total += size;
+            metrics_gauge_add(GAUGE_RESULT_BYTES, size);
+            evicted_count = evict_results(&evicted);
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    unlink_evicted(evicted, evicted_count);
+    return result;
+}
+
+
+/*
+ * Remove the result with the given key from the index, if it is there.
+ */
+static void index_forget(const unsigned char key[RESULT_KEY_SIZE]) {
+    lock_index();
+    long slot = find_slot(key, NULL);
+    if (slot >= 0) {
+        ResultIndexEntry *e = &entries[slot];
+        state->total -= e->size;
+        metrics_gauge_add(GAUGE_RESULT_BYTES, -(long) e->size);
+        write_entry(e, key, 0, e->last_use);
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+
+/*
+ * Remove every file in RESULT_DIR except the index, for a fresh index.
+ */
+static void clear_results(void) {
+    DIR *d = opendir(RESULT_DIR);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] != '.' && strcmp(ent->d_name, "index") != 0) {
+            unlinkat(dirfd(d), ent->d_name, 0);
+        }
+    }
+    closedir(d);
+}
+
+
+/*
+ * Open and map the index file, making a new, empty one if it is missing or
+ * isn't an index with the current layout. Return the mapping, or NULL.
+ */
+static void *map_index(void) {
+    int fd = open(RESULT_INDEX, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(RESULT_INDEX);
+        return NULL;
+    }
+    ResultIndexHeader header;
+    struct stat st;
+    int usable = fstat(fd, &st) == 0 && st.st_size == INDEX_SIZE &&
+                 pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, RESULT_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.slots == RESULT_INDEX_SLOTS &&
+                 header.entry_size == sizeof(ResultIndexEntry);
+    if (!usable) {
+        // The results can't be accounted for without an index, so start
+        // over; they are only a cache.
+        log_msg(LOG_INFO, "Creating a new result index");
+        clear_results();
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, RESULT_INDEX_MAGIC, sizeof(header.magic));
+        header.slots = RESULT_INDEX_SLOTS;
+        header.entry_size = sizeof(ResultIndexEntry);
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, INDEX_SIZE) < 0 ||
+                pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            perror(RESULT_INDEX);
+            close(fd);
+            return NULL;
+        }
+    }
+    void *map = mmap(NULL, INDEX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return map;
+}
+
+
+int results_init(long max_mb) {
+    if ((mkdir(CACHE_DIR, 0755) < 0 && errno != EEXIST) ||
+            (mkdir(RESULT_DIR, 0755) < 0 && errno != EEXIST)) {
+        perror(RESULT_DIR);
+        return -1;
+    }
+    char *map = map_index();
+    void *mem = mmap(NULL, sizeof(IndexState), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == NULL || mem == MAP_FAILED) {
+        return -1;
+    }
+    entries = (ResultIndexEntry *) (map + sizeof(ResultIndexHeader));
+    state = mem;
+    max_bytes = max_mb * 1024 * 1024;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&state->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    long count = 0;
+    for (long i = 0; i < RESULT_INDEX_SLOTS; i++) {
+        if (!entry_empty(&entries[i])) {
+            state->used++;
+        }
+        if (entry_live(&entries[i])) {
+            state->total += entries[i].size;
+            count++;
+        }
+    }
+    metrics_gauge_add(GAUGE_RESULT_BYTES, state->total);
+    log_msg(LOG_INFO, "Result store: %ld result(s), %ld MB", count,
+            state->total / (1024 * 1024));
+
+    // The limit may have been lowered since the last run.
+    unsigned char (*evicted)[RESULT_KEY_SIZE];
+    lock_index();
+    long evicted_count = evict_results(&evicted);
+    pthread_mutex_unlock(&state->lock);
+    unlink_evicted(evicted, evicted_count);
+    return 0;
+}
+
+
+int open_result(const char *image_path, const char *filter) {
+    unsigned char key[RESULT_KEY_SIZE];
+    char path[MAX_RESULT_PATH];
+    if (entries == NULL || result_key(image_path, filter, key) < 0) {
+        return -1;
+    }
+    key_path(key, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        index_forget(key);
+        return -1;
+    }
+    struct stat result_st;
+    if (fstat(fd, &result_st) < 0) {
+        close(fd);
+        return -1;
+    }
+    // A result that was renamed into place just before a crash may not
+    // have all of its data, in which case its size is off.
+    if (result_st.st_size < BMP_HEADER_SIZE ||
+            index_note(key, result_st.st_size, 0) < 0) {
+        log_msg(LOG_WARN, "Removing damaged result %s", path);
+        close(fd);
+        unlink(path);
+        index_forget(key);
+        return -1;
+    }
+    // A filter program that was replaced after the result was made may
+    // give different output now. Built-in filters never change.
+    if (find_kernel(filter) < 0 && !is_convolution(filter)) {
+        char filter_path[MAXLINE + sizeof(FILTER_DIR)];
+        struct stat filter_st;
+        snprintf(filter_path, sizeof(filter_path), "%s%s", FILTER_DIR, filter);
+        if (stat(filter_path, &filter_st) < 0 ||
+                filter_st.st_mtime >= result_st.st_mtime) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+
+int save_result(const char *image_path, const char *filter, int result_fd) {
+    unsigned char key[RESULT_KEY_SIZE];
+    char path[MAX_RESULT_PATH];
+    char tmp_path[MAX_RESULT_PATH + 32];
+    struct stat st;
+    if (entries == NULL || result_key(image_path, filter, key) < 0 ||
+            fstat(result_fd, &st) < 0) {
+        return -1;
+    }
+    key_path(key, path, sizeof(path));
+    // Written under a temporary name and renamed into place, so that a
+    // result is either complete or absent.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp_path);
+        return -1;
+    }
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        if (sendfile(fd, result_fd, &offset, st.st_size - offset) <= 0) {
+            perror("sendfile");
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+    }
+    close(fd);
+    if (rename(tmp_path, path) < 0) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    // Indexed only once it is in place. A crash in between leaves a result
+    // that the index doesn't know about, which open_result adds when it
+    // is next asked for.
+    index_note(key, st.st_size, 1);
+    return 0;
+}
+
+
+void discard_partial_result(const char *image_path, const char *filter, int pid) {
+    unsigned char key[RESULT_KEY_SIZE];
+    char path[MAX_RESULT_PATH];
+    char tmp_path[MAX_RESULT_PATH + 32];
+    if (result_key(image_path, filter, key) == 0) {
+        key_path(key, path, sizeof(path));
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, pid);
+        unlink(tmp_path);
+    }
+}
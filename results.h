@@ -0,0 +1,75 @@
+#ifndef RESULTS_H_
+#define RESULTS_H_
+
+#include <stdint.h>
+
+#include "sidecar.h"
+
+// Filter results are kept as bitmaps in RESULT_DIR, each named after its
+// key: the SHA-256 of the image's content hash and the filter's name,
+// truncated to RESULT_KEY_SIZE bytes and written in hex. Only images
+// linked into the blob store (see store.h) have results kept.
+//
+// RESULT_INDEX records the size and last use of every result, so that the
+// store can be kept under a size limit by evicting the least recently used
+// results. It is a hash table in a file that every process maps; starting
+// up only maps it and sums the sizes, without looking at the results.
+#define RESULT_DIR CACHE_DIR "results/"
+#define RESULT_INDEX RESULT_DIR "index"
+#define RESULT_KEY_SIZE 16
+#define RESULT_INDEX_MAGIC "IMGRIDX1"
+#define RESULT_INDEX_SLOTS 65536        // A power of two.
+#define DEFAULT_RESULT_STORE_MB 1024
+// When the store goes over its limit, results are evicted until it is
+// this fraction of the limit.
+#define RESULT_EVICT_TO 0.9
+
+typedef struct {
+    char magic[8];
+    uint32_t slots;
+    uint32_t entry_size;
+    char reserved[48];
+} ResultIndexHeader;
+
+// Entries are updated in place, so a crash can leave one half written;
+// check is a hash of the other fields that shows whether an entry is whole.
+// An entry that isn't is skipped, and its result is indexed again the next
+// time it is found on disk.
+typedef struct {
+    unsigned char key[RESULT_KEY_SIZE];   // All zero if never used.
+    uint64_t size;                        // 0 once the result is removed.
+    int64_t last_use;                     // Wall-clock seconds.
+    uint64_t check;
+} ResultIndexEntry;
+
+
+/*
+ * Create the result directory and map its index, creating the index (and
+ * emptying the directory) if it is missing or unusable. The results are
+ * kept under max_mb megabytes. This must be called before any processes
+ * are forked. Return 0 on success, or -1 (results are then not kept).
+ */
+int results_init(long max_mb);
+
+/*
+ * Open the stored result of running filter on the image at image_path.
+ * Results of filter programs that have changed since are ignored.
+ * Return a file descriptor positioned at its start, or -1 if there is none.
+ */
+int open_result(const char *image_path, const char *filter);
+
+/*
+ * Store the whole of result_fd as the result of running filter on the
+ * image at image_path. The file offset of result_fd is left unchanged.
+ * Return 0 on success, or -1 if the image has no blob or the result can't
+ * be written.
+ */
+int save_result(const char *image_path, const char *filter, int result_fd);
+
+/*
+ * Remove what is left of a save_result by process pid that was killed
+ * before it finished.
+ */
+void discard_partial_result(const char *image_path, const char *filter, int pid);
+
+#endif /* RESULTS_H_ */
@@ -0,0 +1,39 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+// Length of a hash written out in hex, including the terminating null.
+#define SHA256_HEX_SIZE (2 * SHA256_SIZE + 1)
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;              // Bytes hashed so far.
+    unsigned char block[64];      // Bytes waiting for a full block.
+    size_t block_used;
+} Sha256;
+
+
+/*
+ * Start a new hash.
+ */
+void sha256_init(Sha256 *ctx);
+
+/*
+ * Add len bytes of data to the hash.
+ */
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+
+/*
+ * Finish the hash and store it in digest.
+ */
+void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_SIZE]);
+
+/*
+ * Write digest into hex as a null-terminated lowercase hex string.
+ */
+void sha256_hex(const unsigned char digest[SHA256_SIZE], char hex[SHA256_HEX_SIZE]);
+
+#endif /* SHA256_H_ */
@@ -0,0 +1,349 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sidecar.h"
+#include "request.h"
+#include "log.h"
+
+_Static_assert(sizeof(SidecarHeader) <= SIDECAR_HEADER_SIZE,
+               "sidecar header doesn't fit");
+
+// Room for an image path (at most MAXLINE) plus the sidecar's directory,
+// suffix and temporary suffix.
+#define MAX_SIDECAR_PATH (MAXLINE + 64)
+
+static int sidecar_pixel_size = BMP_PIXEL_SIZE;
+
+
+void set_sidecar_pixel_size(int pixel_size) {
+    sidecar_pixel_size = pixel_size;
+}
+
+
+static int sidecar_stride(int width, int pixel_size) {
+    return (width * pixel_size + SIDECAR_ROW_ALIGN - 1) & ~(SIDECAR_ROW_ALIGN - 1);
+}
+
+
+static long mtime_ns(const struct stat *st) {
+    return st->st_mtim.tv_sec * 1000000000L + st->st_mtim.tv_nsec;
+}
+
+
+/*
+ * Write the path of the sidecar for the bitmap at image_path into buf.
+ * Sidecars are named after the file holding the image, whichever directory
+ * it is in, so every name linked to the same blob shares one sidecar.
+ */
+static void sidecar_path(const char *image_path, char *buf, size_t size) {
+    char target[MAXLINE];
+    ssize_t len = readlink(image_path, target, sizeof(target) - 1);
+    if (len > 0) {
+        target[len] = '\0';
+        image_path = target;
+    }
+    const char *name = strrchr(image_path, '/');
+    name = name == NULL ? image_path : name + 1;
+    snprintf(buf, size, "%s%s%s", SIDECAR_DIR, name, SIDECAR_SUFFIX);
+}
+
+
+/*
+ * Copy the rows of bmp, in either layout, into pixels, top-down with the
+ * given stride and pixel size. Padding is zeroed.
+ */
+static void convert_rows(const Image *bmp, unsigned char *pixels, int stride,
+                         int pixel_size) {
+    for (int y = 0; y < bmp->height; y++) {
+        int row = bmp->bottom_up ? bmp->height - 1 - y : y;
+        const unsigned char *src = bmp->pixels + (size_t) bmp->stride * row;
+        unsigned char *dst = pixels + (size_t) stride * y;
+        memset(dst, 0, stride);
+        if (pixel_size == bmp->pixel_size) {
+            memcpy(dst, src, pixel_size * bmp->width);
+            continue;
+        }
+        for (int x = 0; x < bmp->width; x++) {
+            memcpy(dst + pixel_size * x, src + bmp->pixel_size * x, BMP_PIXEL_SIZE);
+        }
+    }
+}
+
+
+void sidecar_layout(int width, int *stride, int *pixel_size) {
+    *pixel_size = sidecar_pixel_size;
+    *stride = sidecar_stride(width, sidecar_pixel_size);
+}
+
+
+void copy_to_sidecar_layout(const Image *image, unsigned char *pixels) {
+    int stride, pixel_size;
+    sidecar_layout(image->width, &stride, &pixel_size);
+    convert_rows(image, pixels, stride, pixel_size);
+}
+
+
+int convert_to_sidecar_layout(const Image *bmp, Image *out) {
+    memset(out, 0, sizeof(*out));
+    out->width = bmp->width;
+    out->height = bmp->height;
+    out->pixel_size = sidecar_pixel_size;
+    out->stride = sidecar_stride(bmp->width, out->pixel_size);
+    out->header_size = bmp->header_size;
+    out->header = malloc(bmp->header_size);
+    void *pixels = NULL;
+    if (out->header == NULL ||
+            posix_memalign(&pixels, SIDECAR_ROW_ALIGN, (size_t) out->stride * out->height) != 0) {
+        free_bitmap(out);
+        return -1;
+    }
+    out->pixels = pixels;
+    memcpy(out->header, bmp->header, bmp->header_size);
+    convert_rows(bmp, out->pixels, out->stride, out->pixel_size);
+    return 0;
+}
+
+
+/*
+ * Read the whole of the bitmap at path into memory and decode it into bmp.
+ * If hash_known is 0, hash it into hash as well.
+ * Return 0 on success, or -1.
+ */
+static int read_and_hash(const char *path, Image *bmp, struct stat *st,
+                         unsigned char hash[SHA256_SIZE], int hash_known) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    unsigned char *data = malloc(st->st_size > 0 ? st->st_size : 1);
+    off_t done = 0;
+    while (data != NULL && done < st->st_size) {
+        ssize_t n = read(fd, data + done, st->st_size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+
+    int offset;
+    memset(bmp, 0, sizeof(*bmp));
+    if (data == NULL || done != st->st_size || st->st_size < BMP_HEADER_SIZE ||
+            parse_bitmap_header(data, &offset, &bmp->width, &bmp->height) < 0 ||
+            st->st_size < offset + (off_t) BMP_ROW_SIZE(bmp->width) * bmp->height) {
+        free(data);
+        return -1;
+    }
+    if (!hash_known) {
+        Sha256 ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, data, st->st_size);
+        sha256_final(&ctx, hash);
+    }
+
+    // The pixels are used where they are; the headers get their own copy.
+    bmp->stride = BMP_ROW_SIZE(bmp->width);
+    bmp->pixel_size = BMP_PIXEL_SIZE;
+    bmp->bottom_up = 1;
+    bmp->header_size = offset;
+    bmp->header = malloc(offset);
+    if (bmp->header == NULL) {
+        free(data);
+        return -1;
+    }
+    memcpy(bmp->header, data, offset);
+    memmove(data, data + offset, (size_t) bmp->stride * bmp->height);
+    bmp->pixels = data;
+    return 0;
+}
+
+
+int make_sidecar(const char *image_path, const unsigned char *hash) {
+    Image bmp;
+    struct stat st;
+    SidecarHeader header;
+    memset(&header, 0, sizeof(header));
+    if (hash != NULL) {
+        memcpy(header.hash, hash, SHA256_SIZE);
+    }
+    if (read_and_hash(image_path, &bmp, &st, header.hash, hash != NULL) < 0) {
+        log_msg(LOG_WARN, "Couldn't read %s to make its sidecar", image_path);
+        return -1;
+    }
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.width = bmp.width;
+    header.height = bmp.height;
+    header.pixel_size = sidecar_pixel_size;
+    header.stride = sidecar_stride(bmp.width, sidecar_pixel_size);
+    header.source_size = st.st_size;
+    header.source_mtime_ns = mtime_ns(&st);
+
+    // Write a temporary file and rename it into place, so that readers
+    // never see a partial sidecar.
+    char path[MAX_SIDECAR_PATH];
+    char tmp_path[MAX_SIDECAR_PATH + 16];
+    sidecar_path(image_path, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+    size_t size = SIDECAR_HEADER_SIZE + (size_t) header.stride * header.height;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        perror(tmp_path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free_bitmap(&bmp);
+        return -1;
+    }
+    unsigned char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        unlink(tmp_path);
+        free_bitmap(&bmp);
+        return -1;
+    }
+    memcpy(map, &header, sizeof(header));
+    convert_rows(&bmp, map + SIDECAR_HEADER_SIZE, header.stride, header.pixel_size);
+    munmap(map, size);
+    free_bitmap(&bmp);
+
+    if (rename(tmp_path, path) < 0) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Map the sidecar at path and check that it is complete and that it was
+ * made from the bitmap described by image_st.
+ * Return the mapping, or NULL if it can't be used.
+ */
+static void *map_sidecar(const char *path, const struct stat *image_st,
+                         size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= SIDECAR_HEADER_SIZE) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const SidecarHeader *header = map;
+    if (memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) != 0 ||
+            (header->pixel_size != BMP_PIXEL_SIZE && header->pixel_size != 4) ||
+            header->width == 0 || header->height == 0 ||
+            header->stride < (uint64_t) header->width * header->pixel_size ||
+            st.st_size < SIDECAR_HEADER_SIZE + (off_t) header->stride * header->height ||
+            header->source_size != image_st->st_size ||
+            header->source_mtime_ns != mtime_ns(image_st)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return map;
+}
+
+
+int open_sidecar(const char *image_path, Image *image,
+                 unsigned char hash[SHA256_SIZE]) {
+    struct stat image_st;
+    char path[MAX_SIDECAR_PATH];
+    size_t size;
+    memset(image, 0, sizeof(*image));
+    if (stat(image_path, &image_st) < 0) {
+        return -1;
+    }
+    sidecar_path(image_path, path, sizeof(path));
+    SidecarHeader *header = map_sidecar(path, &image_st, &size);
+    if (header == NULL) {
+        return -1;
+    }
+    image->header = malloc(BMP_HEADER_SIZE);
+    if (image->header == NULL) {
+        munmap(header, size);
+        return -1;
+    }
+    image->width = header->width;
+    image->height = header->height;
+    image->stride = header->stride;
+    image->pixel_size = header->pixel_size;
+    image->bottom_up = 0;
+    image->pixels = (unsigned char *) header + SIDECAR_HEADER_SIZE;
+    image->header_size = BMP_HEADER_SIZE;
+    init_bitmap_header(image->header, image->width, image->height);
+    image->mapping = header;
+    image->mapping_size = size;
+    if (hash != NULL) {
+        memcpy(hash, header->hash, SHA256_SIZE);
+    }
+    return 0;
+}
+
+
+void remove_sidecar(const char *image_path) {
+    char path[MAX_SIDECAR_PATH];
+    sidecar_path(image_path, path, sizeof(path));
+    unlink(path);
+}
+
+
+int scan_sidecars(const char *dir) {
+    if ((mkdir(CACHE_DIR, 0755) < 0 && errno != EEXIST) ||
+            (mkdir(SIDECAR_DIR, 0755) < 0 && errno != EEXIST)) {
+        perror(SIDECAR_DIR);
+        return 0;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror(dir);
+        return 0;
+    }
+    int made = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char image_path[MAXLINE];
+        char path[MAX_SIDECAR_PATH];
+        struct stat image_st;
+        size_t size;
+        snprintf(image_path, sizeof(image_path), "%s%s", dir, entry->d_name);
+        if (stat(image_path, &image_st) < 0 || !S_ISREG(image_st.st_mode)) {
+            continue;
+        }
+        sidecar_path(image_path, path, sizeof(path));
+        SidecarHeader *header = map_sidecar(path, &image_st, &size);
+        if (header != NULL) {
+            int current = header->pixel_size == sidecar_pixel_size;
+            munmap(header, size);
+            if (current) {
+                continue;
+            }
+        }
+        if (make_sidecar(image_path, NULL) == 0) {
+            made++;
+        }
+    }
+    closedir(d);
+    return made;
+}
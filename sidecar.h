@@ -0,0 +1,90 @@
+#ifndef SIDECAR_H_
+#define SIDECAR_H_
+
+#include <stdint.h>
+
+#include "bitmap.h"
+#include "sha256.h"
+
+// Files the server derives from its images are kept under CACHE_DIR, so
+// they don't show up in the image list. Everything there can be made again,
+// so the directory can be deleted while the server is stopped; the images
+// themselves are in the store (see store.h).
+#define CACHE_DIR "cache/"
+#define SIDECAR_DIR CACHE_DIR "pixels/"
+#define SIDECAR_SUFFIX ".px"
+
+// A sidecar holds an image's pixels in the layout the built-in filters
+// work on, so that they can map it instead of decoding a bitmap:
+//   - a SIDECAR_HEADER_SIZE header (below),
+//   - the rows, top-down, each starting on a SIDECAR_ROW_ALIGN boundary,
+//   - each pixel either BGR or BGR plus a zero padding byte.
+#define SIDECAR_MAGIC "IMGPIX01"
+#define SIDECAR_HEADER_SIZE 128
+#define SIDECAR_ROW_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t pixel_size;                  // 3 or 4.
+    uint64_t source_size;                 // Size and modification time of
+    int64_t source_mtime_ns;              // the bitmap it was made from.
+    unsigned char hash[SHA256_SIZE];      // SHA-256 of that bitmap.
+} SidecarHeader;
+
+
+/*
+ * Set the pixel size of sidecars made from now on: BMP_PIXEL_SIZE for
+ * packed BGR (the default), or 4 to pad each pixel to four bytes.
+ */
+void set_sidecar_pixel_size(int pixel_size);
+
+/*
+ * Copy the pixels of bmp into a new top-down image in out, laid out like a
+ * sidecar. Return 0 on success, or -1 if memory runs out.
+ */
+int convert_to_sidecar_layout(const Image *bmp, Image *out);
+
+/*
+ * Store the stride and pixel size of an image of the given width laid out
+ * like a sidecar.
+ */
+void sidecar_layout(int width, int *stride, int *pixel_size);
+
+/*
+ * Copy the pixels of image, in either layout, into pixels, laid out like a
+ * sidecar (see sidecar_layout).
+ */
+void copy_to_sidecar_layout(const Image *image, unsigned char *pixels);
+
+/*
+ * Make the sidecar for the bitmap at image_path, replacing any old one.
+ * hash is the bitmap's SHA-256 if it is already known, or NULL.
+ * Return 0 on success, or -1 if the image can't be read or the sidecar
+ * can't be written.
+ */
+int make_sidecar(const char *image_path, const unsigned char *hash);
+
+/*
+ * Map the sidecar of the bitmap at image_path into image; the pixels are
+ * read-only, and image gets headers to encode it as a bitmap with. If hash
+ * isn't NULL, the bitmap's SHA-256 is stored there.
+ * Return 0 on success, or -1 if there is no sidecar or it is out of date.
+ */
+int open_sidecar(const char *image_path, Image *image,
+                 unsigned char hash[SHA256_SIZE]);
+
+/*
+ * Remove the sidecar of the bitmap at image_path, if it has one.
+ */
+void remove_sidecar(const char *image_path);
+
+/*
+ * Make sidecars for every bitmap in dir that doesn't have an up-to-date
+ * one with the current pixel size. Return the number made.
+ */
+int scan_sidecars(const char *dir);
+
+#endif /* SIDECAR_H_ */
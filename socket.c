@@ -7,6 +7,7 @@
 #include <sys/socket.h>
 
 #include "socket.h"
+#include "log.h"
 
 /*
  * Initialize a server address associated with the given port.
@@ -29,8 +30,11 @@ struct sockaddr_in *init_server_addr(int port) {
 
 /*
  * Create and setup a socket for a server to listen on.
+ * If reuse_port is non-zero, SO_REUSEPORT is also set so that several
+ * processes can each bind their own listening socket to the same port and
+ * have the kernel load-balance incoming connections between them.
  */
-int setup_server_socket(struct sockaddr_in *self, int num_queue) {
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
@@ -47,6 +51,15 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
         exit(1);
     }
 
+    if (reuse_port) {
+        status = setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+            (const char *) &on, sizeof(on));
+        if (status < 0) {
+            perror("setsockopt");
+            exit(1);
+        }
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
         // bind failed; could be because port is in use.
@@ -74,57 +87,76 @@ int accept_connection(int listenfd) {
     unsigned int peer_len = sizeof(peer);
     peer.sin_family = PF_INET;
 
-    fprintf(stderr, "Waiting for a new connection...\n");
+    log_msg(LOG_DEBUG, "Waiting for a new connection...");
     int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
     if (client_socket < 0) {
         perror("accept");
         return -1;
     } else {
-        fprintf(stderr,
-            "New connection accepted from %s:%d\n",
-            inet_ntoa(peer.sin_addr),
-            ntohs(peer.sin_port));
+        log_connection(&peer);
         return client_socket;
     }
 }
 
 
+void log_connection(const struct sockaddr_in *peer) {
+    log_msg(LOG_INFO,
+        "New connection accepted from %s:%d",
+        inet_ntoa(peer->sin_addr),
+        ntohs(peer->sin_port));
+}
+
+
 /******************************************************************************
  * Client-specific functions
  *****************************************************************************/
 /*
- * Create a socket and connect to the server indicated by the port and hostname
+ * Create a socket and connect to the server indicated by the port and hostname.
+ * Return the socket, or -1 if the server couldn't be reached.
+ * Unlike gethostbyname, getaddrinfo is safe to use from several threads.
  */
-int connect_to_server(int port, const char *hostname) {
-    int soc = socket(PF_INET, SOCK_STREAM, 0);
-    if (soc < 0) {
-        perror("socket");
-        exit(1);
-    }
-    struct sockaddr_in addr;
-
+int try_connect_to_server(int port, const char *hostname) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
     // Allow sockets across machines.
-    addr.sin_family = PF_INET;
-    // The port the server will be listening on.
-    addr.sin_port = htons(port);
-    // Clear this field; sin_zero is used for padding for the struct.
-    memset(&(addr.sin_zero), 0, 8);
+    hints.ai_family = PF_INET;
+    hints.ai_socktype = SOCK_STREAM;
 
     // Lookup host IP address.
-    struct hostent *hp = gethostbyname(hostname);
-    if (hp == NULL) {
-        fprintf(stderr, "unknown host %s\n", hostname);
-        exit(1);
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo *res;
+    int status = getaddrinfo(hostname, service, &hints, &res);
+    if (status != 0) {
+        fprintf(stderr, "unknown host %s: %s\n", hostname, gai_strerror(status));
+        return -1;
     }
 
-    addr.sin_addr = *((struct in_addr *) hp->h_addr);
+    int soc = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (soc < 0) {
+        perror("socket");
+        freeaddrinfo(res);
+        return -1;
+    }
 
     // Request connection to server.
-    if (connect(soc, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if (connect(soc, res->ai_addr, res->ai_addrlen) == -1) {
         perror("connect");
-        exit(1);
+        close(soc);
+        soc = -1;
     }
-
+    freeaddrinfo(res);
     return soc;
 }
 
+
+/*
+ * Create a socket and connect to the server indicated by the port and hostname
+ */
+int connect_to_server(int port, const char *hostname) {
+    int soc = try_connect_to_server(port, hostname);
+    if (soc < 0) {
+        exit(1);
+    }
+    return soc;
+}
@@ -6,9 +6,12 @@
 #define MAX_HOSTNAME 256
 
 struct sockaddr_in *init_server_addr(int port);
-int setup_server_socket(struct sockaddr_in *self, int num_queue);
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port);
 int accept_connection(int listenfd);
+// Log a connection accepted from peer, as accept_connection does.
+void log_connection(const struct sockaddr_in *peer);
 
 int connect_to_server(int port, const char *hostname);
+int try_connect_to_server(int port, const char *hostname);
 
 #endif
@@ -0,0 +1,285 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "request.h"
+#include "log.h"
+
+#define TMP_SUFFIX ".tmp"
+
+
+/*
+ * Write the path of the blob with the given hash into buf, relative to the
+ * server's directory if dir is BLOB_DIR or to the image directory if it is
+ * BLOB_LINK_DIR.
+ */
+static void blob_path(const char *dir, const unsigned char hash[SHA256_SIZE],
+                      char *buf, size_t size) {
+    char hex[SHA256_HEX_SIZE];
+    sha256_hex(hash, hex);
+    snprintf(buf, size, "%s%s%s", dir, hex, BLOB_SUFFIX);
+}
+
+
+/*
+ * Hash the file at path. Return 0 on success, or -1 if it can't be read.
+ */
+static int hash_file(const char *path, unsigned char hash[SHA256_SIZE]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    Sha256 ctx;
+    sha256_init(&ctx);
+    unsigned char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        sha256_update(&ctx, buf, n);
+    }
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    sha256_final(&ctx, hash);
+    return 0;
+}
+
+
+/*
+ * Point image_path at the blob with the given hash, replacing whatever is
+ * there in one step. Return 0 on success, or -1.
+ */
+static int replace_with_link(const char *image_path,
+                             const unsigned char hash[SHA256_SIZE]) {
+    char target[MAX_BLOB_PATH];
+    char tmp_path[MAXLINE + 32];
+    blob_path(BLOB_LINK_DIR, hash, target, sizeof(target));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d%s", image_path, getpid(), TMP_SUFFIX);
+    if (symlink(target, tmp_path) < 0) {
+        perror(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, image_path) < 0) {
+        perror(image_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Move the regular file at image_path into the store, leaving a link in its
+ * place. Return 0 on success, or -1.
+ */
+static int import_image(const char *image_path) {
+    unsigned char hash[SHA256_SIZE];
+    char path[MAX_BLOB_PATH];
+    if (hash_file(image_path, hash) < 0) {
+        perror(image_path);
+        return -1;
+    }
+    blob_path(BLOB_DIR, hash, path, sizeof(path));
+    // The file stays where it is until the link replaces it, so the image
+    // never disappears, even if this is interrupted.
+    if (link(image_path, path) < 0 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    // The sidecar named after the file is replaced by the blob's.
+    remove_sidecar(image_path);
+    return replace_with_link(image_path, hash);
+}
+
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/*
+ * Remove the blobs in the store that none of the count names in linked
+ * refer to, along with their sidecars, and any temporary files left behind
+ * by uploads that didn't finish. linked must be sorted.
+ */
+static void collect_garbage(char **linked, int count) {
+    DIR *d = opendir(BLOB_DIR);
+    if (d == NULL) {
+        return;
+    }
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char *name = entry->d_name;
+        if (name[0] == '.') {
+            continue;
+        }
+        size_t len = strlen(name);
+        int is_tmp = len > strlen(TMP_SUFFIX) &&
+                     strcmp(name + len - strlen(TMP_SUFFIX), TMP_SUFFIX) == 0;
+        if (!is_tmp && bsearch(&name, linked, count, sizeof(*linked), compare_names) != NULL) {
+            continue;
+        }
+        char path[MAXLINE];
+        snprintf(path, sizeof(path), "%s%s", BLOB_DIR, name);
+        if (unlink(path) == 0) {
+            remove_sidecar(path);
+            removed++;
+        }
+    }
+    closedir(d);
+    if (removed > 0) {
+        log_msg(LOG_INFO, "Removed %d unused blob(s)", removed);
+    }
+}
+
+
+int store_init(const char *image_dir) {
+    if ((mkdir(STORE_DIR, 0755) < 0 && errno != EEXIST) ||
+            (mkdir(BLOB_DIR, 0755) < 0 && errno != EEXIST)) {
+        perror(BLOB_DIR);
+        return -1;
+    }
+    DIR *d = opendir(image_dir);
+    if (d == NULL) {
+        perror(image_dir);
+        return -1;
+    }
+    int imported = 0;
+    char **linked = NULL;
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char image_path[MAXLINE];
+        struct stat st;
+        snprintf(image_path, sizeof(image_path), "%s%s", image_dir, entry->d_name);
+        if (lstat(image_path, &st) < 0) {
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) {
+            if (import_image(image_path) < 0) {
+                continue;
+            }
+            imported++;
+        }
+        char name[MAX_BLOB_PATH];
+        if (store_blob_name(image_path, name, sizeof(name)) < 0) {
+            continue;
+        }
+        char **grown = realloc(linked, (count + 1) * sizeof(*linked));
+        if (grown == NULL || (grown[count] = strdup(name)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        linked = grown;
+        count++;
+    }
+    closedir(d);
+
+    qsort(linked, count, sizeof(*linked), compare_names);
+    collect_garbage(linked, count);
+    for (int i = 0; i < count; i++) {
+        free(linked[i]);
+    }
+    free(linked);
+    return imported;
+}
+
+
+int store_create_upload(char *tmp_path, size_t size) {
+    snprintf(tmp_path, size, "%supload.XXXXXX" TMP_SUFFIX, BLOB_DIR);
+    int fd = mkstemps(tmp_path, strlen(TMP_SUFFIX));
+    if (fd < 0) {
+        perror(tmp_path);
+        return -1;
+    }
+    // Blobs are served and read like the images they replace.
+    fchmod(fd, 0644);
+    return fd;
+}
+
+
+int store_commit_blob(const char *tmp_path, const unsigned char hash[SHA256_SIZE]) {
+    char path[MAX_BLOB_PATH];
+    blob_path(BLOB_DIR, hash, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        unlink(tmp_path);
+        return 0;
+    } else if (rename(tmp_path, path) < 0) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 1;
+}
+
+
+int store_commit_upload(const char *tmp_path, const unsigned char hash[SHA256_SIZE],
+                        const char *image_path) {
+    char target[MAX_BLOB_PATH];
+    blob_path(BLOB_LINK_DIR, hash, target, sizeof(target));
+    // Claim the name first: symlink fails if it was taken while the upload
+    // was arriving, and then the upload is simply dropped. Adding the blob
+    // first would leave it with no name, and it can't be taken back once
+    // added, since another upload may already share it.
+    if (symlink(target, image_path) < 0) {
+        perror(image_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    int added = store_commit_blob(tmp_path, hash);
+    if (added < 0) {
+        unlink(image_path);
+        return -1;
+    }
+    return added;
+}
+
+
+void store_blob_path(const unsigned char hash[SHA256_SIZE], char *buf, size_t size) {
+    blob_path(BLOB_DIR, hash, buf, size);
+}
+
+
+int store_blob_name(const char *image_path, char *buf, size_t size) {
+    if (strncmp(image_path, BLOB_DIR, strlen(BLOB_DIR)) == 0) {
+        snprintf(buf, size, "%s", image_path + strlen(BLOB_DIR));
+        return 0;
+    }
+    char target[MAXLINE];
+    ssize_t len = readlink(image_path, target, sizeof(target) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    target[len] = '\0';
+    if (strncmp(target, BLOB_LINK_DIR, strlen(BLOB_LINK_DIR)) != 0) {
+        return -1;
+    }
+    snprintf(buf, size, "%s", target + strlen(BLOB_LINK_DIR));
+    return 0;
+}
+
+
+int store_blob_hash(const char *image_path, unsigned char hash[SHA256_SIZE]) {
+    char name[MAX_BLOB_PATH];
+    if (store_blob_name(image_path, name, sizeof(name)) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(name + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        hash[i] = byte;
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <stddef.h>
+
+#include "sha256.h"
+#include "sidecar.h"
+
+// Image contents are stored once each, as blobs named after their SHA-256:
+// BLOB_DIR<hex>BLOB_SUFFIX. Each name in the image directory is a symbolic
+// link to the blob holding its contents, so everything derived from an
+// image (its sidecar, cached results) can be keyed by the blob and shared
+// between every name for the same bitmap. The blobs are the only copy of
+// the images, so they are kept out of CACHE_DIR, which can be deleted.
+#define STORE_DIR "store/"
+#define BLOB_DIR STORE_DIR "blobs/"
+#define BLOB_SUFFIX ".bmp"
+// Where BLOB_DIR is relative to the image directory, for the links.
+#define BLOB_LINK_DIR "../" BLOB_DIR
+
+// Room for a blob path: the directory, the hash in hex and the suffix.
+#define MAX_BLOB_PATH (sizeof(BLOB_LINK_DIR) + SHA256_HEX_SIZE + sizeof(BLOB_SUFFIX))
+
+
+/*
+ * Create the blob directory, and move every regular file in image_dir into
+ * the store, leaving a link in its place. Blobs that no name links to are
+ * removed. Return the number of files moved, or -1 if the store can't be
+ * created.
+ */
+int store_init(const char *image_dir);
+
+/*
+ * Create a temporary file in the store for an upload, and write its path
+ * into tmp_path. Return a descriptor open for writing, or -1.
+ */
+int store_create_upload(char *tmp_path, size_t size);
+
+/*
+ * Add the finished upload at tmp_path, whose contents hash to hash, to the
+ * store and link image_path to it. If the store already has those contents,
+ * the upload is discarded.
+ * Return 1 if the contents were new, 0 if they were already stored, or -1
+ * if image_path couldn't be linked (for example, if it exists).
+ */
+int store_commit_upload(const char *tmp_path, const unsigned char hash[SHA256_SIZE],
+                        const char *image_path);
+
+/*
+ * Add the file at tmp_path, whose contents hash to hash, to the store,
+ * discarding it if the store already has those contents.
+ * Return 1 if the contents were new, 0 if they were already stored, or -1.
+ */
+int store_commit_blob(const char *tmp_path, const unsigned char hash[SHA256_SIZE]);
+
+/*
+ * Write the path of the blob with the given hash into buf.
+ */
+void store_blob_path(const unsigned char hash[SHA256_SIZE], char *buf, size_t size);
+
+/*
+ * If image_path is a link into the store, or a blob itself, write the name
+ * of its blob into buf and return 0; otherwise return -1.
+ */
+int store_blob_name(const char *image_path, char *buf, size_t size);
+
+/*
+ * If image_path is a link into the store, or a blob itself, store the hash
+ * of its contents (from the blob's name) in hash and return 0; otherwise
+ * return -1.
+ */
+int store_blob_hash(const char *image_path, unsigned char hash[SHA256_SIZE]);
+
+#endif /* STORE_H_ */
@@ -0,0 +1,139 @@
+#include <time.h>
+
+#include "timer_wheel.h"
+
+
+unsigned long timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (1000 / TIMER_TICK_MS) +
+        ts.tv_nsec / (TIMER_TICK_MS * 1000000L);
+}
+
+
+/*
+ * Make the list head an empty circular list.
+ */
+static void list_init(Timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+
+static void list_add(Timer *head, Timer *t) {
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+
+static void list_del(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+
+void timer_wheel_init(TimerWheel *tw, unsigned long now) {
+    tw->now = now;
+    tw->num_armed = 0;
+    for (int i = 0; i < TIMER_L0_SIZE; i++) {
+        list_init(&tw->level0[i]);
+    }
+    for (int i = 0; i < TIMER_L1_SIZE; i++) {
+        list_init(&tw->level1[i]);
+    }
+}
+
+
+void timer_init(Timer *t) {
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+}
+
+
+/*
+ * Link an unarmed timer into the slot matching its expiry time.
+ */
+static void file_timer(TimerWheel *tw, Timer *t) {
+    if (t->expires <= tw->now) {
+        // Already due: fire on the next tick.
+        t->expires = tw->now + 1;
+    }
+    unsigned long delta = t->expires - tw->now;
+    if (delta < TIMER_L0_SIZE) {
+        list_add(&tw->level0[t->expires & (TIMER_L0_SIZE - 1)], t);
+    } else {
+        unsigned long slot = t->expires >> TIMER_L0_BITS;
+        if (delta >= (unsigned long) TIMER_L0_SIZE * TIMER_L1_SIZE) {
+            // Out of range; park it in the furthest slot for now.
+            slot = (tw->now >> TIMER_L0_BITS) + TIMER_L1_SIZE - 1;
+        }
+        list_add(&tw->level1[slot & (TIMER_L1_SIZE - 1)], t);
+    }
+}
+
+
+void timer_arm(TimerWheel *tw, Timer *t, unsigned long expires) {
+    timer_cancel(tw, t);
+    t->expires = expires;
+    file_timer(tw, t);
+    tw->num_armed++;
+}
+
+
+void timer_cancel(TimerWheel *tw, Timer *t) {
+    if (t->next != NULL) {
+        list_del(t);
+        tw->num_armed--;
+    }
+}
+
+
+/*
+ * Move every timer in the outer slot that the inner level is about to
+ * enter down into the inner level (or back out, if it was parked).
+ */
+static void cascade(TimerWheel *tw) {
+    Timer *head = &tw->level1[(tw->now >> TIMER_L0_BITS) & (TIMER_L1_SIZE - 1)];
+    Timer pending;
+    list_init(&pending);
+    // Detach the whole slot before re-filing its timers.
+    if (head->next != head) {
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        list_init(head);
+    }
+    while (pending.next != &pending) {
+        Timer *t = pending.next;
+        list_del(t);
+        file_timer(tw, t);
+    }
+}
+
+
+void timer_wheel_advance(TimerWheel *tw, unsigned long now,
+                         void (*expire)(Timer *t, void *arg), void *arg) {
+    while (tw->now < now) {
+        tw->now++;
+        if ((tw->now & (TIMER_L0_SIZE - 1)) == 0) {
+            cascade(tw);
+        }
+        Timer *head = &tw->level0[tw->now & (TIMER_L0_SIZE - 1)];
+        while (head->next != head) {
+            Timer *t = head->next;
+            list_del(t);
+            tw->num_armed--;
+            expire(t, arg);
+        }
+        if (tw->num_armed == 0) {
+            // Nothing left to fire; jump straight to the present.
+            tw->now = now;
+        }
+    }
+}
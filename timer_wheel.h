@@ -0,0 +1,76 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stddef.h>
+
+// Length of one tick of the wheel, in milliseconds.
+#define TIMER_TICK_MS 100
+
+// The wheel has two levels: the inner level has one slot per tick, and each
+// slot of the outer level covers a full turn of the inner level. Timers
+// further out than the outer level can reach are parked in its last slot
+// and re-filed when they come around.
+#define TIMER_L0_BITS 8
+#define TIMER_L1_BITS 6
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_L1_SIZE (1 << TIMER_L1_BITS)
+
+
+/*
+ * A timer, embedded in the struct it belongs to (use TIMER_CONTAINER to
+ * get back to that struct when it expires).
+ * A timer is armed while it is linked into a wheel slot (next != NULL).
+ */
+typedef struct timer {
+    struct timer *next;
+    struct timer *prev;
+    unsigned long expires;   // The tick at which the timer fires.
+} Timer;
+
+#define TIMER_CONTAINER(t, type, member) \
+    ((type *) ((char *) (t) - offsetof(type, member)))
+
+typedef struct {
+    unsigned long now;                  // The current tick.
+    int num_armed;
+    Timer level0[TIMER_L0_SIZE];        // List heads; see above.
+    Timer level1[TIMER_L1_SIZE];
+} TimerWheel;
+
+
+/*
+ * Return the current time of the monotonic clock in ticks.
+ */
+unsigned long timer_now(void);
+
+/*
+ * Initialize the wheel with its current time set to the given tick.
+ */
+void timer_wheel_init(TimerWheel *tw, unsigned long now);
+
+/*
+ * Initialize a timer so that it is unarmed.
+ */
+void timer_init(Timer *t);
+
+/*
+ * Arm the timer to fire at the given tick, re-arming it if it is already
+ * armed. Expiry times in the past fire on the next tick. O(1).
+ */
+void timer_arm(TimerWheel *tw, Timer *t, unsigned long expires);
+
+/*
+ * Disarm the timer if it is armed. O(1).
+ */
+void timer_cancel(TimerWheel *tw, Timer *t);
+
+/*
+ * Advance the wheel up to the given tick, calling expire(t, arg) for every
+ * timer that has fired. Each tick only touches the timers in one inner
+ * slot (plus, once per turn, one outer slot being cascaded inwards).
+ * The expire callback may arm or cancel timers, including t itself.
+ */
+void timer_wheel_advance(TimerWheel *tw, unsigned long now,
+                         void (*expire)(Timer *t, void *arg), void *arg);
+
+#endif /* TIMER_WHEEL_H_ */
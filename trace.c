@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+#include "metrics.h"
+#include "response.h"
+#include "reply.h"
+
+#define MAX_TRACE_NAME 32
+
+typedef struct {
+    unsigned long id;
+    int pid;                  // The child that responded.
+    int worker;               // The event loop that accepted the connection.
+    int status;
+    char route[MAX_TRACE_NAME];
+    char filter[MAX_TRACE_NAME];
+    long marks[MARK_COUNT];   // Monotonic nanoseconds, or 0 if not reached.
+} TraceRecord;
+
+// A ring slot is a tiny seqlock: seq is 0 while the record is being
+// written, and afterwards the (1-based) position it was written at, so a
+// reader can tell torn and overwritten records apart from good ones.
+typedef struct {
+    unsigned long seq;
+    TraceRecord record;
+} TraceSlot;
+
+typedef struct {
+    unsigned long requests;   // Requests seen, for sampling.
+    unsigned long head;       // Records written.
+    TraceSlot slots[TRACE_RING_SIZE];
+} TraceRing;
+
+static TraceRing *ring;
+static int sample_every;
+static long slow_ns;
+
+// The request being responded to by this process.
+static TraceRecord current;
+static int sampled;
+
+
+int trace_init(int every, int slow_ms) {
+    sample_every = every;
+    slow_ns = slow_ms * 1000000L;
+    if (sample_every == 0 && slow_ns == 0) {
+        return 0;
+    }
+    void *mem = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    ring = mem;
+    return 0;
+}
+
+
+void trace_request_begin(long accepted_ns, long first_byte_ns, long parsed_ns) {
+    if (ring == NULL) {
+        return;
+    }
+    memset(&current, 0, sizeof(current));
+    current.id = __atomic_add_fetch(&ring->requests, 1, __ATOMIC_RELAXED);
+    current.pid = getpid();
+    current.worker = getppid();
+    current.marks[MARK_ACCEPT] = accepted_ns;
+    current.marks[MARK_FIRST_BYTE] = first_byte_ns;
+    current.marks[MARK_PARSED] = parsed_ns;
+    current.marks[MARK_DISPATCH] = metrics_now_ns();
+    sampled = sample_every > 0 && current.id % sample_every == 0;
+}
+
+
+void trace_mark(int mark) {
+    if (ring != NULL) {
+        current.marks[mark] = metrics_now_ns();
+    }
+}
+
+
+void trace_response_bytes(void) {
+    if (ring == NULL) {
+        return;
+    }
+    long now = metrics_now_ns();
+    if (current.marks[MARK_FIRST_RESPONSE_BYTE] == 0) {
+        current.marks[MARK_FIRST_RESPONSE_BYTE] = now;
+    }
+    current.marks[MARK_LAST_BYTE] = now;
+}
+
+
+void trace_set_filter(const char *filter) {
+    if (ring != NULL) {
+        strncpy(current.filter, filter, MAX_TRACE_NAME - 1);
+    }
+}
+
+
+void trace_request_end(const char *route, int status) {
+    if (ring == NULL) {
+        return;
+    }
+    long end = current.marks[MARK_LAST_BYTE];
+    if (end == 0) {
+        end = metrics_now_ns();
+    }
+    if (!sampled && (slow_ns == 0 || end - current.marks[MARK_ACCEPT] < slow_ns)) {
+        return;
+    }
+    strncpy(current.route, route, MAX_TRACE_NAME - 1);
+    current.status = status;
+
+    unsigned long pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    TraceSlot *slot = &ring->slots[pos % TRACE_RING_SIZE];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->record = current;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * Chrome trace-event JSON
+ *****************************************************************************/
+
+// Spans drawn for each request, between pairs of marks. Each request is
+// drawn on its own track, and the spans nest by time.
+static const struct {
+    const char *name;
+    int from;
+    int to;
+} spans[] = {
+    {"wait for first byte", MARK_ACCEPT, MARK_FIRST_BYTE},
+    {"read start line", MARK_FIRST_BYTE, MARK_PARSED},
+    {"queue", MARK_PARSED, MARK_DISPATCH},
+    {"prepare response", MARK_DISPATCH, MARK_FIRST_RESPONSE_BYTE},
+    {"filter", MARK_FILTER_START, MARK_FILTER_END},
+    {"decode", MARK_FILTER_START, MARK_DECODED},
+    {"kernel", MARK_DECODED, MARK_KERNEL_DONE},
+    {"encode", MARK_KERNEL_DONE, MARK_FILTER_END},
+    {"send", MARK_FIRST_RESPONSE_BYTE, MARK_LAST_BYTE},
+};
+
+
+static void write_span(FILE *out, int *first, const TraceRecord *r,
+                       const char *name, long from, long to) {
+    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,"
+            "\"ts\":%.3f,\"dur\":%.3f", *first ? "" : ",", name, r->worker,
+            r->id, from / 1e3, (to - from) / 1e3);
+    *first = 0;
+}
+
+
+static void write_record(FILE *out, int *first, const TraceRecord *r) {
+    long start = r->marks[MARK_ACCEPT];
+    long end = 0;
+    for (int m = 0; m < MARK_COUNT; m++) {
+        if (r->marks[m] > end) {
+            end = r->marks[m];
+        }
+    }
+    write_span(out, first, r, "request", start, end);
+    fprintf(out, ",\"args\":{\"route\":\"%s\",\"status\":%d,\"filter\":\"%s\","
+            "\"child\":%d}}", r->route, r->status, r->filter, r->pid);
+
+    for (int s = 0; s < sizeof(spans) / sizeof(spans[0]); s++) {
+        long from = r->marks[spans[s].from];
+        long to = r->marks[spans[s].to];
+        if (from != 0 && to >= from) {
+            write_span(out, first, r, spans[s].name, from, to);
+            fprintf(out, "}");
+        }
+    }
+}
+
+
+void trace_response(int fd) {
+    if (ring == NULL) {
+        not_found_response(fd);
+        return;
+    }
+    char *body;
+    size_t body_len;
+    FILE *out = open_memstream(&body, &body_len);
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    int first = 1;
+    for (int i = 0; i < TRACE_RING_SIZE; i++) {
+        TraceSlot *slot = &ring->slots[i];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) {
+            continue;
+        }
+        TraceRecord r = slot->record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;   // Overwritten while we were copying it.
+        }
+        write_record(out, &first, &r);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    metrics_note_status(200);
+    Reply reply;
+    reply_init(&reply, fd);
+    reply_printf(&reply, "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Disposition: attachment; filename=\"trace.json\"\r\n"
+            "Content-Length: %zu\r\n\r\n", body_len);
+    reply_add(&reply, body, body_len);
+    reply_send(&reply, 0);
+    free(body);
+}
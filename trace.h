@@ -0,0 +1,69 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#define TRACE "/trace"
+
+// Number of request traces kept; older ones are overwritten.
+#define TRACE_RING_SIZE 1024
+
+// Points in the life of a request that are timestamped when it is traced.
+// Decode, kernel and encode are only marked by filters that run in-process;
+// for an external filter, only its start and end are known.
+enum {
+    MARK_ACCEPT,
+    MARK_FIRST_BYTE,             // First bytes read from the client.
+    MARK_PARSED,                 // Start line parsed.
+    MARK_DISPATCH,               // Child forked to respond.
+    MARK_FILTER_START,
+    MARK_DECODED,
+    MARK_KERNEL_DONE,
+    MARK_FILTER_END,             // Output encoded.
+    MARK_FIRST_RESPONSE_BYTE,
+    MARK_LAST_BYTE,
+    MARK_COUNT
+};
+
+
+/*
+ * Map the shared trace ring. Like metrics_init, this must be called before
+ * forking. sample_every traces one in that many requests (0 disables
+ * sampling), and requests slower than slow_ms milliseconds are always traced
+ * (0 disables this); if both are 0, tracing is off.
+ * Return 0 on success, or -1 on failure.
+ */
+int trace_init(int sample_every, int slow_ms);
+
+/*
+ * Start tracing the request being responded to by this (child) process,
+ * given the times of the marks made by the event loop.
+ */
+void trace_request_begin(long accepted_ns, long first_byte_ns, long parsed_ns);
+
+/*
+ * Timestamp the given point of the current request.
+ */
+void trace_mark(int mark);
+
+/*
+ * Note that response bytes have just been written to the client.
+ */
+void trace_response_bytes(void);
+
+/*
+ * Note the filter used by the current request.
+ */
+void trace_set_filter(const char *filter);
+
+/*
+ * Finish the current request, and record it in the trace ring if it was
+ * sampled or slow.
+ */
+void trace_request_end(const char *route, int status);
+
+/*
+ * Write the traces in the ring to fd as an HTTP response holding Chrome
+ * trace-event JSON, which can be opened in chrome://tracing or Perfetto.
+ */
+void trace_response(int fd);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tuner.h"
+#include "log.h"
+#include "sidecar.h"
+
+#define MAX_PROFILE_LINE 256
+
+// Runs of each candidate; the fastest one counts.
+#define TUNE_RUNS 3
+
+static KernelParams params[KERNEL_COUNT];
+static int params_ready;
+
+
+/*
+ * Write a description of this machine's CPUs and caches into buf, so that
+ * a profile made elsewhere is noticed.
+ */
+static void describe_machine(char *buf, size_t size) {
+    char model[128] = "unknown";
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo != NULL) {
+        char line[MAX_PROFILE_LINE];
+        while (fgets(line, sizeof(line), cpuinfo) != NULL) {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+                snprintf(model, sizeof(model), "%s", colon + 2);
+                model[strcspn(model, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(cpuinfo);
+    }
+    snprintf(buf, size, "cpus=%ld l1d=%ld l2=%ld l3=%ld model=%s",
+             sysconf(_SC_NPROCESSORS_ONLN), sysconf(_SC_LEVEL1_DCACHE_SIZE),
+             sysconf(_SC_LEVEL2_CACHE_SIZE), sysconf(_SC_LEVEL3_CACHE_SIZE), model);
+}
+
+
+/*
+ * Read the parameters from the profile at path.
+ * Return 0 on success, or -1 if it is missing, for another machine, or
+ * doesn't cover every kernel.
+ */
+static int read_profile(const char *path, const char *machine) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char line[MAX_PROFILE_LINE];
+    int matched = 0;
+    int found = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#') {
+            continue;
+        }
+        if (strncmp(line, "machine ", 8) == 0) {
+            matched = strcmp(line + 8, machine) == 0;
+            continue;
+        }
+        char kernel[64];
+        char variant[16];
+        KernelParams p;
+        if (sscanf(line, "%63s variant=%15s tile_rows=%d tile_cols=%d threads=%d",
+                   kernel, variant, &p.tile_rows, &p.tile_cols, &p.threads) != 5) {
+            continue;
+        }
+        int k = find_kernel(kernel);
+        p.variant = find_variant(variant);
+        if (k >= 0 && variant_supported(p.variant) && p.tile_rows > 0 &&
+                p.tile_cols >= 0 && p.threads > 0) {
+            params[k] = p;
+            found |= 1 << k;
+        }
+    }
+    fclose(in);
+    return matched && found == (1 << KERNEL_COUNT) - 1 ? 0 : -1;
+}
+
+
+static void write_profile(const char *path, const char *machine) {
+    char tmp_path[MAX_PROFILE_LINE];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        return;
+    }
+    fprintf(out, "# Kernel parameters chosen by image_server; delete to recalibrate.\n");
+    fprintf(out, "machine %s\n", machine);
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        fprintf(out, "%s variant=%s tile_rows=%d tile_cols=%d threads=%d\n",
+                kernel_name(k), variant_name(params[k].variant),
+                params[k].tile_rows, params[k].tile_cols, params[k].threads);
+    }
+    // Replace the old profile only once the new one is complete.
+    if (fclose(out) != 0 || rename(tmp_path, path) < 0) {
+        perror(path);
+        unlink(tmp_path);
+    }
+}
+
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * Return the fastest time in nanoseconds of TUNE_RUNS runs of the kernel
+ * with the given parameters, after one run to warm up.
+ */
+static long time_kernel(int kernel, const Image *src, Image *dst,
+                        const KernelParams *p) {
+    long best = -1;
+    for (int i = 0; i <= TUNE_RUNS; i++) {
+        long start = now_ns();
+        run_kernel(kernel, src, dst, p);
+        long elapsed = now_ns() - start;
+        if (i > 0 && (best < 0 || elapsed < best)) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+
+/*
+ * Try p on the kernel, and keep it as the best parameters if it is faster.
+ */
+static void try_params(int kernel, const Image *src, Image *dst,
+                       KernelParams p, long *best_ns) {
+    long ns = time_kernel(kernel, src, dst, &p);
+    if (ns < *best_ns) {
+        *best_ns = ns;
+        params[kernel] = p;
+    }
+}
+
+
+/*
+ * Search for the fastest parameters for each kernel, one dimension at a
+ * time: the variant, then the tile shape, then the number of threads.
+ */
+static void calibrate(void) {
+    static const int tile_rows[] = {4, 16, 64, 256};
+    static const int tile_cols[] = {0, 256, 1024};
+    Image bmp, src, dst;
+    if (create_bitmap(&bmp, TUNE_WIDTH, TUNE_HEIGHT) < 0) {
+        fprintf(stderr, "Not enough memory to calibrate the kernels\n");
+        return;
+    }
+    // Something like a photo: smooth gradients with some fine detail.
+    for (int y = 0; y < bmp.height; y++) {
+        unsigned char *row = bmp.pixels + (size_t) bmp.stride * y;
+        for (int x = 0; x < bmp.width; x++) {
+            row[BMP_PIXEL_SIZE * x] = x * 255 / bmp.width;
+            row[BMP_PIXEL_SIZE * x + 1] = y * 255 / bmp.height;
+            row[BMP_PIXEL_SIZE * x + 2] = (x * 7) ^ (y * 13);
+        }
+    }
+    // Calibrate on the layout that the kernels will see in sidecars.
+    int converted = convert_to_sidecar_layout(&bmp, &src);
+    free_bitmap(&bmp);
+    if (converted < 0 || create_bitmap_like(&dst, &src) < 0) {
+        fprintf(stderr, "Not enough memory to calibrate the kernels\n");
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        long best_ns = time_kernel(k, &src, &dst, &params[k]);
+        KernelParams p = params[k];
+        for (int v = 0; v < VARIANT_COUNT; v++) {
+            if (variant_supported(v)) {
+                p.variant = v;
+                try_params(k, &src, &dst, p, &best_ns);
+            }
+        }
+        p = params[k];
+        for (int r = 0; r < sizeof(tile_rows) / sizeof(tile_rows[0]); r++) {
+            for (int c = 0; c < sizeof(tile_cols) / sizeof(tile_cols[0]); c++) {
+                p.tile_rows = tile_rows[r];
+                p.tile_cols = tile_cols[c];
+                try_params(k, &src, &dst, p, &best_ns);
+            }
+        }
+        p = params[k];
+        for (int threads = 2; threads <= cpus; threads *= 2) {
+            p.threads = threads;
+            try_params(k, &src, &dst, p, &best_ns);
+        }
+        log_msg(LOG_INFO, "Calibrated %s: %.2f ms for %dx%d",
+                kernel_name(k), best_ns / 1e6, TUNE_WIDTH, TUNE_HEIGHT);
+    }
+    free_bitmap(&src);
+    free_bitmap(&dst);
+}
+
+
+void tuner_init(const char *profile_path) {
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        default_kernel_params(&params[k]);
+    }
+    params_ready = 1;
+    if (profile_path == NULL) {
+        return;
+    }
+
+    char machine[MAX_PROFILE_LINE];
+    describe_machine(machine, sizeof(machine));
+    if (read_profile(profile_path, machine) == 0) {
+        log_msg(LOG_INFO, "Kernel parameters read from %s", profile_path);
+    } else {
+        log_msg(LOG_INFO, "Calibrating kernels for %s", machine);
+        for (int k = 0; k < KERNEL_COUNT; k++) {
+            default_kernel_params(&params[k]);
+        }
+        calibrate();
+        write_profile(profile_path, machine);
+    }
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        char cols[32] = "full-width";
+        if (params[k].tile_cols > 0) {
+            snprintf(cols, sizeof(cols), "%d-pixel", params[k].tile_cols);
+        }
+        log_msg(LOG_INFO, "%s: %s variant, %d-row %s tiles, %d thread(s)",
+                kernel_name(k), variant_name(params[k].variant),
+                params[k].tile_rows, cols, params[k].threads);
+    }
+}
+
+
+const KernelParams *tuned_params(int kernel) {
+    if (!params_ready) {
+        tuner_init(NULL);
+    }
+    return &params[kernel];
+}
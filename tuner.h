@@ -0,0 +1,26 @@
+#ifndef TUNER_H_
+#define TUNER_H_
+
+#include "kernels.h"
+
+// Size of the synthetic image the kernels are calibrated on.
+#define TUNE_WIDTH 1920
+#define TUNE_HEIGHT 1080
+
+
+/*
+ * Choose the parameters of the built-in kernels. If profile_path is NULL,
+ * the defaults are used. Otherwise the parameters are read from the profile
+ * at that path; if it is missing, or was made on a machine with different
+ * CPUs or caches, the kernels are calibrated on a synthetic image and the
+ * profile is rewritten with the fastest parameters found.
+ * Must be called before forking, since calibration takes a few seconds.
+ */
+void tuner_init(const char *profile_path);
+
+/*
+ * Return the parameters to run the kernel with.
+ */
+const KernelParams *tuned_params(int kernel);
+
+#endif /* TUNER_H_ */
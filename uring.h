@@ -0,0 +1,90 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring wrapper over the raw system calls, so the server
+// doesn't need liburing. io_uring is optional (-u): uring_probe checks
+// that the kernel has it and supports every operation the server uses,
+// and the server falls back to epoll and plain system calls if not.
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned features;        // IORING_FEAT_* flags of the kernel.
+    // Submission queue.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    // Completion queue.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings, for uring_close.
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+
+/*
+ * Return 1 if io_uring is available and supports every operation used by
+ * the server, 0 otherwise.
+ */
+int uring_probe(void);
+
+/*
+ * Turn the io_uring paths on or off for this process and its children.
+ * They are off unless turned on, and can only be on if uring_probe passes.
+ */
+void uring_set_enabled(int enabled);
+int uring_enabled(void);
+
+/*
+ * Set up a ring with room for the given number of submissions.
+ * Return 0 on success, or -1 with errno set.
+ */
+int uring_init(Uring *ring, unsigned entries);
+
+void uring_close(Uring *ring);
+
+/*
+ * Register count buffers with the ring, for IORING_OP_READ_FIXED and
+ * IORING_OP_WRITE_FIXED; the buffer index of an operation is the index
+ * into bufs. Return 0 on success, or -1.
+ */
+int uring_register_buffers(Uring *ring, const struct iovec *bufs, unsigned count);
+
+/*
+ * Return the next free submission entry, cleared and filled in with the
+ * given operation, descriptor, address, length, offset and user data, or
+ * NULL if the queue is full even after submitting what is in it.
+ */
+struct io_uring_sqe *uring_prep(Uring *ring, int op, int fd, const void *addr,
+                                unsigned len, unsigned long offset,
+                                unsigned long user_data);
+
+/*
+ * Submit the prepared entries, and wait until at least wait_nr completions
+ * are available, or for at most timeout_ms milliseconds if that isn't -1.
+ * Return the number submitted, or -1 with errno set: ETIME if the wait
+ * timed out, or EINTR if a signal arrived (entries not yet submitted then
+ * go with the next call).
+ */
+int uring_submit(Uring *ring, unsigned wait_nr, int timeout_ms);
+
+/*
+ * Return the oldest unconsumed completion, or NULL if there is none. Call
+ * uring_seen once done with it.
+ */
+struct io_uring_cqe *uring_peek(Uring *ring);
+void uring_seen(Uring *ring);
+
+#endif /* URING_H_ */
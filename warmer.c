@@ -0,0 +1,307 @@
+#define _GNU_SOURCE  // SCHED_IDLE, pipe2
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "warmer.h"
+#include "store.h"
+#include "results.h"
+#include "response.h"
+#include "request.h"
+#include "metrics.h"
+#include "log.h"
+
+// The filters offered by main.html.
+static const char *warm_filters[] = {"copy", "greyscale", "gaussian_blur", "edge_detection"};
+#define WARM_FILTER_COUNT (sizeof(warm_filters) / sizeof(warm_filters[0]))
+#define ALL_TRIED ((1u << WARM_FILTER_COUNT) - 1)
+
+typedef struct {
+    char blob[MAX_BLOB_PATH];     // Empty if the entry is free.
+    char image_path[MAXLINE];     // A name linked to the blob.
+    unsigned long requests;       // Filter requests, halved as they age.
+    int uploaded;
+    unsigned tried;               // Bit i is set once warm_filters[i] has run.
+} WarmEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WarmEntry entries[WARM_TABLE_SIZE];
+} WarmTable;
+
+static WarmTable *table;
+
+// The warmer watches the read end; it sees the pipe close when the server
+// exits.
+static int exit_pipe[2];
+
+
+int warmer_init(void) {
+    void *mem = mmap(NULL, sizeof(WarmTable), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    table = mem;
+    // Robust, since any child that notes a request can be killed while
+    // holding the lock.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+
+static void lock_table(void) {
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&table->lock);
+    }
+}
+
+
+/*
+ * Return the entry for blob, reusing the least requested one if there is
+ * no free entry. The table must be locked.
+ */
+static WarmEntry *find_entry(const char *blob) {
+    WarmEntry *victim = NULL;
+    for (int i = 0; i < WARM_TABLE_SIZE; i++) {
+        WarmEntry *e = &table->entries[i];
+        if (strcmp(e->blob, blob) == 0) {
+            return e;
+        }
+        if (victim == NULL || (victim->blob[0] != '\0' &&
+                (e->blob[0] == '\0' || e->requests < victim->requests))) {
+            victim = e;
+        }
+    }
+    memset(victim, 0, sizeof(*victim));
+    strcpy(victim->blob, blob);
+    return victim;
+}
+
+
+static void note_image(const char *image_path, int uploaded) {
+    char blob[MAX_BLOB_PATH];
+    if (table == NULL || strlen(image_path) >= MAXLINE ||
+            store_blob_name(image_path, blob, sizeof(blob)) < 0) {
+        return;
+    }
+    lock_table();
+    WarmEntry *e = find_entry(blob);
+    strcpy(e->image_path, image_path);
+    if (uploaded) {
+        e->uploaded = 1;
+    } else {
+        e->requests++;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+void warmer_note_request(const char *image_path) {
+    note_image(image_path, 0);
+}
+
+
+void warmer_note_upload(const char *image_path) {
+    note_image(image_path, 1);
+}
+
+
+/*
+ * Pick the next image and filter to warm: new uploads first, then the most
+ * requested images, and the first filter not yet run on it. The filter is
+ * marked as tried. Copy the image's path and blob into image_path and blob.
+ * Return the filter's index in warm_filters, or -1 if there is nothing to do.
+ */
+static int pick_work(char *image_path, char *blob) {
+    lock_table();
+    WarmEntry *best = NULL;
+    for (int i = 0; i < WARM_TABLE_SIZE; i++) {
+        WarmEntry *e = &table->entries[i];
+        if (e->blob[0] == '\0' || e->tried == ALL_TRIED ||
+                (!e->uploaded && e->requests < WARM_MIN_REQUESTS)) {
+            continue;
+        }
+        if (best == NULL || e->uploaded > best->uploaded ||
+                (e->uploaded == best->uploaded && e->requests > best->requests)) {
+            best = e;
+        }
+    }
+    int filter = -1;
+    if (best != NULL) {
+        filter = __builtin_ctz(~best->tried);
+        best->tried |= 1u << filter;
+        strcpy(image_path, best->image_path);
+        strcpy(blob, best->blob);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return filter;
+}
+
+
+/*
+ * Mark the filter as not yet run on blob, so it is picked again.
+ */
+static void untry(const char *blob, int filter) {
+    lock_table();
+    for (int i = 0; i < WARM_TABLE_SIZE; i++) {
+        if (strcmp(table->entries[i].blob, blob) == 0) {
+            table->entries[i].tried &= ~(1u << filter);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+/*
+ * Halve every request count, so that popularity reflects recent requests.
+ */
+static void decay_requests(void) {
+    lock_table();
+    for (int i = 0; i < WARM_TABLE_SIZE; i++) {
+        table->entries[i].requests /= 2;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+/*
+ * Return 1 if the server has requests to respond to, 0 otherwise.
+ */
+static int server_busy(void) {
+    return metrics_gauge(GAUGE_RUNNING_CHILDREN) > 0 ||
+           metrics_gauge(GAUGE_QUEUED_JOBS) > 0;
+}
+
+
+/*
+ * Run filter on the image at image_path and store the result, in a child
+ * process that is killed as soon as the server gets busy.
+ * Return 1 if the result was stored, 0 if the filter failed, or -1 if the
+ * run was preempted.
+ */
+static int warm_one(const char *image_path, const char *filter) {
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    } else if (pid == 0) {
+        // In its own process group, so that a filter program it runs is
+        // killed along with it.
+        setpgid(0, 0);
+        int result_fd = run_named_filter(filter, image_path);
+        exit(result_fd >= 0 && save_result(image_path, filter, result_fd) == 0 ? 0 : 1);
+    }
+    setpgid(pid, pid);
+    while (1) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (server_busy()) {
+            kill(-pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            discard_partial_result(image_path, filter, pid);
+            return -1;
+        }
+        usleep(WARM_CHECK_MS * 1000);
+    }
+}
+
+
+/*
+ * The warmer's main loop. Exits when the server does.
+ */
+static void run_warmer(void) {
+    struct pollfd exit_poll = {exit_pipe[0], POLLIN, 0};
+    long last_busy = metrics_now_ns();
+    long last_decay = last_busy;
+    while (poll(&exit_poll, 1, WARM_POLL_MS) == 0) {
+        long now = metrics_now_ns();
+        if (now - last_decay >= WARM_DECAY_SEC * 1000000000L) {
+            decay_requests();
+            last_decay = now;
+        }
+        if (server_busy()) {
+            last_busy = now;
+            continue;
+        }
+        if (now - last_busy < WARM_IDLE_MS * 1000000L) {
+            continue;
+        }
+
+        char image_path[MAXLINE];
+        char blob[MAX_BLOB_PATH];
+        int filter;
+        while ((filter = pick_work(image_path, blob)) >= 0) {
+            int result_fd = open_result(image_path, warm_filters[filter]);
+            if (result_fd >= 0) {
+                close(result_fd);
+                continue;
+            }
+            int warmed = warm_one(image_path, warm_filters[filter]);
+            if (warmed < 0) {
+                untry(blob, filter);
+                metrics_add(COUNTER_WARM_PREEMPTED, 1);
+                last_busy = metrics_now_ns();
+                break;
+            } else if (warmed > 0) {
+                metrics_add(COUNTER_WARMED, 1);
+                log_msg(LOG_DEBUG, "Warmed %s of %s", warm_filters[filter], image_path);
+            }
+            if (poll(&exit_poll, 1, 0) != 0) {
+                break;
+            }
+        }
+    }
+    exit(0);
+}
+
+
+void warmer_start(void) {
+    if (table == NULL) {
+        return;
+    }
+    if (pipe2(exit_pipe, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return;
+    }
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return;
+    } else if (pid == 0) {
+        // Fork again and let the middle process exit, so that the warmer
+        // isn't a child of the event loop, which counts every child it
+        // reaps as a finished request.
+        if (fork() != 0) {
+            exit(0);
+        }
+        close(exit_pipe[1]);
+        struct sched_param param = {0};
+        if (sched_setscheduler(0, SCHED_IDLE, &param) < 0) {
+            perror("sched_setscheduler");
+        }
+        setpriority(PRIO_PROCESS, 0, 19);
+        log_msg(LOG_INFO, "Warmer [%d] started", getpid());
+        run_warmer();
+    }
+    waitpid(pid, NULL, 0);
+    close(exit_pipe[0]);
+}
@@ -0,0 +1,40 @@
+#ifndef WARMER_H_
+#define WARMER_H_
+
+// The warmer runs the filters offered by main.html on images that are
+// likely to be asked for next, while the server is idle, and stores the
+// results (see results.h). Images are picked from access statistics kept
+// in shared memory: new uploads first, then the images requested most
+// often recently.
+//
+// It runs in its own process under SCHED_IDLE and at nice 19, and
+// only while no requests are being responded to or queued. A run still in
+// progress when a request arrives is killed and retried later.
+
+#define WARM_TABLE_SIZE 256       // Images tracked at once.
+#define WARM_MIN_REQUESTS 2       // Requests before an image is warmed.
+#define WARM_POLL_MS 50           // How often an idle warmer looks for work.
+#define WARM_IDLE_MS 200          // Idle time before warming starts.
+#define WARM_CHECK_MS 1           // How often a run checks for requests.
+#define WARM_DECAY_SEC 60         // Request counts are halved this often.
+
+
+/*
+ * Map the shared access statistics. This must be called before any
+ * processes are forked. Return 0 on success, or -1 (nothing is then
+ * tracked).
+ */
+int warmer_init(void);
+
+/*
+ * Start the warmer process. It exits when the calling process does.
+ */
+void warmer_start(void);
+
+/*
+ * Record a filter request for, or the upload of, the image at image_path.
+ */
+void warmer_note_request(const char *image_path);
+void warmer_note_upload(const char *image_path);
+
+#endif /* WARMER_H_ */